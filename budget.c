@@ -0,0 +1,271 @@
+/*
+ * Syscall and heap allocation accounting for the transfer loop.
+ *
+ * Syscalls are counted with a seccomp user notification filter: the kernel
+ * stops the filtered thread on every syscall and hands it to a supervisor
+ * thread, which counts it and lets it continue unchanged. The supervisor is
+ * created before the filter is installed so that it is not filtered itself,
+ * and it must not take any lock the stopped thread could hold, which rules
+ * out stdio and malloc.
+ *
+ * Allocations are counted by interposing the glibc malloc entry points,
+ * when built with BUDGET_ALLOCS=1 (-DSPIDEV_BUDGET_ALLOCS). Otherwise the
+ * process keeps the plain allocator and only syscalls are counted.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "budget.h"
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int      s_listener = -1;
+static pid_t    s_tid      = 0;
+static int      s_counting = 0;
+static uint64_t s_syscalls = 0;
+static int      s_recent[BUDGET_RECENT];
+
+#if defined(__GLIBC__) && defined(SPIDEV_BUDGET_ALLOCS)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static __thread uint64_t t_allocs;
+
+/*
+ * The wrappers replace the allocator of the whole process, so outside of
+ * budget_start()..budget_stop() they only forward.
+ */
+static void count_alloc(void)
+{
+    if (__atomic_load_n(&s_counting, __ATOMIC_RELAXED))
+    {
+        t_allocs++;
+    }
+}
+
+void *malloc(size_t size)
+{
+    count_alloc();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    count_alloc();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t bytes;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    count_alloc();
+    return __libc_realloc(ptr, bytes);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    count_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    count_alloc();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+    {
+        return EINVAL;
+    }
+
+    count_alloc();
+    if ((ptr = __libc_memalign(alignment, size)) == NULL)
+    {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    count_alloc();
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+    count_alloc();
+    return __libc_pvalloc(size);
+}
+#endif
+static void *supervise(void *arg)
+{
+    struct seccomp_notif      notif;
+    struct seccomp_notif_resp resp;
+    int                       listener;
+
+    (void)arg;
+
+    while ((listener = __atomic_load_n(&s_listener, __ATOMIC_ACQUIRE)) < 0)
+    {
+        usleep(100);
+    }
+
+    while (1)
+    {
+        memset(&notif, 0, sizeof(notif));
+        if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, &notif) < 0)
+        {
+            if (errno == EINTR || errno == ENOENT)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if ((pid_t)notif.pid == s_tid && __atomic_load_n(&s_counting, __ATOMIC_RELAXED))
+        {
+            s_recent[s_syscalls % BUDGET_RECENT] = notif.data.nr;
+            __atomic_store_n(&s_syscalls, s_syscalls + 1, __ATOMIC_RELEASE);
+        }
+
+        memset(&resp, 0, sizeof(resp));
+        resp.id    = notif.id;
+        resp.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+
+        // ENOENT: the syscall was interrupted by a signal in the meantime.
+        ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+    }
+
+    return NULL;
+}
+
+int budget_start(void)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    };
+    struct sock_fprog prog = {
+        .len    = sizeof(filter) / sizeof(filter[0]),
+        .filter = filter,
+    };
+    pthread_t thread;
+    sigset_t  all;
+    sigset_t  old;
+    int       listener;
+    int       ret;
+
+    s_tid = (pid_t)syscall(SYS_gettid);
+
+    // Signals must keep going to the filtered thread, not the supervisor.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&thread, NULL, supervise, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0)
+    {
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+    {
+        return -1;
+    }
+
+    listener = (int)syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+    if (listener < 0)
+    {
+        // The supervisor keeps polling for a listener; it costs nothing.
+        return -1;
+    }
+
+    __atomic_store_n(&s_counting, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s_listener, listener, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void budget_read(struct budget_counts *counts)
+{
+    counts->syscalls = __atomic_load_n(&s_syscalls, __ATOMIC_ACQUIRE);
+#if defined(__GLIBC__) && defined(SPIDEV_BUDGET_ALLOCS)
+    counts->allocs = t_allocs;
+#else
+    counts->allocs = 0;
+#endif
+}
+
+/*
+ * Copy the numbers of the syscalls made since the `since` count, oldest
+ * first, as far as they are still in the history. Returns how many.
+ */
+int budget_recent(uint64_t since, int *nrs, int max)
+{
+    uint64_t now = __atomic_load_n(&s_syscalls, __ATOMIC_ACQUIRE);
+    int      n   = 0;
+
+    if (now - since > BUDGET_RECENT)
+    {
+        since = now - BUDGET_RECENT;
+    }
+
+    for (uint64_t i = since; i < now && n < max; i++)
+    {
+        nrs[n++] = s_recent[i % BUDGET_RECENT];
+    }
+
+    return n;
+}
+
+int budget_allocs_counted(void)
+{
+#if defined(__GLIBC__) && defined(SPIDEV_BUDGET_ALLOCS)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void budget_stop(void)
+{
+    __atomic_store_n(&s_counting, 0, __ATOMIC_RELAXED);
+}
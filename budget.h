@@ -0,0 +1,34 @@
+/*
+ * Syscall and heap allocation accounting for the transfer loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_BUDGET_H
+#define SPIDEV_BUDGET_H
+
+#include <stdint.h>
+
+#define BUDGET_RECENT 32
+
+struct budget_counts
+{
+    uint64_t syscalls;
+    uint64_t allocs;
+};
+
+/*
+ * budget_start() installs a seccomp filter on the calling thread that
+ * reports each of its syscalls to a supervisor thread. The filter cannot be
+ * removed again: budget_stop() only stops the counting, and every later
+ * syscall of the thread still takes the detour through the supervisor.
+ */
+int  budget_start(void);
+void budget_read(struct budget_counts *counts);
+int  budget_recent(uint64_t since, int *nrs, int max);
+int  budget_allocs_counted(void);
+void budget_stop(void);
+
+#endif // SPIDEV_BUDGET_H
@@ -0,0 +1,1760 @@
+/*
+ * Recording and reading of timestamped SPI transaction captures.
+ *
+ * The text format has a header line followed by one transaction per line:
+ *
+ *   # spidev_test capture v1 mode=0x00
+ *   <t_ns> <speed_hz> <delay_us> <bits> <tx hex> <rx hex or ->
+ *
+ * The indexed format is meant for long recordings. All integers are stored
+ * little endian:
+ *
+ *   file header   "SPICAP1\0", mode, 7 reserved bytes
+ *   block         magic "BLK1", encoding, record count, payload size,
+ *                 t_min, t_max, then the records
+ *   record        t_ns, speed_hz, delay_us, bits, flags, len, tx[, rx]
+ *   index         one entry per block: offset, t_min, t_max, record count
+ *   footer        index offset, block count, reserved, "SPIIDX1\0"
+ *
+ * Blocks are written once they reach BLOCK_TARGET_SIZE, so a reader can
+ * skip whole blocks by time from the index and scan the remaining ones in
+ * parallel. A file whose footer is missing (the recorder was killed) is
+ * still readable by walking the block headers.
+ *
+ * Delta blocks store each record against one of the last DELTA_SLOTS
+ * distinct frames of the same block:
+ *
+ *   record        tag, varint time delta to the previous record,
+ *                 [varint speed_hz, varint delay_us, bits]   if DELTA_PARAMS
+ *                 [varint len, tx[, rx]]                     if DELTA_LITERAL
+ *                 [tx xor stream][, rx xor stream]           otherwise
+ *   xor stream    (varint zero run, varint literal length, literal bytes)
+ *                 repeated until the frame length is covered; the literal
+ *                 bytes are the XOR against the reference frame
+ *
+ * The first record of a block is always literal and the history starts
+ * empty in every block, so each block is a keyframe for random access.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "capture.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define CAPTURE_TEXT_MAGIC "# spidev_test capture v1"
+#define CAPTURE_FILE_MAGIC "SPICAP1"
+#define CAPTURE_INDEX_MAGIC "SPIIDX1"
+#define CAPTURE_BLOCK_MAGIC 0x314b4c42 // "BLK1"
+
+#define FILE_HEADER_SIZE 16
+#define BLOCK_HEADER_SIZE 32
+#define RECORD_HEADER_SIZE 20
+#define INDEX_ENTRY_SIZE 32
+#define FOOTER_SIZE 24
+
+#define BLOCK_TARGET_SIZE (64 * 1024)
+#define QUERY_MAX_THREADS 64
+
+#define RECORD_FLAG_RX 0x01
+
+enum block_encoding
+{
+    BLOCK_ENCODING_RAW   = 0,
+    BLOCK_ENCODING_DELTA = 1,
+};
+
+#define DELTA_SLOTS 8
+#define DELTA_SLOT_MASK 0x07
+#define DELTA_LITERAL 0x08
+#define DELTA_RX_SAME 0x10
+#define DELTA_TX_SAME 0x20
+#define DELTA_RX 0x40
+#define DELTA_PARAMS 0x80
+
+struct delta_slot
+{
+    uint8_t *tx;
+    uint8_t *rx;
+    uint32_t size;
+    uint32_t len;
+    uint32_t speed_hz;
+    uint16_t delay_us;
+    uint8_t  bits;
+    uint8_t  has_rx;
+};
+
+/*
+ * History of distinct frames shared by the delta encoder and decoder. Both
+ * sides apply the same insertion rule, so slot numbers agree.
+ */
+struct delta_state
+{
+    struct delta_slot slots[DELTA_SLOTS];
+    struct delta_slot scratch;
+    uint32_t          used;
+    uint32_t          next;
+    uint64_t          prev_t_ns;
+};
+
+struct block_info
+{
+    uint64_t offset;
+    uint64_t t_min;
+    uint64_t t_max;
+    uint32_t count;
+};
+
+struct block_cursor
+{
+    const uint8_t      *p;
+    const uint8_t      *end;
+    uint32_t            remaining;
+    uint32_t            encoding;
+    struct delta_state *delta;
+};
+
+struct capture_writer
+{
+    enum capture_format format;
+    FILE               *fp;
+    char               *line;
+    size_t              line_size;
+
+    uint32_t            encoding;
+    struct delta_state *delta;
+    uint8_t            *block;
+    size_t              block_len;
+    size_t              block_size;
+    uint32_t            block_records;
+    uint64_t            block_t_min;
+    uint64_t            block_t_max;
+    uint64_t            offset;
+    struct block_info  *index;
+    uint32_t            index_count;
+    uint32_t            index_size;
+};
+
+struct capture_reader
+{
+    enum capture_format format;
+    uint8_t             mode;
+
+    FILE    *fp;
+    char    *line;
+    size_t   line_size;
+    uint8_t *tx;
+    uint8_t *rx;
+    uint32_t buf_size;
+
+    const uint8_t      *map;
+    size_t              map_size;
+    struct block_info  *blocks;
+    uint32_t            block_count;
+    uint32_t            next_block;
+    struct block_cursor cursor;
+};
+
+static const char s_hex_digits[] = "0123456789abcdef";
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int hex_value(char c)
+{
+    if ('0' <= c && c <= '9')
+    {
+        return c - '0';
+    }
+    else if ('a' <= c && c <= 'f')
+    {
+        return 10 + (c - 'a');
+    }
+    else if ('A' <= c && c <= 'F')
+    {
+        return 10 + (c - 'A');
+    }
+
+    return -1;
+}
+
+static char *format_hex(char *out, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        *out++ = s_hex_digits[data[i] >> 4];
+        *out++ = s_hex_digits[data[i] & 0xf];
+    }
+
+    return out;
+}
+
+static size_t text_line_size(uint32_t len)
+{
+    return 64 + 4 * (size_t)len;
+}
+
+/*
+ * Format one record as a text capture line into `out`, which must hold at
+ * least text_line_size() bytes. Returns the line length.
+ */
+static size_t format_text_record(char *out, const struct capture_record *record)
+{
+    char *p = out;
+
+    p += sprintf(p, "%" PRIu64 " %u %u %u ", record->t_ns, record->speed_hz, record->delay_us, record->bits);
+    p = format_hex(p, record->tx, record->len);
+    *p++ = ' ';
+
+    if (record->rx != NULL)
+    {
+        p = format_hex(p, record->rx, record->len);
+    }
+    else
+    {
+        *p++ = '-';
+    }
+
+    *p++ = '\n';
+
+    return (size_t)(p - out);
+}
+
+static int parse_hex_field(const char *field, size_t field_len, uint8_t *out, uint32_t len)
+{
+    if (field_len != (size_t)len * 2)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        int hi = hex_value(field[2 * i]);
+        int lo = hex_value(field[2 * i + 1]);
+
+        if (hi < 0 || lo < 0)
+        {
+            return -1;
+        }
+
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return 0;
+}
+
+static int grow(void **buf, size_t *size, size_t needed, size_t elem_size)
+{
+    size_t new_size = (*size == 0) ? 16 : *size;
+    void  *p;
+
+    if (needed <= *size)
+    {
+        return 0;
+    }
+
+    while (new_size < needed)
+    {
+        new_size *= 2;
+    }
+
+    if ((p = realloc(*buf, new_size * elem_size)) == NULL)
+    {
+        return -1;
+    }
+
+    *buf  = p;
+    *size = new_size;
+    return 0;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+
+    for (uint32_t shift = 0; p < end && shift < 64; shift += 7)
+    {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+
+        if ((*p++ & 0x80) == 0)
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static void delta_reset(struct delta_state *state, uint64_t t_ns)
+{
+    state->used      = 0;
+    state->next      = 0;
+    state->prev_t_ns = t_ns;
+}
+
+static void delta_release(struct delta_state *state)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < DELTA_SLOTS; i++)
+    {
+        free(state->slots[i].tx);
+    }
+
+    free(state->scratch.tx);
+    free(state);
+}
+
+/*
+ * Make room for a frame of `len` bytes. TX and RX share one allocation,
+ * each followed by CAPTURE_PATTERN_MAX bytes so that pattern matching may
+ * read whole vector lanes past the end of a decoded frame.
+ */
+static int delta_slot_reserve(struct delta_slot *slot, uint32_t len)
+{
+    uint8_t *p;
+
+    if (len <= slot->size && slot->tx != NULL)
+    {
+        return 0;
+    }
+
+    if ((p = calloc(1, 2 * ((size_t)len + CAPTURE_PATTERN_MAX))) == NULL)
+    {
+        return -1;
+    }
+
+    free(slot->tx);
+    slot->tx   = p;
+    slot->rx   = p + len + CAPTURE_PATTERN_MAX;
+    slot->size = len;
+    return 0;
+}
+
+/*
+ * Move the scratch slot into the history, recycling the oldest slot as the
+ * next scratch buffer. Returns the slot now holding the frame.
+ */
+static const struct delta_slot *delta_commit(struct delta_state *state)
+{
+    struct delta_slot victim = state->slots[state->next];
+    uint32_t          slot   = state->next;
+
+    state->slots[slot] = state->scratch;
+    state->scratch     = victim;
+    state->next        = (state->next + 1) % DELTA_SLOTS;
+
+    if (state->used < DELTA_SLOTS)
+    {
+        state->used++;
+    }
+
+    return &state->slots[slot];
+}
+
+/*
+ * Pick the reference for a frame: the most recent slot with identical TX
+ * data, otherwise the most recent slot of the same length. Returns -1 when
+ * the frame has to be stored as a literal.
+ */
+static int delta_find_reference(const struct delta_state *state, const struct capture_record *record)
+{
+    int candidate = -1;
+
+    for (uint32_t i = 0; i < state->used; i++)
+    {
+        uint32_t                 slot = (state->next + DELTA_SLOTS - 1 - i) % DELTA_SLOTS;
+        const struct delta_slot *ref  = &state->slots[slot];
+
+        if (ref->len != record->len)
+        {
+            continue;
+        }
+
+        if (memcmp(ref->tx, record->tx, record->len) == 0)
+        {
+            return (int)slot;
+        }
+
+        if (candidate < 0)
+        {
+            candidate = (int)slot;
+        }
+    }
+
+    return candidate;
+}
+
+static uint8_t *put_xor_stream(uint8_t *p, const uint8_t *data, const uint8_t *ref, uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (i < len)
+    {
+        uint32_t zeros = i;
+        uint32_t end;
+
+        while (zeros < len && data[zeros] == ref[zeros])
+        {
+            zeros++;
+        }
+
+        // A literal run only ends at two equal bytes in a row; a single one is cheaper to keep inline.
+        for (end = zeros; end < len; end++)
+        {
+            if (data[end] == ref[end] && (end + 1 == len || data[end + 1] == ref[end + 1]))
+            {
+                break;
+            }
+        }
+
+        p = put_varint(p, zeros - i);
+        p = put_varint(p, end - zeros);
+
+        for (uint32_t j = zeros; j < end; j++)
+        {
+            *p++ = data[j] ^ ref[j];
+        }
+
+        i = end;
+    }
+
+    return p;
+}
+
+static const uint8_t *get_xor_stream(const uint8_t *p, const uint8_t *end, uint8_t *out, const uint8_t *ref,
+                                     uint32_t len)
+{
+    uint32_t i = 0;
+
+    while (i < len)
+    {
+        uint64_t zeros, literal;
+
+        if ((p = get_varint(p, end, &zeros)) == NULL || (p = get_varint(p, end, &literal)) == NULL ||
+            zeros > len - i || literal > len - i - zeros || literal > (uint64_t)(end - p))
+        {
+            return NULL;
+        }
+
+        memcpy(out + i, ref + i, zeros);
+        i += (uint32_t)zeros;
+
+        for (uint64_t j = 0; j < literal; j++, i++)
+        {
+            out[i] = ref[i] ^ *p++;
+        }
+    }
+
+    return p;
+}
+
+static void delta_slot_set_params(struct delta_slot *slot, const struct capture_record *record)
+{
+    slot->len      = record->len;
+    slot->speed_hz = record->speed_hz;
+    slot->delay_us = record->delay_us;
+    slot->bits     = record->bits;
+    slot->has_rx   = (record->rx != NULL);
+}
+
+/*
+ * Append one delta-encoded record at `p`, which must have room for
+ * delta_record_max_size() bytes. Returns the new end of the block, or NULL
+ * when the history could not be updated.
+ */
+static uint8_t *delta_encode(struct delta_state *state, const struct capture_record *record, uint8_t *p)
+{
+    int                      slot = delta_find_reference(state, record);
+    const struct delta_slot *ref  = (slot >= 0) ? &state->slots[slot] : NULL;
+    uint8_t                 *tag  = p++;
+    int                      same;
+
+    *tag = (record->rx != NULL) ? DELTA_RX : 0;
+    p    = put_varint(p, record->t_ns - state->prev_t_ns);
+
+    state->prev_t_ns = record->t_ns;
+
+    if (ref == NULL || ref->speed_hz != record->speed_hz || ref->delay_us != record->delay_us ||
+        ref->bits != record->bits)
+    {
+        *tag |= DELTA_PARAMS;
+        p    = put_varint(p, record->speed_hz);
+        p    = put_varint(p, record->delay_us);
+        *p++ = record->bits;
+    }
+
+    if (ref == NULL)
+    {
+        *tag |= DELTA_LITERAL;
+        p = put_varint(p, record->len);
+        memcpy(p, record->tx, record->len);
+        p += record->len;
+
+        if (record->rx != NULL)
+        {
+            memcpy(p, record->rx, record->len);
+            p += record->len;
+        }
+    }
+    else
+    {
+        *tag |= (uint8_t)slot;
+
+        if (memcmp(ref->tx, record->tx, record->len) == 0)
+        {
+            *tag |= DELTA_TX_SAME;
+        }
+        else
+        {
+            p = put_xor_stream(p, record->tx, ref->tx, record->len);
+        }
+
+        if (record->rx != NULL)
+        {
+            // The RX area of a slot without receive data is zeroed, so it works as a reference too.
+            if (ref->has_rx && memcmp(ref->rx, record->rx, record->len) == 0)
+            {
+                *tag |= DELTA_RX_SAME;
+            }
+            else
+            {
+                p = put_xor_stream(p, record->rx, ref->rx, record->len);
+            }
+        }
+    }
+
+    same = (*tag & (DELTA_LITERAL | DELTA_PARAMS | DELTA_TX_SAME)) == DELTA_TX_SAME &&
+           ((*tag & DELTA_RX) ? (*tag & DELTA_RX_SAME) != 0 : !ref->has_rx);
+
+    if (!same)
+    {
+        if (delta_slot_reserve(&state->scratch, record->len) < 0)
+        {
+            return NULL;
+        }
+
+        memcpy(state->scratch.tx, record->tx, record->len);
+        memset(state->scratch.rx, 0, record->len);
+
+        if (record->rx != NULL)
+        {
+            memcpy(state->scratch.rx, record->rx, record->len);
+        }
+
+        delta_slot_set_params(&state->scratch, record);
+        delta_commit(state);
+    }
+
+    return p;
+}
+
+static size_t delta_record_max_size(uint32_t len)
+{
+    // Tag, time, parameters and length varints, then two worst-case XOR streams.
+    return 48 + 2 * (2 * (size_t)len + 10);
+}
+
+static int delta_decode(struct delta_state *state, struct block_cursor *cursor, struct capture_record *record)
+{
+    const uint8_t           *p   = cursor->p;
+    const uint8_t           *end = cursor->end;
+    const struct delta_slot *ref = NULL;
+    const struct delta_slot *out;
+    struct delta_slot       *next = &state->scratch;
+    uint64_t                 dt, value;
+    uint8_t                  tag;
+
+    if (p >= end)
+    {
+        return -1;
+    }
+
+    tag = *p++;
+
+    if ((p = get_varint(p, end, &dt)) == NULL)
+    {
+        return -1;
+    }
+
+    if (!(tag & DELTA_LITERAL))
+    {
+        if ((tag & DELTA_SLOT_MASK) >= state->used)
+        {
+            return -1;
+        }
+
+        ref                = &state->slots[tag & DELTA_SLOT_MASK];
+        record->speed_hz   = ref->speed_hz;
+        record->delay_us   = ref->delay_us;
+        record->bits       = ref->bits;
+        record->len        = ref->len;
+    }
+
+    if (tag & DELTA_PARAMS)
+    {
+        if ((p = get_varint(p, end, &value)) == NULL)
+        {
+            return -1;
+        }
+        record->speed_hz = (uint32_t)value;
+
+        if ((p = get_varint(p, end, &value)) == NULL || p >= end)
+        {
+            return -1;
+        }
+        record->delay_us = (uint16_t)value;
+        record->bits     = *p++;
+    }
+    else if (ref == NULL)
+    {
+        return -1;
+    }
+
+    state->prev_t_ns += dt;
+    record->t_ns = state->prev_t_ns;
+
+    if (ref != NULL && (tag & (DELTA_PARAMS | DELTA_TX_SAME)) == DELTA_TX_SAME &&
+        ((tag & DELTA_RX) ? (tag & DELTA_RX_SAME) != 0 : !ref->has_rx))
+    {
+        // Identical to the reference: nothing to decode and the history is unchanged.
+        out = ref;
+    }
+    else
+    {
+        if (ref == NULL)
+        {
+            if ((p = get_varint(p, end, &value)) == NULL || value > UINT32_MAX)
+            {
+                return -1;
+            }
+            record->len = (uint32_t)value;
+        }
+
+        if (delta_slot_reserve(next, record->len) < 0)
+        {
+            return -1;
+        }
+
+        if (ref == NULL)
+        {
+            if ((uint64_t)(end - p) < (uint64_t)record->len * ((tag & DELTA_RX) ? 2 : 1))
+            {
+                return -1;
+            }
+
+            memcpy(next->tx, p, record->len);
+            p += record->len;
+            memset(next->rx, 0, record->len);
+
+            if (tag & DELTA_RX)
+            {
+                memcpy(next->rx, p, record->len);
+                p += record->len;
+            }
+        }
+        else
+        {
+            if (tag & DELTA_TX_SAME)
+            {
+                memcpy(next->tx, ref->tx, record->len);
+            }
+            else if ((p = get_xor_stream(p, end, next->tx, ref->tx, record->len)) == NULL)
+            {
+                return -1;
+            }
+
+            memset(next->rx, 0, record->len);
+
+            if ((tag & DELTA_RX) && (tag & DELTA_RX_SAME))
+            {
+                memcpy(next->rx, ref->rx, record->len);
+            }
+            else if ((tag & DELTA_RX) && (p = get_xor_stream(p, end, next->rx, ref->rx, record->len)) == NULL)
+            {
+                return -1;
+            }
+        }
+
+        delta_slot_set_params(next, record);
+        out = delta_commit(state);
+    }
+
+    record->tx = out->tx;
+    record->rx = (tag & DELTA_RX) ? out->rx : NULL;
+    cursor->p  = p;
+    return 1;
+}
+
+static int flush_block(struct capture_writer *writer)
+{
+    uint8_t            header[BLOCK_HEADER_SIZE];
+    struct block_info *info;
+    size_t             index_size = writer->index_size;
+
+    if (writer->block_records == 0)
+    {
+        return 0;
+    }
+
+    put_le32(header, CAPTURE_BLOCK_MAGIC);
+    put_le32(header + 4, writer->encoding);
+    put_le32(header + 8, writer->block_records);
+    put_le32(header + 12, (uint32_t)writer->block_len);
+    put_le64(header + 16, writer->block_t_min);
+    put_le64(header + 24, writer->block_t_max);
+
+    if (fwrite(header, 1, sizeof(header), writer->fp) != sizeof(header) ||
+        fwrite(writer->block, 1, writer->block_len, writer->fp) != writer->block_len)
+    {
+        return -1;
+    }
+
+    if (grow((void **)&writer->index, &index_size, writer->index_count + 1, sizeof(*writer->index)) < 0)
+    {
+        return -1;
+    }
+    writer->index_size = (uint32_t)index_size;
+
+    info         = &writer->index[writer->index_count++];
+    info->offset = writer->offset;
+    info->t_min  = writer->block_t_min;
+    info->t_max  = writer->block_t_max;
+    info->count  = writer->block_records;
+
+    writer->offset += BLOCK_HEADER_SIZE + writer->block_len;
+    writer->block_len     = 0;
+    writer->block_records = 0;
+    return 0;
+}
+
+static int write_indexed(struct capture_writer *writer, const struct capture_record *record)
+{
+    size_t   size = RECORD_HEADER_SIZE + (size_t)record->len * (record->rx != NULL ? 2 : 1);
+    uint8_t *p;
+
+    if (writer->encoding == BLOCK_ENCODING_DELTA)
+    {
+        size = delta_record_max_size(record->len);
+    }
+
+    if (grow((void **)&writer->block, &writer->block_size, writer->block_len + size, 1) < 0)
+    {
+        return -1;
+    }
+
+    if (writer->block_records == 0)
+    {
+        writer->block_t_min = record->t_ns;
+
+        if (writer->delta != NULL)
+        {
+            delta_reset(writer->delta, record->t_ns);
+        }
+    }
+
+    writer->block_t_max = record->t_ns;
+    writer->block_records++;
+
+    p = writer->block + writer->block_len;
+
+    if (writer->encoding == BLOCK_ENCODING_DELTA)
+    {
+        if ((p = delta_encode(writer->delta, record, p)) == NULL)
+        {
+            return -1;
+        }
+
+        writer->block_len = (size_t)(p - writer->block);
+        return (writer->block_len >= BLOCK_TARGET_SIZE) ? flush_block(writer) : 0;
+    }
+
+    put_le64(p, record->t_ns);
+    put_le32(p + 8, record->speed_hz);
+    put_le16(p + 12, record->delay_us);
+    p[14] = record->bits;
+    p[15] = (record->rx != NULL) ? RECORD_FLAG_RX : 0;
+    put_le32(p + 16, record->len);
+    memcpy(p + RECORD_HEADER_SIZE, record->tx, record->len);
+
+    if (record->rx != NULL)
+    {
+        memcpy(p + RECORD_HEADER_SIZE + record->len, record->rx, record->len);
+    }
+
+    writer->block_len += size;
+
+    return (writer->block_len >= BLOCK_TARGET_SIZE) ? flush_block(writer) : 0;
+}
+
+struct capture_writer *capture_writer_open(const char *path, uint8_t mode, enum capture_format format)
+{
+    struct capture_writer *writer;
+    uint8_t                header[FILE_HEADER_SIZE] = {0};
+
+    if ((writer = calloc(1, sizeof(*writer))) == NULL)
+    {
+        return NULL;
+    }
+
+    writer->format   = (format == CAPTURE_FORMAT_TEXT) ? CAPTURE_FORMAT_TEXT : CAPTURE_FORMAT_INDEXED;
+    writer->encoding = (format == CAPTURE_FORMAT_DELTA) ? BLOCK_ENCODING_DELTA : BLOCK_ENCODING_RAW;
+
+    if (writer->encoding == BLOCK_ENCODING_DELTA && (writer->delta = calloc(1, sizeof(*writer->delta))) == NULL)
+    {
+        free(writer);
+        return NULL;
+    }
+
+    if ((writer->fp = fopen(path, "w")) == NULL)
+    {
+        delta_release(writer->delta);
+        free(writer);
+        return NULL;
+    }
+
+    if (format == CAPTURE_FORMAT_TEXT)
+    {
+        fprintf(writer->fp, CAPTURE_TEXT_MAGIC " mode=0x%02x\n", mode);
+    }
+    else
+    {
+        memcpy(header, CAPTURE_FILE_MAGIC, sizeof(CAPTURE_FILE_MAGIC));
+        header[8] = mode;
+
+        if (fwrite(header, 1, sizeof(header), writer->fp) != sizeof(header))
+        {
+            capture_writer_close(writer);
+            return NULL;
+        }
+
+        writer->offset = FILE_HEADER_SIZE;
+    }
+
+    return writer;
+}
+
+int capture_write(struct capture_writer *writer, const struct capture_record *record)
+{
+    size_t len;
+
+    if (writer->format == CAPTURE_FORMAT_INDEXED)
+    {
+        return write_indexed(writer, record);
+    }
+
+    if (grow((void **)&writer->line, &writer->line_size, text_line_size(record->len), 1) < 0)
+    {
+        return -1;
+    }
+
+    len = format_text_record(writer->line, record);
+
+    return (fwrite(writer->line, 1, len, writer->fp) == len) ? 0 : -1;
+}
+
+static int write_index(struct capture_writer *writer)
+{
+    uint8_t entry[INDEX_ENTRY_SIZE] = {0};
+    uint8_t footer[FOOTER_SIZE]     = {0};
+
+    if (flush_block(writer) < 0)
+    {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < writer->index_count; i++)
+    {
+        put_le64(entry, writer->index[i].offset);
+        put_le64(entry + 8, writer->index[i].t_min);
+        put_le64(entry + 16, writer->index[i].t_max);
+        put_le32(entry + 24, writer->index[i].count);
+
+        if (fwrite(entry, 1, sizeof(entry), writer->fp) != sizeof(entry))
+        {
+            return -1;
+        }
+    }
+
+    put_le64(footer, writer->offset);
+    put_le32(footer + 8, writer->index_count);
+    memcpy(footer + 16, CAPTURE_INDEX_MAGIC, sizeof(CAPTURE_INDEX_MAGIC));
+
+    return (fwrite(footer, 1, sizeof(footer), writer->fp) == sizeof(footer)) ? 0 : -1;
+}
+
+int capture_writer_close(struct capture_writer *writer)
+{
+    int ret = 0;
+
+    if (writer == NULL)
+    {
+        return 0;
+    }
+
+    if (writer->format == CAPTURE_FORMAT_INDEXED && write_index(writer) < 0)
+    {
+        ret = -1;
+    }
+
+    if (fclose(writer->fp) != 0)
+    {
+        ret = -1;
+    }
+
+    delta_release(writer->delta);
+    free(writer->line);
+    free(writer->block);
+    free(writer->index);
+    free(writer);
+    return ret;
+}
+
+/*
+ * Position `cursor` at the first record of a block. The cursor must start
+ * zeroed; it keeps its delta history buffers across blocks until
+ * block_cursor_release().
+ */
+static int block_cursor_init(struct block_cursor *cursor, const uint8_t *map, size_t map_size,
+                             const struct block_info *info)
+{
+    const uint8_t *header;
+    uint32_t       size;
+
+    // The offset comes from the file, which may be corrupt or truncated.
+    if (info->offset < FILE_HEADER_SIZE || info->offset > map_size || map_size - info->offset < BLOCK_HEADER_SIZE ||
+        get_le32(map + info->offset) != CAPTURE_BLOCK_MAGIC)
+    {
+        return -1;
+    }
+
+    header = map + info->offset;
+    size   = get_le32(header + 12);
+
+    cursor->p         = header + BLOCK_HEADER_SIZE;
+    cursor->end       = (info->offset + BLOCK_HEADER_SIZE + size <= map_size) ? cursor->p + size : cursor->p;
+    cursor->remaining = info->count;
+    cursor->encoding  = get_le32(header + 4);
+
+    if (cursor->encoding == BLOCK_ENCODING_DELTA)
+    {
+        if (cursor->delta == NULL && (cursor->delta = calloc(1, sizeof(*cursor->delta))) == NULL)
+        {
+            return -1;
+        }
+
+        delta_reset(cursor->delta, get_le64(header + 16));
+    }
+    else if (cursor->encoding != BLOCK_ENCODING_RAW)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void block_cursor_release(struct block_cursor *cursor)
+{
+    delta_release(cursor->delta);
+    cursor->delta = NULL;
+}
+
+static int block_cursor_next(struct block_cursor *cursor, struct capture_record *record)
+{
+    const uint8_t *p = cursor->p;
+    size_t         size;
+
+    if (cursor->remaining == 0)
+    {
+        return 0;
+    }
+
+    if (cursor->encoding == BLOCK_ENCODING_DELTA)
+    {
+        cursor->remaining--;
+        return delta_decode(cursor->delta, cursor, record);
+    }
+
+    if (cursor->end - p < RECORD_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    record->t_ns     = get_le64(p);
+    record->speed_hz = get_le32(p + 8);
+    record->delay_us = get_le16(p + 12);
+    record->bits     = p[14];
+    record->len      = get_le32(p + 16);
+    size             = RECORD_HEADER_SIZE + (size_t)record->len * ((p[15] & RECORD_FLAG_RX) ? 2 : 1);
+
+    if ((size_t)(cursor->end - p) < size)
+    {
+        return -1;
+    }
+
+    record->tx = p + RECORD_HEADER_SIZE;
+    record->rx = (p[15] & RECORD_FLAG_RX) ? record->tx + record->len : NULL;
+
+    cursor->p += size;
+    cursor->remaining--;
+    return 1;
+}
+
+/*
+ * Read the block index from the footer, or rebuild it from the block
+ * headers when the capture was not closed properly.
+ */
+static int load_index(const uint8_t *map, size_t map_size, struct block_info **blocks, uint32_t *block_count)
+{
+    const uint8_t *footer = map + map_size - FOOTER_SIZE;
+    size_t         size   = 0;
+    uint64_t       offset;
+
+    *blocks      = NULL;
+    *block_count = 0;
+
+    if (map_size >= FILE_HEADER_SIZE + FOOTER_SIZE &&
+        memcmp(footer + 16, CAPTURE_INDEX_MAGIC, sizeof(CAPTURE_INDEX_MAGIC)) == 0)
+    {
+        uint64_t index_offset = get_le64(footer);
+        uint32_t count        = get_le32(footer + 8);
+        uint32_t i;
+
+        if (index_offset >= FILE_HEADER_SIZE && index_offset <= map_size &&
+            index_offset + (uint64_t)count * INDEX_ENTRY_SIZE + FOOTER_SIZE == map_size)
+        {
+            if ((*blocks = calloc(count ? count : 1, sizeof(**blocks))) == NULL)
+            {
+                return -1;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                const uint8_t *entry = map + index_offset + (size_t)i * INDEX_ENTRY_SIZE;
+
+                (*blocks)[i].offset = get_le64(entry);
+                (*blocks)[i].t_min  = get_le64(entry + 8);
+                (*blocks)[i].t_max  = get_le64(entry + 16);
+                (*blocks)[i].count  = get_le32(entry + 24);
+
+                if ((*blocks)[i].offset < FILE_HEADER_SIZE ||
+                    (*blocks)[i].offset + BLOCK_HEADER_SIZE > index_offset)
+                {
+                    break;
+                }
+            }
+
+            if (i == count)
+            {
+                *block_count = count;
+                return 0;
+            }
+
+            // A block outside the data: do not trust the index, rebuild it from the headers.
+            free(*blocks);
+            *blocks = NULL;
+        }
+    }
+
+    for (offset = FILE_HEADER_SIZE; offset + BLOCK_HEADER_SIZE <= map_size;)
+    {
+        const uint8_t *header = map + offset;
+        uint32_t       payload;
+
+        if (get_le32(header) != CAPTURE_BLOCK_MAGIC)
+        {
+            break;
+        }
+
+        payload = get_le32(header + 12);
+        if (offset + BLOCK_HEADER_SIZE + payload > map_size)
+        {
+            break;
+        }
+
+        if (grow((void **)blocks, &size, *block_count + 1, sizeof(**blocks)) < 0)
+        {
+            return -1;
+        }
+
+        (*blocks)[*block_count].offset = offset;
+        (*blocks)[*block_count].count  = get_le32(header + 8);
+        (*blocks)[*block_count].t_min  = get_le64(header + 16);
+        (*blocks)[*block_count].t_max  = get_le64(header + 24);
+        (*block_count)++;
+
+        offset += BLOCK_HEADER_SIZE + payload;
+    }
+
+    return 0;
+}
+
+static int map_file(const char *path, const uint8_t **map, size_t *map_size)
+{
+    struct stat st;
+    void       *p;
+    int         fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < FILE_HEADER_SIZE)
+    {
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    *map      = p;
+    *map_size = (size_t)st.st_size;
+    return 0;
+}
+
+static int is_indexed_capture(const uint8_t *map, size_t map_size)
+{
+    return map_size >= FILE_HEADER_SIZE && memcmp(map, CAPTURE_FILE_MAGIC, sizeof(CAPTURE_FILE_MAGIC)) == 0;
+}
+
+static int open_indexed(struct capture_reader *reader, const char *path)
+{
+    if (map_file(path, &reader->map, &reader->map_size) < 0)
+    {
+        return -1;
+    }
+
+    if (!is_indexed_capture(reader->map, reader->map_size))
+    {
+        munmap((void *)reader->map, reader->map_size);
+        reader->map = NULL;
+        return -1;
+    }
+
+    madvise((void *)reader->map, reader->map_size, MADV_SEQUENTIAL);
+
+    reader->format = CAPTURE_FORMAT_INDEXED;
+    reader->mode   = reader->map[8];
+
+    return load_index(reader->map, reader->map_size, &reader->blocks, &reader->block_count);
+}
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+    struct capture_reader *reader;
+    const char            *mode;
+
+    if ((reader = calloc(1, sizeof(*reader))) == NULL)
+    {
+        return NULL;
+    }
+
+    if (open_indexed(reader, path) == 0)
+    {
+        return reader;
+    }
+
+    if (reader->map != NULL || (reader->fp = fopen(path, "r")) == NULL)
+    {
+        capture_reader_close(reader);
+        return NULL;
+    }
+
+    if (getline(&reader->line, &reader->line_size, reader->fp) < 0 ||
+        strncmp(reader->line, CAPTURE_TEXT_MAGIC, strlen(CAPTURE_TEXT_MAGIC)) != 0)
+    {
+        capture_reader_close(reader);
+        return NULL;
+    }
+
+    if ((mode = strstr(reader->line, "mode=")) != NULL)
+    {
+        reader->mode = (uint8_t)strtoul(mode + strlen("mode="), NULL, 0);
+    }
+
+    reader->format = CAPTURE_FORMAT_TEXT;
+    return reader;
+}
+
+static int reserve_buffers(struct capture_reader *reader, uint32_t len)
+{
+    uint8_t *tx;
+    uint8_t *rx;
+
+    if (len <= reader->buf_size)
+    {
+        return 0;
+    }
+
+    if ((tx = realloc(reader->tx, len)) == NULL)
+    {
+        return -1;
+    }
+    reader->tx = tx;
+
+    if ((rx = realloc(reader->rx, len)) == NULL)
+    {
+        return -1;
+    }
+    reader->rx = rx;
+
+    reader->buf_size = len;
+    return 0;
+}
+
+static int read_text(struct capture_reader *reader, struct capture_record *record)
+{
+    unsigned long long t_ns;
+    unsigned int       speed, delay, bits;
+    int                consumed;
+    char              *tx, *rx;
+    size_t             tx_len, rx_len;
+
+    do
+    {
+        if (getline(&reader->line, &reader->line_size, reader->fp) < 0)
+        {
+            return 0;
+        }
+    } while (reader->line[0] == '#' || reader->line[0] == '\n');
+
+    if (sscanf(reader->line, "%llu %u %u %u %n", &t_ns, &speed, &delay, &bits, &consumed) != 4)
+    {
+        return -1;
+    }
+
+    tx     = reader->line + consumed;
+    tx_len = strcspn(tx, " \r\n");
+    rx     = tx + tx_len + strspn(tx + tx_len, " ");
+    rx_len = strcspn(rx, " \r\n");
+
+    if ((tx_len & 1) != 0 || reserve_buffers(reader, (uint32_t)(tx_len / 2)) < 0)
+    {
+        return -1;
+    }
+
+    record->t_ns     = t_ns;
+    record->speed_hz = speed;
+    record->delay_us = (uint16_t)delay;
+    record->bits     = (uint8_t)bits;
+    record->len      = (uint32_t)(tx_len / 2);
+    record->tx       = reader->tx;
+    record->rx       = NULL;
+
+    if (parse_hex_field(tx, tx_len, reader->tx, record->len) < 0)
+    {
+        return -1;
+    }
+
+    if (!(rx_len == 1 && rx[0] == '-'))
+    {
+        if (parse_hex_field(rx, rx_len, reader->rx, record->len) < 0)
+        {
+            return -1;
+        }
+        record->rx = reader->rx;
+    }
+
+    return 1;
+}
+
+int capture_read(struct capture_reader *reader, struct capture_record *record)
+{
+    int ret;
+
+    if (reader->format == CAPTURE_FORMAT_TEXT)
+    {
+        return read_text(reader, record);
+    }
+
+    while ((ret = block_cursor_next(&reader->cursor, record)) == 0)
+    {
+        if (reader->next_block >= reader->block_count)
+        {
+            return 0;
+        }
+
+        if (block_cursor_init(&reader->cursor, reader->map, reader->map_size, &reader->blocks[reader->next_block++]) <
+            0)
+        {
+            return -1;
+        }
+    }
+
+    return ret;
+}
+
+uint8_t capture_reader_mode(const struct capture_reader *reader)
+{
+    return reader->mode;
+}
+
+void capture_reader_close(struct capture_reader *reader)
+{
+    if (reader == NULL)
+    {
+        return;
+    }
+
+    if (reader->fp != NULL)
+    {
+        fclose(reader->fp);
+    }
+
+    if (reader->map != NULL)
+    {
+        munmap((void *)reader->map, reader->map_size);
+    }
+
+    block_cursor_release(&reader->cursor);
+    free(reader->blocks);
+    free(reader->line);
+    free(reader->tx);
+    free(reader->rx);
+    free(reader);
+}
+
+int capture_parse_pattern(const char *text, struct capture_pattern *pattern)
+{
+    memset(pattern, 0, sizeof(*pattern));
+
+    while (*text != '\0')
+    {
+        int hi, lo;
+
+        if (*text == ' ')
+        {
+            text++;
+            continue;
+        }
+
+        if (pattern->len == CAPTURE_PATTERN_MAX || text[1] == '\0')
+        {
+            return -1;
+        }
+
+        if (text[0] == '?' && text[1] == '?')
+        {
+            pattern->len++;
+        }
+        else
+        {
+            if ((hi = hex_value(text[0])) < 0 || (lo = hex_value(text[1])) < 0)
+            {
+                return -1;
+            }
+
+            pattern->value[pattern->len] = (uint8_t)((hi << 4) | lo);
+            pattern->mask[pattern->len]  = 0xff;
+            pattern->len++;
+        }
+
+        text += 2;
+    }
+
+    return 0;
+}
+
+typedef uint8_t  pattern_lane __attribute__((vector_size(16)));
+typedef uint64_t pattern_word __attribute__((vector_size(16)));
+
+/*
+ * Compare `data` against the pattern 16 bytes at a time. The compiler lowers
+ * the vector types to SSE2/NEON. Pattern bytes past `len` have a zero mask
+ * and value, so a lane may safely read beyond the record as long as it stays
+ * inside the mapping; otherwise the scalar loop is used.
+ */
+static int pattern_match(const struct capture_pattern *pattern, const uint8_t *data, uint32_t len,
+                         const uint8_t *map_end)
+{
+    uint32_t lanes = (pattern->len + 15) / 16;
+
+    if (pattern->len == 0)
+    {
+        return 1;
+    }
+
+    if (data == NULL || len < pattern->len)
+    {
+        return 0;
+    }
+
+    if ((size_t)(map_end - data) >= lanes * 16)
+    {
+        for (uint32_t i = 0; i < lanes; i++)
+        {
+            pattern_lane bytes, mask, value;
+            pattern_word diff;
+
+            memcpy(&bytes, data + 16 * i, 16);
+            memcpy(&mask, pattern->mask + 16 * i, 16);
+            memcpy(&value, pattern->value + 16 * i, 16);
+
+            diff = (pattern_word)((bytes & mask) ^ value);
+            if ((diff[0] | diff[1]) != 0)
+            {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < pattern->len; i++)
+    {
+        if ((data[i] & pattern->mask[i]) != pattern->value[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+struct query_match
+{
+    uint32_t    block;
+    uint32_t    seq;
+    size_t      text_offset;
+    size_t      text_len;
+    const char *text;
+};
+
+struct query_shared
+{
+    const uint8_t              *map;
+    size_t                      map_size;
+    const struct block_info    *blocks;
+    uint32_t                    first;
+    uint32_t                    last;
+    uint32_t                    next;
+    const struct capture_query *query;
+};
+
+struct query_worker
+{
+    pthread_t            thread;
+    struct query_shared *shared;
+    struct query_match  *matches;
+    size_t               match_count;
+    size_t               match_size;
+    char                *text;
+    size_t               text_len;
+    size_t               text_size;
+    uint32_t             blocks_scanned;
+    int                  error;
+};
+
+static int query_emit(struct query_worker *worker, uint32_t block, uint32_t seq, const struct capture_record *record)
+{
+    struct query_match *match;
+
+    if (grow((void **)&worker->text, &worker->text_size, worker->text_len + text_line_size(record->len), 1) < 0 ||
+        grow((void **)&worker->matches, &worker->match_size, worker->match_count + 1, sizeof(*worker->matches)) < 0)
+    {
+        return -1;
+    }
+
+    match              = &worker->matches[worker->match_count++];
+    match->block       = block;
+    match->seq         = seq;
+    match->text_offset = worker->text_len;
+    match->text_len    = format_text_record(worker->text + worker->text_len, record);
+    worker->text_len += match->text_len;
+    return 0;
+}
+
+static void *query_thread(void *arg)
+{
+    struct query_worker        *worker = arg;
+    struct query_shared        *shared = worker->shared;
+    const struct capture_query *query  = shared->query;
+    const uint8_t              *end    = shared->map + shared->map_size;
+    struct block_cursor         cursor = {0};
+    uint32_t                    block;
+
+    while ((block = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED)) <= shared->last)
+    {
+        const struct block_info *info = &shared->blocks[block];
+        struct capture_record    record;
+        const uint8_t           *tx_end, *rx_end;
+        uint32_t                 seq = 0;
+        int                      ret;
+
+        if (info->t_max < query->from_ns || info->t_min > query->to_ns)
+        {
+            continue;
+        }
+
+        worker->blocks_scanned++;
+
+        if (block_cursor_init(&cursor, shared->map, shared->map_size, info) < 0)
+        {
+            worker->error = 1;
+            break;
+        }
+
+        while ((ret = block_cursor_next(&cursor, &record)) > 0)
+        {
+            // Decoded delta frames live in padded history buffers rather than in the mapping.
+            tx_end = (cursor.encoding == BLOCK_ENCODING_RAW) ? end : record.tx + record.len + CAPTURE_PATTERN_MAX;
+            rx_end = (cursor.encoding == BLOCK_ENCODING_RAW || record.rx == NULL)
+                         ? end
+                         : record.rx + record.len + CAPTURE_PATTERN_MAX;
+
+            if (record.t_ns >= query->from_ns && record.t_ns <= query->to_ns &&
+                pattern_match(&query->tx, record.tx, record.len, tx_end) &&
+                pattern_match(&query->rx, record.rx, record.len, rx_end) &&
+                query_emit(worker, block, seq, &record) < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            seq++;
+        }
+
+        if (ret < 0)
+        {
+            worker->error = 1;
+            break;
+        }
+    }
+
+    block_cursor_release(&cursor);
+    return NULL;
+}
+
+static int compare_matches(const void *a, const void *b)
+{
+    const struct query_match *x = *(const struct query_match *const *)a;
+    const struct query_match *y = *(const struct query_match *const *)b;
+
+    if (x->block != y->block)
+    {
+        return (x->block < y->block) ? -1 : 1;
+    }
+
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+/*
+ * Find the first block whose t_max reaches `t_ns`. Timestamps only grow
+ * within a capture, so the index is sorted on both bounds.
+ */
+static uint32_t first_block_after(const struct block_info *blocks, uint32_t count, uint64_t t_ns)
+{
+    uint32_t lo = 0;
+    uint32_t hi = count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (blocks[mid].t_max < t_ns)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+long capture_run_query(const char *path, const struct capture_query *query, FILE *out)
+{
+    struct query_shared  shared = {0};
+    struct query_worker  workers[QUERY_MAX_THREADS];
+    struct query_match **sorted = NULL;
+    struct block_info   *blocks;
+    uint32_t             block_count;
+    uint32_t             threads  = query->threads;
+    uint32_t             scanned  = 0;
+    size_t               total    = 0;
+    long                 ret      = -1;
+    uint64_t             start_ns = monotonic_ns();
+
+    if (map_file(path, &shared.map, &shared.map_size) < 0)
+    {
+        return -1;
+    }
+
+    if (!is_indexed_capture(shared.map, shared.map_size) ||
+        load_index(shared.map, shared.map_size, &blocks, &block_count) < 0)
+    {
+        munmap((void *)shared.map, shared.map_size);
+        return -1;
+    }
+
+    shared.blocks = blocks;
+    shared.query  = query;
+    shared.first  = first_block_after(blocks, block_count, query->from_ns);
+    shared.next   = shared.first;
+    shared.last   = first_block_after(blocks, block_count, query->to_ns);
+
+    if (shared.last >= block_count && block_count > 0)
+    {
+        shared.last = block_count - 1;
+    }
+
+    if (threads == 0)
+    {
+        threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (threads == 0 || threads > QUERY_MAX_THREADS)
+    {
+        threads = (threads == 0) ? 1 : QUERY_MAX_THREADS;
+    }
+
+    memset(workers, 0, sizeof(workers));
+
+    if (block_count > 0)
+    {
+        madvise((void *)shared.map, shared.map_size, MADV_WILLNEED);
+
+        for (uint32_t i = 0; i < threads; i++)
+        {
+            workers[i].shared = &shared;
+
+            if (pthread_create(&workers[i].thread, NULL, query_thread, &workers[i]) != 0)
+            {
+                // Run with the threads we have; the block counter hands out the rest.
+                threads = i;
+                break;
+            }
+        }
+
+        if (threads == 0)
+        {
+            workers[0].shared = &shared;
+            query_thread(&workers[0]);
+            threads = 1;
+        }
+        else
+        {
+            for (uint32_t i = 0; i < threads; i++)
+            {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        if (workers[i].error)
+        {
+            goto exit;
+        }
+
+        total += workers[i].match_count;
+        scanned += workers[i].blocks_scanned;
+    }
+
+    if ((sorted = malloc((total ? total : 1) * sizeof(*sorted))) == NULL)
+    {
+        goto exit;
+    }
+
+    total = 0;
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        for (size_t j = 0; j < workers[i].match_count; j++)
+        {
+            workers[i].matches[j].text = workers[i].text + workers[i].matches[j].text_offset;
+            sorted[total++]            = &workers[i].matches[j];
+        }
+    }
+
+    qsort(sorted, total, sizeof(*sorted), compare_matches);
+
+    fprintf(out, CAPTURE_TEXT_MAGIC " mode=0x%02x\n", shared.map[8]);
+
+    for (size_t i = 0; i < total; i++)
+    {
+        fwrite(sorted[i]->text, 1, sorted[i]->text_len, out);
+    }
+
+    fprintf(stderr, "query: %zu matches, %u of %u blocks scanned on %u threads in %.3f ms\n", total, scanned,
+            block_count, threads, (double)(monotonic_ns() - start_ns) / NSEC_PER_MSEC);
+
+    ret = (long)total;
+
+exit:
+    for (uint32_t i = 0; i < QUERY_MAX_THREADS; i++)
+    {
+        free(workers[i].matches);
+        free(workers[i].text);
+    }
+
+    free(sorted);
+    free(blocks);
+    munmap((void *)shared.map, shared.map_size);
+    return ret;
+}
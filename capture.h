@@ -0,0 +1,86 @@
+/*
+ * Recording and reading of timestamped SPI transaction captures.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_CAPTURE_H
+#define SPIDEV_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * One SPI transaction. `t_ns` is relative to the first transaction of the
+ * capture. `rx` is NULL when the receive data was not recorded.
+ */
+struct capture_record
+{
+    uint64_t       t_ns;
+    uint32_t       speed_hz;
+    uint16_t       delay_us;
+    uint8_t        bits;
+    uint32_t       len;
+    const uint8_t *tx;
+    const uint8_t *rx;
+};
+
+enum capture_format
+{
+    CAPTURE_FORMAT_TEXT,    // one human readable line per transaction
+    CAPTURE_FORMAT_INDEXED, // binary blocks with a sparse time index
+    CAPTURE_FORMAT_DELTA,   // indexed, frames stored as XOR/RLE deltas
+};
+
+#define CAPTURE_PATTERN_MAX 64
+
+/*
+ * A byte prefix to look for in TX or RX data. Bytes whose mask is zero are
+ * wildcards; `len` is zero when the pattern is unused.
+ */
+struct capture_pattern
+{
+    uint32_t len;
+    uint8_t  value[CAPTURE_PATTERN_MAX];
+    uint8_t  mask[CAPTURE_PATTERN_MAX];
+};
+
+struct capture_query
+{
+    uint64_t               from_ns;
+    uint64_t               to_ns;
+    struct capture_pattern tx;
+    struct capture_pattern rx;
+    uint32_t               threads;
+};
+
+struct capture_writer;
+struct capture_reader;
+
+struct capture_writer *capture_writer_open(const char *path, uint8_t mode, enum capture_format format);
+int                    capture_write(struct capture_writer *writer, const struct capture_record *record);
+int                    capture_writer_close(struct capture_writer *writer);
+
+/*
+ * Returns 1 when a record was read, 0 at the end of the capture and -1 on a
+ * malformed capture. The data pointers stay valid until the next call.
+ */
+struct capture_reader *capture_reader_open(const char *path);
+int                    capture_read(struct capture_reader *reader, struct capture_record *record);
+uint8_t                capture_reader_mode(const struct capture_reader *reader);
+void                   capture_reader_close(struct capture_reader *reader);
+
+/*
+ * Parse a pattern such as "?? ?? 00" where "??" matches any byte.
+ */
+int capture_parse_pattern(const char *text, struct capture_pattern *pattern);
+
+/*
+ * Print every record of an indexed capture that matches the query to `out`,
+ * in the text capture format. Returns the number of matches or -1.
+ */
+long capture_run_query(const char *path, const struct capture_query *query, FILE *out);
+
+#endif // SPIDEV_CAPTURE_H
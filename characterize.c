@@ -0,0 +1,362 @@
+/*
+ * Throughput and latency of the bus as a function of transfer size and
+ * clock speed.
+ *
+ * The time of one message is modelled per speed as a fixed overhead (the
+ * ioctl, the driver and the controller setup) plus a cost per byte, fitted
+ * by least squares over the sizes. Controllers that move small transfers
+ * by PIO and large ones by DMA do not follow one line: the setup cost
+ * steps up and the per-byte cost drops at the threshold. So a fit in two
+ * segments is also tried at every split, and reported when it explains
+ * the times much better than the single line.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "characterize.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+
+// A two-segment fit has to leave less than this share of the squared error of one line,
+// which itself has to miss by more than SPLIT_MIN_RMS of the mean time (i.e. more than noise).
+#define SPLIT_SSE_RATIO 0.25
+#define SPLIT_MIN_RMS 0.02
+#define SPLIT_MIN_POINTS 3
+// Sizes from which the throughput is within this share of the best at the speed.
+#define NEAR_PEAK 0.9
+
+struct line_fit
+{
+    double overhead_ns;
+    double per_byte_ns;
+    double sse;
+};
+
+int characterize_parse_list(const char *text, int binary, uint32_t *values, uint32_t max)
+{
+    uint32_t count = 0;
+
+    while (*text != '\0')
+    {
+        char              *end;
+        unsigned long long value;
+
+        errno = 0;
+        value = strtoull(text, &end, 0);
+        if (end == text || errno != 0)
+        {
+            return -1;
+        }
+
+        if (*end == 'k' || *end == 'K')
+        {
+            value *= binary ? 1024 : 1000;
+            end++;
+        }
+        else if (*end == 'M')
+        {
+            value *= binary ? 1048576 : 1000000;
+            end++;
+        }
+
+        if ((*end != ',' && *end != '\0') || value == 0 || value > UINT32_MAX || count == max)
+        {
+            return -1;
+        }
+
+        values[count++] = (uint32_t)value;
+        text            = (*end == ',') ? end + 1 : end;
+    }
+
+    return (int)count;
+}
+
+int characterize_init(struct characterize *ch,
+                      const uint32_t      *speeds,
+                      uint32_t             speed_count,
+                      const uint32_t      *sizes,
+                      uint32_t             size_count)
+{
+    memset(ch, 0, sizeof(*ch));
+
+    if (speed_count > CHARACTERIZE_MAX_POINTS || size_count > CHARACTERIZE_MAX_POINTS)
+    {
+        return -1;
+    }
+
+    memcpy(ch->speeds, speeds, speed_count * sizeof(speeds[0]));
+    memcpy(ch->sizes, sizes, size_count * sizeof(sizes[0]));
+    ch->speed_count = speed_count;
+    ch->size_count  = size_count;
+
+    ch->cells = calloc((size_t)speed_count * size_count, sizeof(ch->cells[0]));
+    return (ch->cells != NULL) ? 0 : -1;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void characterize_add(struct characterize *ch,
+                      uint32_t             speed_hz,
+                      uint32_t             size,
+                      uint64_t            *times_ns,
+                      uint32_t             count,
+                      uint32_t             errors,
+                      uint64_t             wire_ns)
+{
+    struct characterize_cell *cell;
+
+    if (count == 0 || ch->used == ch->speed_count * ch->size_count)
+    {
+        return;
+    }
+
+    qsort(times_ns, count, sizeof(times_ns[0]), compare_ns);
+
+    cell            = &ch->cells[ch->used++];
+    cell->speed_hz  = speed_hz;
+    cell->size      = size;
+    cell->messages  = count;
+    cell->errors    = errors;
+    cell->min_ns    = times_ns[0];
+    cell->median_ns = times_ns[count / 2];
+    cell->p99_ns    = times_ns[(uint64_t)count * 99 / 100];
+    cell->wire_ns   = wire_ns;
+}
+
+/*
+ * Least squares line through the median times of cells [from, to).
+ */
+static struct line_fit fit_line(const struct characterize_cell *cells, uint32_t from, uint32_t to)
+{
+    struct line_fit fit = {0};
+    double          n   = to - from;
+    double          sx  = 0;
+    double          sy  = 0;
+    double          sxx = 0;
+    double          sxy = 0;
+    double          det;
+
+    for (uint32_t i = from; i < to; i++)
+    {
+        double x = cells[i].size;
+        double y = (double)cells[i].median_ns;
+
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    det = n * sxx - sx * sx;
+    if (n == 0 || det == 0)
+    {
+        fit.overhead_ns = (n > 0) ? sy / n : 0;
+        return fit;
+    }
+
+    fit.per_byte_ns = (n * sxy - sx * sy) / det;
+    fit.overhead_ns = (sy - fit.per_byte_ns * sx) / n;
+
+    for (uint32_t i = from; i < to; i++)
+    {
+        double residual = (double)cells[i].median_ns - (fit.overhead_ns + fit.per_byte_ns * cells[i].size);
+
+        fit.sse += residual * residual;
+    }
+
+    return fit;
+}
+
+static double throughput(const struct characterize_cell *cell)
+{
+    return (double)cell->size * NSEC_PER_SEC / (double)cell->median_ns;
+}
+
+/*
+ * Print the fit, the PIO/DMA split and the near-peak size for the cells
+ * of one speed.
+ */
+static void report_speed(const struct characterize_cell *cells, uint32_t count, FILE *out)
+{
+    struct line_fit                 one       = fit_line(cells, 0, count);
+    const struct characterize_cell *last      = &cells[count - 1];
+    double                          wire      = (double)last->wire_ns / last->size;
+    double                          best      = 0;
+    uint32_t                        split     = 0;
+    double                          split_sse = one.sse * SPLIT_SSE_RATIO;
+    uint32_t                        errors    = 0;
+    double                          mean_ns   = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        best = (throughput(&cells[i]) > best) ? throughput(&cells[i]) : best;
+        errors += cells[i].errors;
+        mean_ns += (double)cells[i].median_ns / count;
+    }
+
+    if (count > 1 && last->size > cells[0].size)
+    {
+        // The spread leaves out the CS delay, which is the same for every size.
+        wire = (double)(last->wire_ns - cells[0].wire_ns) / (last->size - cells[0].size);
+    }
+
+    fprintf(out, "%10u Hz: %8.1f us + %7.1f ns/byte (the clock alone is %.1f ns/byte)\n", cells[0].speed_hz,
+            one.overhead_ns / NSEC_PER_USEC, one.per_byte_ns, wire);
+
+    if (one.sse / count <= (mean_ns * SPLIT_MIN_RMS) * (mean_ns * SPLIT_MIN_RMS))
+    {
+        split_sse = 0;
+    }
+
+    // Two points always lie on a line, so each segment needs three.
+    for (uint32_t i = SPLIT_MIN_POINTS; i + SPLIT_MIN_POINTS <= count; i++)
+    {
+        double sse = fit_line(cells, 0, i).sse + fit_line(cells, i, count).sse;
+
+        if (sse < split_sse)
+        {
+            split     = i;
+            split_sse = sse;
+        }
+    }
+
+    if (split > 0)
+    {
+        struct line_fit below = fit_line(cells, 0, split);
+        struct line_fit above = fit_line(cells, split, count);
+
+        fprintf(out,
+                "                up to %u bytes %.1f us + %.1f ns/byte, from %u bytes %.1f us + %.1f ns/byte"
+                " (PIO to DMA?)\n",
+                cells[split - 1].size, below.overhead_ns / NSEC_PER_USEC, below.per_byte_ns, cells[split].size,
+                above.overhead_ns / NSEC_PER_USEC, above.per_byte_ns);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (throughput(&cells[i]) >= best * NEAR_PEAK)
+        {
+            fprintf(out, "                %.0f%% of the best %.1f kB/s from %u bytes per message\n", NEAR_PEAK * 100,
+                    best / 1000, cells[i].size);
+            break;
+        }
+    }
+
+    if (errors > 0)
+    {
+        fprintf(out, "                %u responses wrong\n", errors);
+    }
+}
+
+static int write_csv(const struct characterize *ch, const char *csv_path)
+{
+    FILE *csv = fopen(csv_path, "w");
+    int   ok;
+
+    if (csv == NULL)
+    {
+        fprintf(stderr, "characterize: cannot create %s\n", csv_path);
+        return -1;
+    }
+
+    fprintf(csv, "speed_hz,size,messages,errors,min_us,median_us,p99_us,wire_us,overhead_us,throughput_kBps,"
+                 "efficiency\n");
+    for (uint32_t i = 0; i < ch->used; i++)
+    {
+        const struct characterize_cell *cell = &ch->cells[i];
+
+        fprintf(csv, "%u,%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", cell->speed_hz, cell->size, cell->messages,
+                cell->errors, (double)cell->min_ns / NSEC_PER_USEC, (double)cell->median_ns / NSEC_PER_USEC,
+                (double)cell->p99_ns / NSEC_PER_USEC, (double)cell->wire_ns / NSEC_PER_USEC,
+                ((double)cell->median_ns - (double)cell->wire_ns) / NSEC_PER_USEC, throughput(cell) / 1000,
+                (double)cell->wire_ns / (double)cell->median_ns);
+    }
+
+    ok = !ferror(csv);
+    if (fclose(csv) != 0 || !ok)
+    {
+        fprintf(stderr, "characterize: cannot write %s\n", csv_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int characterize_report(const struct characterize *ch, const char *csv_path, FILE *out)
+{
+    const struct characterize_cell *fastest = NULL;
+    const struct characterize_cell *lowest  = NULL;
+
+    if (csv_path != NULL && write_csv(ch, csv_path) < 0)
+    {
+        return -1;
+    }
+
+    if (ch->used == 0)
+    {
+        return 0;
+    }
+
+    fprintf(out, "characterize: time per message by speed\n");
+    for (uint32_t from = 0; from < ch->used;)
+    {
+        uint32_t to = from;
+
+        while (to < ch->used && ch->cells[to].speed_hz == ch->cells[from].speed_hz)
+        {
+            to++;
+        }
+        report_speed(&ch->cells[from], to - from, out);
+        from = to;
+    }
+
+    for (uint32_t i = 0; i < ch->used; i++)
+    {
+        const struct characterize_cell *cell = &ch->cells[i];
+
+        if (cell->errors > 0)
+        {
+            continue;
+        }
+        if (fastest == NULL || throughput(cell) > throughput(fastest))
+        {
+            fastest = cell;
+        }
+        if (lowest == NULL || cell->median_ns < lowest->median_ns)
+        {
+            lowest = cell;
+        }
+    }
+
+    if (fastest == NULL)
+    {
+        fprintf(out, "characterize: no grid point without wrong responses\n");
+        return 0;
+    }
+
+    fprintf(out, "characterize: best throughput %.1f kB/s with %u bytes at %u Hz\n", throughput(fastest) / 1000,
+            fastest->size, fastest->speed_hz);
+    fprintf(out, "characterize: lowest latency %.1f us (p99 %.1f us) with %u bytes at %u Hz\n",
+            (double)lowest->median_ns / NSEC_PER_USEC, (double)lowest->p99_ns / NSEC_PER_USEC, lowest->size,
+            lowest->speed_hz);
+
+    return 0;
+}
+
+void characterize_free(struct characterize *ch)
+{
+    free(ch->cells);
+    ch->cells = NULL;
+}
@@ -0,0 +1,76 @@
+/*
+ * Throughput and latency of the bus as a function of transfer size and
+ * clock speed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_CHARACTERIZE_H
+#define SPIDEV_CHARACTERIZE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CHARACTERIZE_MAX_POINTS 32
+
+/*
+ * One grid point, reduced from the message times measured there.
+ */
+struct characterize_cell
+{
+    uint32_t speed_hz;
+    uint32_t size;
+    uint32_t messages;
+    uint32_t errors;
+    uint64_t min_ns;
+    uint64_t median_ns;
+    uint64_t p99_ns;
+    uint64_t wire_ns;
+};
+
+struct characterize
+{
+    uint32_t                  speeds[CHARACTERIZE_MAX_POINTS];
+    uint32_t                  speed_count;
+    uint32_t                  sizes[CHARACTERIZE_MAX_POINTS];
+    uint32_t                  size_count;
+    struct characterize_cell *cells; // speed_count * size_count, by speed then size
+    uint32_t                  used;
+};
+
+/*
+ * Parse a comma separated list of values such as "1,64,1k" or "500k,2M"
+ * (k and M multiply by 1000 and 1000000, or by 1024 and 1048576 when
+ * binary is set). Returns the number of values, or -1 if the list is
+ * not valid or longer than max.
+ */
+int characterize_parse_list(const char *text, int binary, uint32_t *values, uint32_t max);
+
+int characterize_init(struct characterize *ch,
+                      const uint32_t      *speeds,
+                      uint32_t             speed_count,
+                      const uint32_t      *sizes,
+                      uint32_t             size_count);
+
+/*
+ * Add the grid point measured next, in order of speed then size. Sorts
+ * times_ns in place.
+ */
+void characterize_add(struct characterize *ch,
+                      uint32_t             speed_hz,
+                      uint32_t             size,
+                      uint64_t            *times_ns,
+                      uint32_t             count,
+                      uint32_t             errors,
+                      uint64_t             wire_ns);
+
+/*
+ * Write every grid point to csv_path, if not NULL, and print the fitted
+ * costs and the best operating points to out.
+ */
+int  characterize_report(const struct characterize *ch, const char *csv_path, FILE *out);
+void characterize_free(struct characterize *ch);
+
+#endif // SPIDEV_CHARACTERIZE_H
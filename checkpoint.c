@@ -0,0 +1,342 @@
+/*
+ * Periodic checkpoints of a long run, and resuming from them.
+ *
+ * A writer thread wakes up every interval and raises a flag. The transfer
+ * loop notices it between two frames and copies its position and the used
+ * statistics rows into a snapshot buffer allocated up front, which the
+ * writer then saves with a write to a temporary file, fsync and rename, so
+ * that a power loss leaves either the previous checkpoint or the new one.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define CHECKPOINT_MAGIC "SPICKPT1"
+#define CHECKPOINT_INPUT_MAX 1024
+#define CHECKPOINT_NAP_US 10000
+
+enum checkpoint_state
+{
+    CHECKPOINT_IDLE,
+    CHECKPOINT_REQUESTED, // set by the writer, for the transfer loop
+    CHECKPOINT_TAKEN,     // set by the transfer loop once the snapshot is filled
+};
+
+struct checkpoint_header
+{
+    char                  magic[8];
+    uint32_t              row_size; // sizeof(struct frame_stats), or 0 without statistics
+    uint32_t              key;
+    uint32_t              capacity;
+    uint32_t              used;
+    uint32_t              rows; // rows that follow the `other` row, each after its slot number
+    uint32_t              input_len;
+    struct checkpoint_pos pos;
+};
+
+static const char           *s_path;
+static char                  s_input[CHECKPOINT_INPUT_MAX];
+static uint64_t              s_interval_ns;
+static const struct stats   *s_stats   = NULL;
+static struct stats          s_snapshot;
+static struct checkpoint_pos s_snapshot_pos;
+static int                   s_state   = CHECKPOINT_IDLE;
+static int                   s_stop    = 0;
+static int                   s_running = 0;
+static pthread_t             s_thread;
+
+static int write_rows(FILE *fp, const struct stats *stats)
+{
+    if (fwrite(&stats->other, sizeof(stats->other), 1, fp) != 1)
+    {
+        return -1;
+    }
+
+    for (uint32_t slot = 0; slot < stats->capacity; slot++)
+    {
+        if (stats->frames[slot].count == 0)
+        {
+            continue;
+        }
+
+        if (fwrite(&slot, sizeof(slot), 1, fp) != 1 ||
+            fwrite(&stats->frames[slot], sizeof(stats->frames[slot]), 1, fp) != 1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write the snapshot next to the checkpoint, flush it to the disk and
+ * rename it into place, then flush the directory entry.
+ */
+static void write_checkpoint(void)
+{
+    struct checkpoint_header header;
+    char                     tmp[PATH_MAX];
+    const char              *slash = strrchr(s_path, '/');
+    FILE                    *fp;
+    int                      ok;
+    int                      dir_fd;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", s_path, (int)getpid()) >= sizeof(tmp))
+    {
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.input_len = (uint32_t)strlen(s_input);
+    header.pos       = s_snapshot_pos;
+
+    if (s_stats != NULL)
+    {
+        header.row_size = sizeof(struct frame_stats);
+        header.key      = s_snapshot.key;
+        header.capacity = s_snapshot.capacity;
+        header.used     = s_snapshot.used;
+
+        for (uint32_t slot = 0; slot < s_snapshot.capacity; slot++)
+        {
+            header.rows += (s_snapshot.frames[slot].count != 0);
+        }
+    }
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        return;
+    }
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(s_input, 1, header.input_len, fp) == header.input_len &&
+         (s_stats == NULL || write_rows(fp, &s_snapshot) == 0) && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+
+    if (fclose(fp) != 0 || !ok || rename(tmp, s_path) < 0)
+    {
+        unlink(tmp);
+        return;
+    }
+
+    if (slash == NULL)
+    {
+        dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else
+    {
+        char dir[PATH_MAX];
+
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - s_path) + (slash == s_path), s_path);
+        dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+static void *checkpoint_thread(void *arg)
+{
+    uint64_t next_ns = monotonic_ns() + s_interval_ns;
+
+    (void)arg;
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        if (monotonic_ns() < next_ns)
+        {
+            usleep(CHECKPOINT_NAP_US * 10);
+            continue;
+        }
+
+        __atomic_store_n(&s_state, CHECKPOINT_REQUESTED, __ATOMIC_RELEASE);
+
+        // The loop may be in a long -i sleep; the request waits for it.
+        while (__atomic_load_n(&s_state, __ATOMIC_ACQUIRE) != CHECKPOINT_TAKEN &&
+               !__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+        {
+            usleep(CHECKPOINT_NAP_US);
+        }
+
+        if (__atomic_load_n(&s_state, __ATOMIC_ACQUIRE) == CHECKPOINT_TAKEN)
+        {
+            write_checkpoint();
+            __atomic_store_n(&s_state, CHECKPOINT_IDLE, __ATOMIC_RELEASE);
+        }
+
+        next_ns = monotonic_ns() + s_interval_ns;
+    }
+
+    return NULL;
+}
+
+int checkpoint_start(const char *path, uint32_t interval_s, const char *input, const struct stats *stats)
+{
+    sigset_t all;
+    sigset_t old;
+
+    s_path        = path;
+    s_interval_ns = (uint64_t)(interval_s ? interval_s : 1) * NSEC_PER_SEC;
+    s_stats       = stats;
+    snprintf(s_input, sizeof(s_input), "%s", input);
+
+    if (stats != NULL && (s_snapshot.frames = calloc(stats->capacity, sizeof(*s_snapshot.frames))) == NULL)
+    {
+        return -1;
+    }
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_thread, NULL, checkpoint_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!s_running)
+    {
+        free(s_snapshot.frames);
+        s_snapshot.frames = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int checkpoint_due(void)
+{
+    return __atomic_load_n(&s_state, __ATOMIC_RELAXED) == CHECKPOINT_REQUESTED;
+}
+
+static void fill_snapshot(const struct checkpoint_pos *pos)
+{
+    s_snapshot_pos = *pos;
+
+    if (s_stats == NULL)
+    {
+        return;
+    }
+
+    s_snapshot.key      = s_stats->key;
+    s_snapshot.capacity = s_stats->capacity;
+    s_snapshot.used     = s_stats->used;
+    s_snapshot.other    = s_stats->other;
+
+    // Rows keyed by index fill up from the start; hashed rows are anywhere.
+    memcpy(s_snapshot.frames, s_stats->frames,
+           ((s_stats->key == STATS_KEY_INDEX) ? s_stats->used : s_stats->capacity) * sizeof(*s_stats->frames));
+}
+
+void checkpoint_take(const struct checkpoint_pos *pos)
+{
+    fill_snapshot(pos);
+    __atomic_store_n(&s_state, CHECKPOINT_TAKEN, __ATOMIC_RELEASE);
+}
+
+void checkpoint_stop(const struct checkpoint_pos *pos)
+{
+    if (!s_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_thread, NULL);
+    s_running = 0;
+
+    fill_snapshot(pos);
+    write_checkpoint();
+
+    free(s_snapshot.frames);
+    s_snapshot.frames = NULL;
+}
+
+int checkpoint_load(const char *path, const char *input, struct checkpoint_pos *pos, struct stats *stats)
+{
+    struct checkpoint_header header;
+    char                     saved[CHECKPOINT_INPUT_MAX];
+    FILE                    *fp;
+    int                      ret = -1;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        printf("%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.input_len >= sizeof(saved) ||
+        fread(saved, 1, header.input_len, fp) != header.input_len)
+    {
+        printf("%s: not a checkpoint\n", path);
+        goto exit;
+    }
+
+    saved[header.input_len] = '\0';
+    if (strcmp(saved, input) != 0)
+    {
+        printf("%s: checkpoint of another input (%s)\n", path, saved);
+        goto exit;
+    }
+
+    *pos = header.pos;
+    ret  = 0;
+
+    if (stats == NULL || header.row_size == 0)
+    {
+        goto exit;
+    }
+
+    if (header.row_size != sizeof(struct frame_stats) || header.key != (uint32_t)stats->key ||
+        header.capacity != stats->capacity)
+    {
+        printf("%s: statistics not restored, they were kept another way\n", path);
+        goto exit;
+    }
+
+    // The table is still empty, so the saved rows can go in as they are.
+    if (fread(&stats->other, sizeof(stats->other), 1, fp) != 1)
+    {
+        goto bad_rows;
+    }
+
+    for (uint32_t i = 0; i < header.rows; i++)
+    {
+        uint32_t slot;
+
+        if (fread(&slot, sizeof(slot), 1, fp) != 1 || slot >= stats->capacity ||
+            fread(&stats->frames[slot], sizeof(stats->frames[slot]), 1, fp) != 1)
+        {
+            goto bad_rows;
+        }
+    }
+
+    stats->used = header.used;
+    goto exit;
+
+bad_rows:
+    printf("%s: truncated statistics, not restored\n", path);
+    stats_free(stats);
+    stats_init(stats, (enum stats_key)header.key, header.capacity);
+
+exit:
+    fclose(fp);
+
+    return ret;
+}
@@ -0,0 +1,54 @@
+/*
+ * Periodic checkpoints of a long run, and resuming from them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_CHECKPOINT_H
+#define SPIDEV_CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Where the run is: the next frame to send, as a repeat index and a frame
+ * index (and, for --tx-file, a byte offset), and the transfers made so far.
+ */
+struct checkpoint_pos
+{
+    uint32_t repeat;
+    uint32_t frame;
+    uint64_t offset;
+    uint64_t transfers;
+};
+
+/*
+ * Start writing checkpoints to `path` every interval_s seconds. `input`
+ * identifies what is being sent, so that a checkpoint is only resumed
+ * against the same input; stats may be NULL.
+ */
+int checkpoint_start(const char *path, uint32_t interval_s, const char *input, const struct stats *stats);
+
+/*
+ * Called by the transfer loop between frames: returns 1 when the writer
+ * wants a snapshot, which the loop then hands over with checkpoint_take().
+ * The writer never touches the live statistics, so the loop pays one load
+ * per frame and a copy every interval.
+ */
+int  checkpoint_due(void);
+void checkpoint_take(const struct checkpoint_pos *pos);
+
+// Write a last checkpoint at pos, from the calling thread, and stop the writer.
+void checkpoint_stop(const struct checkpoint_pos *pos);
+
+/*
+ * Read the checkpoint at `path` into pos, and add its statistics to stats
+ * if the rows are laid out alike. Returns -1 if there is no usable
+ * checkpoint for `input`.
+ */
+int checkpoint_load(const char *path, const char *input, struct checkpoint_pos *pos, struct stats *stats);
+
+#endif // SPIDEV_CHECKPOINT_H
@@ -0,0 +1,375 @@
+/*
+ * Transparent decompression of gzip and zstd input files.
+ *
+ * A helper thread reads the compressed file and inflates it into a bounded
+ * ring, and the reader gets the plain text through a stdio stream, so the
+ * frame parser runs unchanged and in parallel with the decompression. The
+ * ring bounds the memory used whatever the size of the file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#define _GNU_SOURCE // fopencookie
+
+#include "decompress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef SPIDEV_ZSTD
+#include <zstd.h>
+#endif
+
+#define DECOMPRESS_RING (1u << 20)
+#define DECOMPRESS_BLOCK (64u << 10)
+
+enum decompress_format
+{
+    DECOMPRESS_GZIP,
+    DECOMPRESS_ZSTD,
+};
+
+struct decompress
+{
+    int                    fd;
+    const char            *path;
+    enum decompress_format format;
+    pthread_t              thread;
+    pthread_mutex_t        lock;
+    pthread_cond_t         cond;
+    uint8_t               *ring;
+    size_t                 head; // bytes written to the ring, ever
+    size_t                 tail; // bytes read from the ring, ever
+    int                    done;
+    int                    error;
+    int                    closing;
+};
+
+/*
+ * Copy len bytes into the ring, waiting for the reader when it is full.
+ * Returns -1 if the stream was closed before the data could be read.
+ */
+static int ring_put(struct decompress *dc, const uint8_t *data, size_t len)
+{
+    pthread_mutex_lock(&dc->lock);
+
+    while (len > 0)
+    {
+        size_t space;
+        size_t offset;
+        size_t n;
+
+        while ((space = DECOMPRESS_RING - (dc->head - dc->tail)) == 0 && !dc->closing)
+        {
+            pthread_cond_wait(&dc->cond, &dc->lock);
+        }
+
+        if (dc->closing)
+        {
+            pthread_mutex_unlock(&dc->lock);
+            return -1;
+        }
+
+        offset = dc->head % DECOMPRESS_RING;
+        n      = len;
+        if (n > space)
+        {
+            n = space;
+        }
+        if (n > DECOMPRESS_RING - offset)
+        {
+            n = DECOMPRESS_RING - offset;
+        }
+
+        // Only the reader moves tail, and it never touches [tail + used, head + n).
+        pthread_mutex_unlock(&dc->lock);
+        memcpy(dc->ring + offset, data, n);
+        pthread_mutex_lock(&dc->lock);
+
+        dc->head += n;
+        data += n;
+        len -= n;
+        pthread_cond_broadcast(&dc->cond);
+    }
+
+    pthread_mutex_unlock(&dc->lock);
+
+    return 0;
+}
+
+static int inflate_gzip(struct decompress *dc, uint8_t *in, uint8_t *out)
+{
+    z_stream z;
+    int      ret = Z_OK;
+    ssize_t  n;
+
+    memset(&z, 0, sizeof(z));
+
+    // 15 + 32: the largest window, with the gzip or zlib header detected.
+    if (inflateInit2(&z, 15 + 32) != Z_OK)
+    {
+        return -1;
+    }
+
+    while ((n = read(dc->fd, in, DECOMPRESS_BLOCK)) > 0)
+    {
+        z.next_in  = in;
+        z.avail_in = (uInt)n;
+
+        // Also go on while the output fills up: zlib may hold more of it.
+        do
+        {
+            if (ret == Z_STREAM_END)
+            {
+                if (z.avail_in == 0)
+                {
+                    break;
+                }
+
+                // Concatenated members, as written by "cat a.gz b.gz".
+                inflateReset(&z);
+            }
+
+            z.next_out  = out;
+            z.avail_out = DECOMPRESS_BLOCK;
+            ret         = inflate(&z, Z_NO_FLUSH);
+
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            {
+                inflateEnd(&z);
+                return -1;
+            }
+
+            if (ring_put(dc, out, DECOMPRESS_BLOCK - z.avail_out) < 0)
+            {
+                inflateEnd(&z);
+                return -1;
+            }
+        } while (z.avail_in > 0 || z.avail_out == 0);
+    }
+
+    inflateEnd(&z);
+
+    // A read error, or a file that ends in the middle of a member.
+    return (n < 0 || ret != Z_STREAM_END) ? -1 : 0;
+}
+
+#ifdef SPIDEV_ZSTD
+static int inflate_zstd(struct decompress *dc, uint8_t *in, uint8_t *out)
+{
+    ZSTD_DStream *zs   = ZSTD_createDStream();
+    size_t        left = 1;
+    ssize_t       n;
+
+    if (zs == NULL)
+    {
+        return -1;
+    }
+
+    while ((n = read(dc->fd, in, DECOMPRESS_BLOCK)) > 0)
+    {
+        ZSTD_inBuffer  input = {in, (size_t)n, 0};
+        ZSTD_outBuffer output;
+
+        do
+        {
+            output = (ZSTD_outBuffer){out, DECOMPRESS_BLOCK, 0};
+            left   = ZSTD_decompressStream(zs, &output, &input);
+
+            if (ZSTD_isError(left) || ring_put(dc, out, output.pos) < 0)
+            {
+                ZSTD_freeDStream(zs);
+                return -1;
+            }
+        } while (input.pos < input.size || output.pos == output.size);
+    }
+
+    ZSTD_freeDStream(zs);
+
+    // left is 0 only at the end of a frame.
+    return (n < 0 || left != 0) ? -1 : 0;
+}
+#endif
+
+static void *decompress_thread(void *arg)
+{
+    struct decompress *dc  = arg;
+    uint8_t           *in  = malloc(DECOMPRESS_BLOCK);
+    uint8_t           *out = malloc(DECOMPRESS_BLOCK);
+    int                ret = -1;
+
+    if (in != NULL && out != NULL)
+    {
+#ifdef SPIDEV_ZSTD
+        ret = (dc->format == DECOMPRESS_ZSTD) ? inflate_zstd(dc, in, out) : inflate_gzip(dc, in, out);
+#else
+        ret = inflate_gzip(dc, in, out);
+#endif
+    }
+
+    free(in);
+    free(out);
+
+    pthread_mutex_lock(&dc->lock);
+    if (ret < 0 && !dc->closing)
+    {
+        fprintf(stderr, "%s: truncated or corrupt compressed data\n", dc->path);
+        dc->error = 1;
+    }
+    dc->done = 1;
+    pthread_cond_broadcast(&dc->cond);
+    pthread_mutex_unlock(&dc->lock);
+
+    return NULL;
+}
+
+static ssize_t decompress_read(void *cookie, char *buf, size_t size)
+{
+    struct decompress *dc = cookie;
+    size_t             used;
+    size_t             offset;
+    size_t             n;
+
+    pthread_mutex_lock(&dc->lock);
+
+    while ((used = dc->head - dc->tail) == 0 && !dc->done)
+    {
+        pthread_cond_wait(&dc->cond, &dc->lock);
+    }
+
+    if (used == 0)
+    {
+        pthread_mutex_unlock(&dc->lock);
+        if (dc->error)
+        {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    offset = dc->tail % DECOMPRESS_RING;
+    n      = size;
+    if (n > used)
+    {
+        n = used;
+    }
+    if (n > DECOMPRESS_RING - offset)
+    {
+        n = DECOMPRESS_RING - offset;
+    }
+
+    pthread_mutex_unlock(&dc->lock);
+    memcpy(buf, dc->ring + offset, n);
+    pthread_mutex_lock(&dc->lock);
+
+    dc->tail += n;
+    pthread_cond_broadcast(&dc->cond);
+    pthread_mutex_unlock(&dc->lock);
+
+    return (ssize_t)n;
+}
+
+static void decompress_stop(struct decompress *dc)
+{
+    pthread_mutex_lock(&dc->lock);
+    dc->closing = 1;
+    pthread_cond_broadcast(&dc->cond);
+    pthread_mutex_unlock(&dc->lock);
+
+    pthread_join(dc->thread, NULL);
+    pthread_cond_destroy(&dc->cond);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->ring);
+    free(dc);
+}
+
+static int decompress_close(void *cookie)
+{
+    struct decompress *dc = cookie;
+    int                fd = dc->fd;
+
+    decompress_stop(dc);
+
+    return close(fd);
+}
+
+int decompress_open(int fd, const char *path, FILE **fp)
+{
+    static const uint8_t   gzip_magic[] = {0x1f, 0x8b};
+    static const uint8_t   zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    cookie_io_functions_t  io           = {.read = decompress_read, .close = decompress_close};
+    struct decompress     *dc;
+    enum decompress_format format;
+    uint8_t                magic[4];
+    sigset_t               all;
+    sigset_t               old;
+    int                    ret;
+
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic))
+    {
+        return 0;
+    }
+
+    if (memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0)
+    {
+        format = DECOMPRESS_GZIP;
+    }
+    else if (memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0)
+    {
+#ifdef SPIDEV_ZSTD
+        format = DECOMPRESS_ZSTD;
+#else
+        fprintf(stderr, "%s: zstd input needs a build with ZSTD=1\n", path);
+        return -1;
+#endif
+    }
+    else
+    {
+        return 0;
+    }
+
+    if ((dc = calloc(1, sizeof(*dc))) == NULL || (dc->ring = malloc(DECOMPRESS_RING)) == NULL)
+    {
+        free(dc);
+        return -1;
+    }
+
+    dc->fd     = fd;
+    dc->path   = path;
+    dc->format = format;
+    pthread_mutex_init(&dc->lock, NULL);
+    pthread_cond_init(&dc->cond, NULL);
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&dc->thread, NULL, decompress_thread, dc);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0)
+    {
+        pthread_cond_destroy(&dc->cond);
+        pthread_mutex_destroy(&dc->lock);
+        free(dc->ring);
+        free(dc);
+        return -1;
+    }
+
+    if ((*fp = fopencookie(dc, "r", io)) == NULL)
+    {
+        // fd is still the caller's.
+        decompress_stop(dc);
+        return -1;
+    }
+
+    return 1;
+}
@@ -0,0 +1,22 @@
+/*
+ * Transparent decompression of gzip and zstd input files.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_DECOMPRESS_H
+#define SPIDEV_DECOMPRESS_H
+
+#include <stdio.h>
+
+/*
+ * If the file open on fd starts with a gzip header (or a zstd one, when
+ * built with ZSTD=1), set *fp to a stream of its decompressed contents and
+ * return 1; the stream owns fd from then on. Returns 0 if the file is not
+ * compressed, and -1 on error. `path` is only used in messages.
+ */
+int decompress_open(int fd, const char *path, FILE **fp);
+
+#endif // SPIDEV_DECOMPRESS_H
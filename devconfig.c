@@ -0,0 +1,222 @@
+/*
+ * Configuration of the spidev device with as few ioctls as possible.
+ *
+ * spidev keeps mode, word size and speed on the spi_device, so they survive
+ * from one open to the next. A tool invoked once per transaction therefore
+ * usually finds the device configured already, and only needs to read the
+ * settings back, or not even that when a state file left by a previous run
+ * is trusted.
+ *
+ * The state file records the device number and inode of the node, so that
+ * a recreated node (driver rebind, hotplug) invalidates it, and the boot id,
+ * so that a reboot does. A process that reconfigures the device behind our
+ * back is not detected; only trust the file when this tool is the only user
+ * of the device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "devconfig.h"
+
+#include <inttypes.h>
+#include <linux/spi/spidev.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATE_MAGIC "spidev_test state v1"
+
+struct devconfig_key
+{
+    uint64_t rdev;
+    uint64_t ino;
+    char     boot_id[40];
+};
+
+static int read_key(int fd, struct devconfig_key *key)
+{
+    struct stat st;
+    FILE       *fp;
+    int         ret = -1;
+
+    if (fstat(fd, &st) < 0)
+    {
+        return -1;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->rdev = st.st_rdev;
+    key->ino  = st.st_ino;
+
+    if ((fp = fopen("/proc/sys/kernel/random/boot_id", "r")) == NULL)
+    {
+        return -1;
+    }
+
+    if (fscanf(fp, "%39s", key->boot_id) == 1)
+    {
+        ret = 0;
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+static int load_state(const char *path, const struct devconfig_key *key, struct devconfig *current)
+{
+    struct devconfig_key saved;
+    unsigned int         mode;
+    unsigned int         bits;
+    FILE                *fp;
+    int                  n;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        return -1;
+    }
+
+    memset(&saved, 0, sizeof(saved));
+    n = fscanf(fp, STATE_MAGIC " rdev=%" SCNx64 " ino=%" SCNu64 " boot=%39s mode=%x bits=%u speed=%" SCNu32,
+               &saved.rdev, &saved.ino, saved.boot_id, &mode, &bits, &current->speed);
+    fclose(fp);
+
+    if (n != 6 || saved.rdev != key->rdev || saved.ino != key->ino || strcmp(saved.boot_id, key->boot_id) != 0)
+    {
+        return -1;
+    }
+
+    current->mode = (uint8_t)mode;
+    current->bits = (uint8_t)bits;
+    return 0;
+}
+
+/*
+ * Write the state next to its final name and rename it into place, so that
+ * concurrent runs never read a partial file.
+ */
+static void save_state(const char *path, const struct devconfig_key *key, const struct devconfig *config)
+{
+    char  tmp[4096];
+    FILE *fp;
+    int   ok;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= sizeof(tmp))
+    {
+        return;
+    }
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        return;
+    }
+
+    ok = fprintf(fp, STATE_MAGIC " rdev=%" PRIx64 " ino=%" PRIu64 " boot=%s mode=%x bits=%u speed=%" PRIu32 "\n",
+                 key->rdev, key->ino, key->boot_id, config->mode, config->bits, config->speed) > 0;
+
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+    }
+}
+
+int devconfig_apply(int fd, const char *state_path, struct devconfig *config, const char **failed)
+{
+    struct devconfig_key key;
+    struct devconfig     current;
+    int                  have_key = 0;
+    int                  trusted  = 0;
+    int                  changed  = 0;
+
+    if (state_path != NULL && read_key(fd, &key) == 0)
+    {
+        have_key = 1;
+        trusted  = (load_state(state_path, &key, &current) == 0);
+    }
+
+    if (!trusted)
+    {
+        if (ioctl(fd, SPI_IOC_RD_MODE, &current.mode) == -1)
+        {
+            *failed = "Failed to get spi mode";
+            return -1;
+        }
+
+        if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &current.bits) == -1)
+        {
+            *failed = "Failed to get bits per word";
+            return -1;
+        }
+
+        if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &current.speed) == -1)
+        {
+            *failed = "Failed to get max speed hz";
+            return -1;
+        }
+    }
+
+    /*
+     * Each setting that is written is read back, as the driver may not
+     * support exactly what was asked for.
+     */
+    if (config->mode != current.mode)
+    {
+        if (ioctl(fd, SPI_IOC_WR_MODE, &config->mode) == -1)
+        {
+            *failed = "Failed to set spi mode";
+            return -1;
+        }
+
+        if (ioctl(fd, SPI_IOC_RD_MODE, &config->mode) == -1)
+        {
+            *failed = "Failed to get spi mode";
+            return -1;
+        }
+
+        changed = 1;
+    }
+
+    if (config->bits != current.bits)
+    {
+        if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &config->bits) == -1)
+        {
+            *failed = "Failed to set bits per word";
+            return -1;
+        }
+
+        if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &config->bits) == -1)
+        {
+            *failed = "Failed to get bits per word";
+            return -1;
+        }
+
+        changed = 1;
+    }
+
+    if (config->speed != current.speed)
+    {
+        if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &config->speed) == -1)
+        {
+            *failed = "Failed to set max speed hz";
+            return -1;
+        }
+
+        if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &config->speed) == -1)
+        {
+            *failed = "Failed to get max speed hz";
+            return -1;
+        }
+
+        changed = 1;
+    }
+
+    if (have_key && (changed || !trusted))
+    {
+        save_state(state_path, &key, config);
+    }
+
+    return 0;
+}
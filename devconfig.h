@@ -0,0 +1,31 @@
+/*
+ * Configuration of the spidev device with as few ioctls as possible.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_DEVCONFIG_H
+#define SPIDEV_DEVCONFIG_H
+
+#include <stdint.h>
+
+struct devconfig
+{
+    uint8_t  mode;
+    uint8_t  bits;
+    uint32_t speed;
+};
+
+/*
+ * Bring the device to `config`, writing only the settings that differ from
+ * what it currently has, and update `config` with what the device reports
+ * back. With a state_path, the current settings are taken from that file
+ * when it was written for the same device node in the same boot, instead of
+ * being read from the device. Returns -1 with errno set and *failed naming
+ * the step that failed.
+ */
+int devconfig_apply(int fd, const char *state_path, struct devconfig *config, const char **failed);
+
+#endif // SPIDEV_DEVCONFIG_H
@@ -0,0 +1,768 @@
+/*
+ * Emulated SPI peripherals that stand in for the spidev device.
+ *
+ * Each model sees the bytes of a message as they would be clocked on the
+ * bus, and is told when C̅S̅ is released, so a command can span several
+ * transfers exactly as on a real part. Busy times are kept against the
+ * monotonic clock, which makes status polling loops behave as on hardware.
+ * With the `timing` option, a message also takes the time it would need on
+ * the wire; without it, it completes at memory speed.
+ *
+ * Models:
+ *   loop    MISO echoes MOSI
+ *   nor     JEDEC SPI NOR flash: RDID, RDSR, WREN/WRDI, READ, FAST_READ,
+ *           page program, 4K sector, 64K block and chip erase. Parts above
+ *           16 MiB take 4-byte addresses in every command.
+ *   eeprom  25xx EEPROM: RDSR/WRSR, WREN/WRDI, READ and page WRITE
+ *   adc     streaming ADC with a sample FIFO. Commands are 0x01 FIFO level
+ *           (16 bits), 0x02 FIFO data (16-bit samples, MSB first) and 0x03
+ *           status (bit 0 overflow, bit 1 underrun, cleared when read).
+ *           Samples are 16-bit sequence numbers so that a reader can spot
+ *           drops; reading an empty FIFO returns 0xffff.
+ *
+ * All values are big-endian on the wire, as on the parts they model.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "emulate.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+
+#define EMU_MAX_OPTS 16
+#define EMU_CHUNK 4096
+#define EMU_SPIN_NS (50 * NSEC_PER_USEC)
+
+#define CMD_WRSR 0x01
+#define CMD_PP 0x02
+#define CMD_READ 0x03
+#define CMD_WRDI 0x04
+#define CMD_RDSR 0x05
+#define CMD_WREN 0x06
+#define CMD_FAST_READ 0x0b
+#define CMD_SE 0x20
+#define CMD_CE_60 0x60
+#define CMD_RDID 0x9f
+#define CMD_CE 0xc7
+#define CMD_BE 0xd8
+
+#define ADC_RDCNT 0x01
+#define ADC_RDFIFO 0x02
+#define ADC_RDSTAT 0x03
+
+#define STATUS_WIP 0x01
+#define STATUS_WEL 0x02
+
+struct emu_opt
+{
+    char     key[32];
+    uint64_t value;
+    int      used;
+};
+
+/*
+ * NOR flash and EEPROM share the 25-series command set and differ in how
+ * data is written: NOR programming can only clear bits and needs erases.
+ */
+struct memchip
+{
+    int      eeprom;
+    uint8_t *mem;
+    uint64_t size;
+    uint32_t page;
+    uint32_t sector;
+    uint32_t block;
+    uint32_t jedec_id;
+    uint8_t  addr_bytes;
+    uint64_t page_ns;
+    uint64_t sector_ns;
+    uint64_t block_ns;
+    uint64_t chip_ns;
+    int      wel;
+    uint8_t  status;
+    uint64_t busy_until;
+
+    // The command being clocked in.
+    uint8_t  cmd;
+    uint32_t pos;
+    uint64_t addr;
+    uint32_t written;
+    int      ignored;
+
+    uint64_t reads;
+    uint64_t programs;
+    uint64_t erases;
+    uint64_t busy_polls;
+};
+
+struct adc
+{
+    uint64_t rate;
+    uint64_t depth;
+    uint64_t t0;
+    uint64_t next;
+    uint64_t available;
+    uint8_t  status;
+    uint8_t  cmd;
+    uint32_t pos;
+    uint16_t latched;
+
+    uint64_t samples_read;
+    uint64_t dropped;
+    uint64_t underruns;
+};
+
+struct emu_model;
+
+struct emu_device
+{
+    const struct emu_model *model;
+    struct emu_opt          opts[EMU_MAX_OPTS];
+    int                     opt_count;
+    uint32_t                speed_hz;
+    int                     timing;
+    uint64_t                now;
+    uint64_t                messages;
+    uint64_t                bytes;
+    union
+    {
+        struct memchip mem;
+        struct adc     adc;
+    } u;
+};
+
+struct emu_model
+{
+    const char *name;
+    int (*init)(struct emu_device *dev);
+    void (*sync)(struct emu_device *dev);
+    void (*xfer)(struct emu_device *dev, const uint8_t *tx, uint8_t *rx, uint32_t len);
+    void (*deselect)(struct emu_device *dev);
+    void (*report)(const struct emu_device *dev, FILE *out);
+    void (*release)(struct emu_device *dev);
+};
+
+static const uint8_t s_zero[EMU_CHUNK];
+static uint8_t       s_scratch[EMU_CHUNK];
+
+static uint64_t emu_get(struct emu_device *dev, const char *key, uint64_t def)
+{
+    for (int i = 0; i < dev->opt_count; i++)
+    {
+        if (strcmp(dev->opts[i].key, key) == 0)
+        {
+            dev->opts[i].used = 1;
+            return dev->opts[i].value;
+        }
+    }
+
+    return def;
+}
+
+static int is_pow2(uint64_t v)
+{
+    return v != 0 && (v & (v - 1)) == 0;
+}
+
+/*
+ * Parse "key=value,..." into dev->opts. Values accept a K, M or G binary
+ * suffix; a key without a value is 1.
+ */
+static int parse_opts(struct emu_device *dev, const char *text)
+{
+    while (text != NULL && *text != '\0')
+    {
+        struct emu_opt *opt;
+        const char     *end = strchr(text, ',');
+        const char     *eq  = strchr(text, '=');
+        size_t          key_len;
+        char           *suffix;
+
+        if (end == NULL)
+        {
+            end = text + strlen(text);
+        }
+
+        if (dev->opt_count == EMU_MAX_OPTS)
+        {
+            printf("emulate: too many options\n");
+            return -1;
+        }
+
+        opt     = &dev->opts[dev->opt_count++];
+        key_len = (eq != NULL && eq < end) ? (size_t)(eq - text) : (size_t)(end - text);
+
+        if (key_len == 0 || key_len >= sizeof(opt->key))
+        {
+            printf("emulate: bad option \"%.*s\"\n", (int)(end - text), text);
+            return -1;
+        }
+
+        memcpy(opt->key, text, key_len);
+        opt->key[key_len] = '\0';
+        opt->value        = 1;
+
+        if (eq != NULL && eq < end)
+        {
+            opt->value = strtoull(eq + 1, &suffix, 0);
+
+            switch (*suffix)
+            {
+            case 'G':
+                opt->value <<= 10;
+                // fall through
+            case 'M':
+                opt->value <<= 10;
+                // fall through
+            case 'K':
+                opt->value <<= 10;
+                suffix++;
+                break;
+            }
+
+            if (suffix == eq + 1 || suffix != end)
+            {
+                printf("emulate: bad value for %s\n", opt->key);
+                return -1;
+            }
+        }
+
+        text = (*end == ',') ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+static void loop_xfer(struct emu_device *dev, const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    (void)dev;
+    memmove(rx, tx, len);
+}
+
+static int memchip_alloc(struct memchip *m)
+{
+    if (!is_pow2(m->size) || !is_pow2(m->page) || m->page > m->size)
+    {
+        printf("emulate: size and page must be powers of two, page no larger than size\n");
+        return -1;
+    }
+
+    if ((m->mem = malloc(m->size)) == NULL)
+    {
+        printf("emulate: cannot allocate %" PRIu64 " bytes\n", m->size);
+        return -1;
+    }
+
+    memset(m->mem, 0xff, m->size);
+    return 0;
+}
+
+static int nor_init(struct emu_device *dev)
+{
+    struct memchip *m = &dev->u.mem;
+
+    m->size       = emu_get(dev, "size", 16 << 20);
+    m->page       = (uint32_t)emu_get(dev, "page", 256);
+    m->sector     = (uint32_t)emu_get(dev, "sector", 4 << 10);
+    m->block      = (uint32_t)emu_get(dev, "block", 64 << 10);
+    m->page_ns    = emu_get(dev, "page_us", 700) * NSEC_PER_USEC;
+    m->sector_ns  = emu_get(dev, "sector_ms", 45) * NSEC_PER_MSEC;
+    m->block_ns   = emu_get(dev, "block_ms", 150) * NSEC_PER_MSEC;
+    m->chip_ns    = emu_get(dev, "chip_ms", 2500 * ((m->size + (1 << 20) - 1) >> 20)) * NSEC_PER_MSEC;
+    m->addr_bytes = (m->size > (16 << 20)) ? 4 : 3;
+    m->jedec_id   = (uint32_t)emu_get(dev, "id", 0xef4000 | (uint32_t)(63 - __builtin_clzll(m->size | 1)));
+
+    if (!is_pow2(m->sector) || !is_pow2(m->block) || m->sector > m->block || m->block > m->size)
+    {
+        printf("emulate: sector and block must be powers of two, sector <= block <= size\n");
+        return -1;
+    }
+
+    return memchip_alloc(m);
+}
+
+static int eeprom_init(struct emu_device *dev)
+{
+    struct memchip *m = &dev->u.mem;
+
+    m->eeprom     = 1;
+    m->size       = emu_get(dev, "size", 32 << 10);
+    m->page       = (uint32_t)emu_get(dev, "page", 64);
+    m->page_ns    = emu_get(dev, "write_ms", 5) * NSEC_PER_MSEC;
+    m->addr_bytes = (m->size <= 256) ? 1 : (m->size <= (64 << 10)) ? 2 : 3;
+
+    return memchip_alloc(m);
+}
+
+static int memchip_busy(const struct emu_device *dev)
+{
+    return dev->now < dev->u.mem.busy_until;
+}
+
+static uint8_t memchip_byte(struct emu_device *dev, uint8_t tx)
+{
+    struct memchip *m     = &dev->u.mem;
+    uint32_t        index = m->pos++ - 1;
+
+    switch (m->cmd)
+    {
+    case CMD_RDSR:
+        return m->status | (memchip_busy(dev) ? STATUS_WIP : 0) | (m->wel ? STATUS_WEL : 0);
+    case CMD_WRSR:
+        if (m->eeprom && index == 0)
+        {
+            m->written = tx;
+        }
+        return 0xff;
+    case CMD_RDID:
+        return (!m->eeprom && index < 3) ? (uint8_t)(m->jedec_id >> (16 - 8 * index)) : 0xff;
+    case CMD_PP:
+        if (index < m->addr_bytes)
+        {
+            m->addr = (m->addr << 8) | tx;
+        }
+        else if (m->wel)
+        {
+            // Data past the end of the page wraps to its start.
+            uint64_t page_base = m->addr & (m->size - 1) & ~(uint64_t)(m->page - 1);
+            uint64_t offset    = (m->addr + m->written) & (m->page - 1);
+
+            if (m->eeprom)
+            {
+                m->mem[page_base + offset] = tx;
+            }
+            else
+            {
+                m->mem[page_base + offset] &= tx;
+            }
+            m->written++;
+        }
+        return 0xff;
+    case CMD_READ:
+    case CMD_FAST_READ:
+    case CMD_SE:
+    case CMD_BE:
+        if (index < m->addr_bytes)
+        {
+            m->addr = (m->addr << 8) | tx;
+        }
+        return 0xff;
+    default:
+        return 0xff;
+    }
+}
+
+static void memchip_xfer(struct emu_device *dev, const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    struct memchip *m = &dev->u.mem;
+    uint32_t        i = 0;
+
+    while (i < len)
+    {
+        if (m->pos == 0)
+        {
+            m->cmd     = tx[i];
+            m->pos     = 1;
+            m->addr    = 0;
+            m->written = 0;
+
+            // A busy part only answers status reads.
+            m->ignored = memchip_busy(dev) && m->cmd != CMD_RDSR;
+
+            if (m->cmd == CMD_RDSR && memchip_busy(dev))
+            {
+                m->busy_polls++;
+            }
+
+            rx[i++] = 0xff;
+            continue;
+        }
+
+        if (m->ignored)
+        {
+            memset(rx + i, 0xff, len - i);
+            return;
+        }
+
+        if ((m->cmd == CMD_READ || m->cmd == CMD_FAST_READ) &&
+            m->pos >= 1u + m->addr_bytes + (m->cmd == CMD_FAST_READ))
+        {
+            // Data phase: copy straight out of the array, wrapping at the end.
+            while (i < len)
+            {
+                uint64_t offset = m->addr & (m->size - 1);
+                uint64_t n      = len - i;
+
+                if (n > m->size - offset)
+                {
+                    n = m->size - offset;
+                }
+
+                memcpy(rx + i, m->mem + offset, n);
+                m->addr += n;
+                m->pos += (uint32_t)n;
+                i += (uint32_t)n;
+            }
+            return;
+        }
+
+        rx[i] = memchip_byte(dev, tx[i]);
+        i++;
+    }
+}
+
+/*
+ * Commands that modify the array take effect when C̅S̅ is released, and only
+ * if they were complete and write-enabled.
+ */
+static void memchip_deselect(struct emu_device *dev)
+{
+    struct memchip *m        = &dev->u.mem;
+    int             complete = m->pos > m->addr_bytes;
+
+    if (m->pos == 0)
+    {
+        return;
+    }
+
+    if (!m->ignored)
+    {
+        switch (m->cmd)
+        {
+        case CMD_WREN:
+            m->wel = 1;
+            break;
+        case CMD_WRDI:
+            m->wel = 0;
+            break;
+        case CMD_READ:
+        case CMD_FAST_READ:
+            m->reads++;
+            break;
+        case CMD_WRSR:
+            if (m->eeprom && m->wel && m->pos > 1)
+            {
+                m->status     = (uint8_t)(m->written & 0x8c);
+                m->busy_until = dev->now + m->page_ns;
+                m->wel        = 0;
+            }
+            break;
+        case CMD_PP:
+            if (m->wel && m->written > 0)
+            {
+                m->programs++;
+                m->busy_until = dev->now + m->page_ns;
+                m->wel        = 0;
+            }
+            break;
+        case CMD_SE:
+        case CMD_BE:
+            if (!m->eeprom && m->wel && complete)
+            {
+                uint64_t span = (m->cmd == CMD_SE) ? m->sector : m->block;
+
+                memset(m->mem + ((m->addr & (m->size - 1)) & ~(span - 1)), 0xff, span);
+                m->erases++;
+                m->busy_until = dev->now + ((m->cmd == CMD_SE) ? m->sector_ns : m->block_ns);
+                m->wel        = 0;
+            }
+            break;
+        case CMD_CE:
+        case CMD_CE_60:
+            if (!m->eeprom && m->wel && m->pos == 1)
+            {
+                memset(m->mem, 0xff, m->size);
+                m->erases++;
+                m->busy_until = dev->now + m->chip_ns;
+                m->wel        = 0;
+            }
+            break;
+        }
+    }
+
+    m->pos = 0;
+}
+
+static void memchip_report(const struct emu_device *dev, FILE *out)
+{
+    const struct memchip *m = &dev->u.mem;
+
+    fprintf(out, "emulate: %" PRIu64 " reads, %" PRIu64 " %s, %" PRIu64 " erases, %" PRIu64 " status polls while busy\n",
+            m->reads, m->programs, m->eeprom ? "page writes" : "page programs", m->erases, m->busy_polls);
+}
+
+static void memchip_release(struct emu_device *dev)
+{
+    free(dev->u.mem.mem);
+}
+
+static int adc_init(struct emu_device *dev)
+{
+    struct adc *adc = &dev->u.adc;
+
+    adc->rate  = emu_get(dev, "rate", 10000);
+    adc->depth = emu_get(dev, "fifo", 1024);
+    adc->t0    = monotonic_ns();
+
+    if (adc->rate == 0 || adc->depth == 0)
+    {
+        printf("emulate: rate and fifo must not be 0\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Bring the FIFO up to date with the samples converted since the last
+ * message, dropping the oldest ones if it overflowed.
+ */
+static void adc_sync(struct emu_device *dev)
+{
+    struct adc *adc      = &dev->u.adc;
+    uint64_t    elapsed  = dev->now - adc->t0;
+    uint64_t    produced = elapsed / NSEC_PER_SEC * adc->rate + elapsed % NSEC_PER_SEC * adc->rate / NSEC_PER_SEC;
+
+    if (produced - adc->next > adc->depth)
+    {
+        adc->dropped += produced - adc->next - adc->depth;
+        adc->next = produced - adc->depth;
+        adc->status |= 0x01;
+    }
+
+    adc->available = produced - adc->next;
+}
+
+static void adc_xfer(struct emu_device *dev, const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    struct adc *adc = &dev->u.adc;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        uint32_t index = adc->pos++;
+
+        if (index == 0)
+        {
+            adc->cmd     = tx[i];
+            adc->latched = (uint16_t)(adc->available > 0xffff ? 0xffff : adc->available);
+            rx[i]        = 0xff;
+            continue;
+        }
+
+        switch (adc->cmd)
+        {
+        case ADC_RDCNT:
+            rx[i] = (index == 1) ? (uint8_t)(adc->latched >> 8) : (index == 2) ? (uint8_t)adc->latched : 0xff;
+            break;
+        case ADC_RDFIFO:
+            if (index & 1)
+            {
+                if (adc->available > 0)
+                {
+                    adc->latched = (uint16_t)adc->next++;
+                    adc->available--;
+                    adc->samples_read++;
+                }
+                else
+                {
+                    adc->latched = 0xffff;
+                    adc->status |= 0x02;
+                    adc->underruns++;
+                }
+                rx[i] = (uint8_t)(adc->latched >> 8);
+            }
+            else
+            {
+                rx[i] = (uint8_t)adc->latched;
+            }
+            break;
+        case ADC_RDSTAT:
+            rx[i]       = adc->status;
+            adc->status = 0;
+            break;
+        default:
+            rx[i] = 0xff;
+            break;
+        }
+    }
+}
+
+static void adc_deselect(struct emu_device *dev)
+{
+    dev->u.adc.pos = 0;
+}
+
+static void adc_report(const struct emu_device *dev, FILE *out)
+{
+    const struct adc *adc = &dev->u.adc;
+
+    fprintf(out, "emulate: %" PRIu64 " samples read, %" PRIu64 " dropped on FIFO overflow, %" PRIu64 " underrun reads\n",
+            adc->samples_read, adc->dropped, adc->underruns);
+}
+
+static const struct emu_model s_models[] = {
+    {"loop", NULL, NULL, loop_xfer, NULL, NULL, NULL},
+    {"nor", nor_init, NULL, memchip_xfer, memchip_deselect, memchip_report, memchip_release},
+    {"eeprom", eeprom_init, NULL, memchip_xfer, memchip_deselect, memchip_report, memchip_release},
+    {"adc", adc_init, adc_sync, adc_xfer, adc_deselect, adc_report, NULL},
+};
+
+struct emu_device *emu_open(const char *spec, uint32_t speed_hz)
+{
+    struct emu_device *dev;
+    const char        *colon    = strchr(spec, ':');
+    size_t             name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    if ((dev = calloc(1, sizeof(*dev))) == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(s_models) / sizeof(s_models[0]); i++)
+    {
+        if (strlen(s_models[i].name) == name_len && strncmp(s_models[i].name, spec, name_len) == 0)
+        {
+            dev->model = &s_models[i];
+        }
+    }
+
+    if (dev->model == NULL)
+    {
+        printf("emulate: unknown model \"%.*s\" (loop, nor, eeprom or adc)\n", (int)name_len, spec);
+        free(dev);
+        return NULL;
+    }
+
+    dev->speed_hz = speed_hz;
+    dev->now      = monotonic_ns();
+
+    if (parse_opts(dev, colon ? colon + 1 : NULL) < 0)
+    {
+        free(dev);
+        return NULL;
+    }
+
+    dev->timing = (int)emu_get(dev, "timing", 0);
+
+    if (dev->model->init != NULL && dev->model->init(dev) < 0)
+    {
+        free(dev);
+        return NULL;
+    }
+
+    for (int i = 0; i < dev->opt_count; i++)
+    {
+        if (!dev->opts[i].used)
+        {
+            printf("emulate: %s has no option \"%s\"\n", dev->model->name, dev->opts[i].key);
+            emu_close(dev);
+            return NULL;
+        }
+    }
+
+    return dev;
+}
+
+int emu_transfer(struct emu_device *dev, const struct spi_ioc_transfer *xfers, unsigned int count)
+{
+    uint64_t wire_ns = 0;
+    int      total   = 0;
+
+    dev->now = monotonic_ns();
+
+    if (dev->model->sync != NULL)
+    {
+        dev->model->sync(dev);
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const struct spi_ioc_transfer *x      = &xfers[i];
+        const uint8_t                 *tx     = (const uint8_t *)(uintptr_t)x->tx_buf;
+        uint8_t                       *rx     = (uint8_t *)(uintptr_t)x->rx_buf;
+        uint32_t                       speed  = x->speed_hz ? x->speed_hz : dev->speed_hz;
+        uint32_t                       bits   = x->bits_per_word ? x->bits_per_word : 8;
+        uint32_t                       remain = x->len;
+        int                            last   = (i + 1 == count);
+
+        // A missing TX buffer clocks out zeros, a missing RX buffer discards.
+        while (remain > 0)
+        {
+            uint32_t n = (remain < EMU_CHUNK) ? remain : EMU_CHUNK;
+
+            dev->model->xfer(dev, tx ? tx : s_zero, rx ? rx : s_scratch, n);
+            tx = tx ? tx + n : NULL;
+            rx = rx ? rx + n : NULL;
+            remain -= n;
+        }
+
+        total += (int)x->len;
+
+        if (speed > 0)
+        {
+            // Words wider than 8 bits take 2 (or 4) bytes in the buffers, as on spidev.
+            uint32_t word_size = (bits <= 8) ? 1 : (bits <= 16) ? 2 : 4;
+
+            wire_ns += (uint64_t)(x->len / word_size) * bits * NSEC_PER_SEC / speed;
+        }
+        wire_ns += (uint64_t)x->delay_usecs * NSEC_PER_USEC;
+
+        // cs_change releases C̅S̅ between transfers, and keeps it after the last.
+        if ((last ? !x->cs_change : x->cs_change) && dev->model->deselect != NULL)
+        {
+            dev->model->deselect(dev);
+        }
+    }
+
+    dev->messages++;
+    dev->bytes += (uint64_t)total;
+
+    if (dev->timing)
+    {
+        uint64_t deadline_ns = dev->now + wire_ns;
+
+        // Sleep most of the way, then spin for the last stretch.
+        if (deadline_ns > monotonic_ns() + EMU_SPIN_NS)
+        {
+            sleep_until_ns(deadline_ns - EMU_SPIN_NS);
+        }
+
+        while (monotonic_ns() < deadline_ns)
+        {
+        }
+    }
+
+    return total;
+}
+
+void emu_report(const struct emu_device *dev, FILE *out)
+{
+    fprintf(out, "\nemulate: %s, %" PRIu64 " messages, %" PRIu64 " bytes\n", dev->model->name, dev->messages,
+            dev->bytes);
+
+    if (dev->model->report != NULL)
+    {
+        dev->model->report(dev, out);
+    }
+}
+
+void emu_close(struct emu_device *dev)
+{
+    if (dev == NULL)
+    {
+        return;
+    }
+
+    if (dev->model->release != NULL)
+    {
+        dev->model->release(dev);
+    }
+
+    free(dev);
+}
@@ -0,0 +1,34 @@
+/*
+ * Emulated SPI peripherals that stand in for the spidev device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_EMULATE_H
+#define SPIDEV_EMULATE_H
+
+#include <linux/spi/spidev.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct emu_device;
+
+/*
+ * Create a peripheral from a "model[:key=value,...]" spec, for example
+ * "nor:size=16M,sector_ms=45". speed_hz is the bus speed used for the
+ * modelled bus timing of transfers that do not set their own. Prints the
+ * reason and returns NULL if the spec is not valid.
+ */
+struct emu_device *emu_open(const char *spec, uint32_t speed_hz);
+
+/*
+ * Run the transfers of one SPI_IOC_MESSAGE against the peripheral, with
+ * the same return value as the ioctl.
+ */
+int  emu_transfer(struct emu_device *dev, const struct spi_ioc_transfer *xfers, unsigned int count);
+void emu_report(const struct emu_device *dev, FILE *out);
+void emu_close(struct emu_device *dev);
+
+#endif // SPIDEV_EMULATE_H
@@ -0,0 +1,915 @@
+/*
+ * In-memory table of the frames of a -f frame file.
+ *
+ * The frame file is parsed once, before the device is opened, so that the
+ * transfer loop only indexes memory instead of reopening and seeking the
+ * file for every frame. Large files are split at line boundaries and
+ * parsed on all cores.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "frames.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decompress.h"
+#include "timing.h"
+
+// Files smaller than this are parsed on the calling thread.
+#define LOAD_PARALLEL_MIN (4u << 20)
+#define LOAD_CHUNK_MIN (1u << 20)
+#define LOAD_MAX_THREADS 64
+#define LOAD_BLOCK (256u << 10)
+#define STREAM_BLOCK (256u << 10)
+#define STREAM_POLL_MS 100
+
+struct load_chunk
+{
+    pthread_t          thread;
+    int                fd;
+    off_t              start;    // first byte of the chunk; it owns the lines starting in [start, end)
+    off_t              end;
+    uint32_t           max_len;
+    struct frame_table table;    // frames of the chunk, with offsets from 0
+    uint32_t           lines;    // lines parsed, up to and including bad_line
+    uint32_t           bad_line; // line within the chunk, or 0
+    char               bad_char; // character that made bad_line invalid, or 0 if it was too long
+    int                error;
+
+    // Where the chunk goes in the stitched table.
+    struct frame_table *out;
+    uint32_t            first_frame;
+    size_t              first_byte;
+};
+
+struct stream_block
+{
+    char  *data;
+    size_t len;
+    int    full; // filled by the reader and not yet consumed
+};
+
+struct frame_stream
+{
+    int                          fd;
+    const char                  *path;
+    uint32_t                     max_len;
+    const volatile sig_atomic_t *stop;
+    pthread_t                    thread;
+    pthread_mutex_t              lock;
+    pthread_cond_t               cond;
+    struct stream_block          blocks[2];
+    int                          eof;
+    int                          error;
+    int                          closing;
+
+    // Consumer side: the block being decoded and the start of a line that
+    // runs on into the next block.
+    uint32_t current;
+    int      holding;
+    size_t   pos;
+    char    *carry;
+    size_t   carry_len;
+    size_t   carry_cap;
+    uint32_t line_no;
+    int      bad;
+};
+
+static void strip(char *string)
+{
+    int count = 0;
+
+    for (int i = 0; string[i]; i++)
+    {
+        if (string[i] != '\r' && string[i] != '\n')
+        {
+            string[count++] = string[i];
+        }
+    }
+
+    string[count] = '\0';
+}
+
+/*
+ * Decode len characters of hexadecimal digits, skipping spaces and carriage
+ * returns. The carriage returns are left out as strip() would, so the line
+ * length that the odd-length padding and the size check go by is the same
+ * as before the lines were read in place. On error, *bad is the character
+ * that is not a digit, or 0 if the data does not fit in bin_length bytes.
+ */
+static int decode_hex(const char *hex, size_t len, uint8_t *bin, uint32_t bin_length, char *bad)
+{
+    const char *hexEnd    = hex + len;
+    uint8_t    *cur       = bin;
+    size_t      hexLength = 0;
+    uint8_t     numChars;
+    uint8_t     byte      = 0;
+    int         rval;
+
+    for (const char *p = hex; p < hexEnd; p++)
+    {
+        if (*p != '\r')
+        {
+            hexLength++;
+        }
+    }
+
+    if ((hexLength + 1) / 2 > bin_length)
+    {
+        *bad = 0;
+        return -1;
+    }
+
+    numChars = hexLength & 1;
+
+    while (hex < hexEnd)
+    {
+        if ('A' <= *hex && *hex <= 'F')
+        {
+            byte |= 10 + (*hex - 'A');
+        }
+        else if ('a' <= *hex && *hex <= 'f')
+        {
+            byte |= 10 + (*hex - 'a');
+        }
+        else if ('0' <= *hex && *hex <= '9')
+        {
+            byte |= *hex - '0';
+        }
+        else if (*hex == ' ' || *hex == '\r')
+        {
+            hex++;
+            continue;
+        }
+        else
+        {
+            *bad = *hex;
+            return -1;
+        }
+
+        hex++;
+        numChars++;
+
+        if (numChars >= 2)
+        {
+            numChars = 0;
+            *cur++   = byte;
+            byte     = 0;
+        }
+        else
+        {
+            byte <<= 4;
+        }
+    }
+
+    rval = (int)(cur - bin);
+
+    return rval;
+}
+
+/*
+ * Convert a line of hexadecimal digits, optionally separated by spaces, to
+ * bytes.
+ */
+int hex_to_bin(const char *hex, uint8_t *bin, uint32_t bin_length)
+{
+    char bad;
+    int  len = decode_hex(hex, strlen(hex), bin, bin_length, &bad);
+
+    if (len < 0 && bad != 0)
+    {
+        printf("Unknown Character (0x%02x|%c)", bad, bad);
+    }
+
+    return len;
+}
+
+void frame_table_init(struct frame_table *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+int frame_table_append(struct frame_table *table, const uint8_t *data, uint32_t len)
+{
+    if (table->count + 2 > table->size)
+    {
+        uint32_t size    = table->size ? table->size * 2 : 64;
+        size_t  *offsets = realloc(table->offsets, size * sizeof(*offsets));
+
+        if (offsets == NULL)
+        {
+            return -1;
+        }
+
+        offsets[0]     = 0;
+        table->offsets = offsets;
+        table->size    = size;
+    }
+
+    if (table->data_len + len > table->data_size)
+    {
+        size_t   size = table->data_size ? table->data_size : 4096;
+        uint8_t *buf;
+
+        while (table->data_len + len > size)
+        {
+            size *= 2;
+        }
+
+        if ((buf = realloc(table->data, size)) == NULL)
+        {
+            return -1;
+        }
+
+        table->data      = buf;
+        table->data_size = size;
+    }
+
+    memcpy(table->data + table->data_len, data, len);
+    table->data_len += len;
+    table->offsets[++table->count] = table->data_len;
+
+    return 0;
+}
+
+/*
+ * Decode one line of a chunk. After an invalid line the rest of the chunk
+ * is only counted, so that later chunks can number their lines.
+ */
+static int load_line(struct load_chunk *chunk, const char *line, size_t len, uint8_t *frame)
+{
+    int frame_len;
+
+    chunk->lines++;
+    if (chunk->bad_line != 0)
+    {
+        return 0;
+    }
+
+    // The serial loader reads lines as strings, so a NUL ends the line there too.
+    len = strnlen(line, len);
+
+    if ((frame_len = decode_hex(line, len, frame, chunk->max_len, &chunk->bad_char)) < 0)
+    {
+        chunk->bad_line = chunk->lines;
+        return 0;
+    }
+
+    if (frame_table_append(&chunk->table, frame, (uint32_t)frame_len) < 0)
+    {
+        chunk->error = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the lines that start inside one chunk of the file. The line that
+ * runs into the chunk is left to the previous one, and the last line is
+ * read past the end of the chunk.
+ */
+static void *load_thread(void *arg)
+{
+    struct load_chunk *chunk   = arg;
+    size_t             cap     = LOAD_BLOCK;
+    size_t             fill    = 0;
+    char              *buf     = malloc(cap);
+    uint8_t           *frame   = malloc(chunk->max_len ? chunk->max_len : 1);
+    off_t              buf_pos = (chunk->start > 0) ? chunk->start - 1 : 0; // file offset of buf[0]
+    int                skip    = (chunk->start > 0);
+    int                eof     = 0;
+
+    if (buf == NULL || frame == NULL)
+    {
+        chunk->error = 1;
+        goto exit;
+    }
+
+    while (!eof)
+    {
+        char   *p = buf;
+        char   *end;
+        ssize_t n;
+
+        if (fill == cap)
+        {
+            // A line longer than the buffer.
+            char *bigger = realloc(buf, cap * 2);
+
+            if (bigger == NULL)
+            {
+                chunk->error = 1;
+                goto exit;
+            }
+
+            buf = bigger;
+            cap *= 2;
+        }
+
+        if ((n = pread(chunk->fd, buf + fill, cap - fill, buf_pos + (off_t)fill)) < 0)
+        {
+            chunk->error = 1;
+            goto exit;
+        }
+
+        eof = (n == 0);
+        fill += (size_t)n;
+        end = buf + fill;
+
+        if (skip)
+        {
+            char *nl = memchr(p, '\n', fill);
+
+            if (nl == NULL)
+            {
+                buf_pos += (off_t)fill;
+                fill = 0;
+                continue;
+            }
+
+            p    = nl + 1;
+            skip = 0;
+        }
+
+        while (p < end)
+        {
+            char *nl;
+
+            if (buf_pos + (p - buf) >= chunk->end)
+            {
+                goto exit;
+            }
+
+            if ((nl = memchr(p, '\n', (size_t)(end - p))) == NULL && !eof)
+            {
+                break;
+            }
+
+            if (load_line(chunk, p, (size_t)((nl ? nl : end) - p), frame) < 0)
+            {
+                goto exit;
+            }
+
+            p = nl ? nl + 1 : end;
+        }
+
+        // Keep the partial line at the front of the buffer.
+        buf_pos += p - buf;
+        fill = (size_t)(end - p);
+        memmove(buf, p, fill);
+    }
+
+exit:
+    free(frame);
+    free(buf);
+
+    return NULL;
+}
+
+static void *stitch_thread(void *arg)
+{
+    struct load_chunk  *chunk = arg;
+    struct frame_table *out   = chunk->out;
+
+    memcpy(out->data + chunk->first_byte, chunk->table.data, chunk->table.data_len);
+
+    for (uint32_t i = 0; i < chunk->table.count; i++)
+    {
+        out->offsets[chunk->first_frame + i + 1] = chunk->first_byte + chunk->table.offsets[i + 1];
+    }
+
+    frame_table_free(&chunk->table);
+
+    return NULL;
+}
+
+/*
+ * Run fn on every chunk, one thread each. Chunks that do not get a thread
+ * are run on the calling thread.
+ */
+static void run_chunks(struct load_chunk *chunks, uint32_t count, void *(*fn)(void *))
+{
+    uint32_t started;
+
+    for (started = 0; started < count; started++)
+    {
+        if (pthread_create(&chunks[started].thread, NULL, fn, &chunks[started]) != 0)
+        {
+            break;
+        }
+    }
+
+    for (uint32_t i = started; i < count; i++)
+    {
+        fn(&chunks[i]);
+    }
+
+    for (uint32_t i = 0; i < started; i++)
+    {
+        pthread_join(chunks[i].thread, NULL);
+    }
+}
+
+/*
+ * Split the file into one chunk per thread at line boundaries, parse the
+ * chunks concurrently and copy them, concurrently again, into one table in
+ * file order. The result is the table the serial loader would build.
+ */
+static int load_parallel(struct frame_table *table, int fd, const char *path, off_t size, uint32_t max_len,
+                         uint32_t threads)
+{
+    struct load_chunk chunks[LOAD_MAX_THREADS];
+    uint32_t          count     = threads;
+    uint32_t          used      = 0;
+    uint32_t          line_base = 0;
+    uint32_t          frames    = 0;
+    size_t            bytes     = 0;
+    int               ret       = -1;
+    uint64_t          start_ns  = monotonic_ns();
+
+    if ((off_t)count > size / LOAD_CHUNK_MIN)
+    {
+        count = (uint32_t)(size / LOAD_CHUNK_MIN);
+    }
+
+    memset(chunks, 0, sizeof(chunks));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        chunks[i].fd      = fd;
+        chunks[i].start   = size * i / count;
+        chunks[i].end     = size * (i + 1) / count;
+        chunks[i].max_len = max_len;
+    }
+
+    run_chunks(chunks, count, load_thread);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (chunks[i].error)
+        {
+            goto exit;
+        }
+    }
+
+    // The table ends at the first invalid line, as with the serial loader.
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct load_chunk *chunk = &chunks[i];
+
+        if (table->bad_line == 0)
+        {
+            chunk->out         = table;
+            chunk->first_frame = frames;
+            chunk->first_byte  = bytes;
+            frames += chunk->table.count;
+            bytes += chunk->table.data_len;
+            used++;
+        }
+
+        if (chunk->bad_line != 0)
+        {
+            if (chunk->bad_char != 0 && table->bad_line == 0)
+            {
+                printf("Unknown Character (0x%02x|%c)", chunk->bad_char, chunk->bad_char);
+            }
+
+            if (table->bad_line == 0)
+            {
+                table->bad_line = line_base + chunk->bad_line;
+                printf("%s:%u: not a valid frame, ignoring the rest of the file\n", path, table->bad_line);
+            }
+            else
+            {
+                printf("%s:%u: not a valid frame either\n", path, line_base + chunk->bad_line);
+            }
+        }
+
+        line_base += chunk->lines;
+    }
+
+    if ((table->data = malloc(bytes ? bytes : 1)) == NULL ||
+        (table->offsets = malloc((frames + 1) * sizeof(*table->offsets))) == NULL)
+    {
+        goto exit;
+    }
+
+    table->offsets[0] = 0;
+    table->data_size  = bytes ? bytes : 1;
+    table->size       = frames + 1;
+
+    run_chunks(chunks, used, stitch_thread);
+
+    table->data_len = bytes;
+    table->count    = frames;
+    ret             = (int)frames;
+
+    fprintf(stderr, "frames: %u frames from %.1f MiB on %u threads in %.3f ms\n", frames,
+            (double)size / (1 << 20), count, (double)(monotonic_ns() - start_ns) / NSEC_PER_MSEC);
+
+exit:
+    for (uint32_t i = 0; i < count; i++)
+    {
+        frame_table_free(&chunks[i].table);
+    }
+
+    return ret;
+}
+
+/*
+ * Parse every line of the frame file. A line that is not valid hexadecimal,
+ * or longer than max_len bytes, ends the table as it used to end the
+ * transfer loop. Large files are parsed on all cores, and gzip or zstd
+ * files are decompressed on a helper thread while they are parsed. Returns
+ * the number of frames, or -1 on error.
+ */
+int frame_table_load(struct frame_table *table, const char *path, uint32_t max_len)
+{
+    FILE       *fp;
+    char       *line     = NULL;
+    size_t      line_cap = 0;
+    uint8_t    *frame;
+    uint32_t    line_no  = 0;
+    int         fd;
+    int         len;
+    int         ret      = 0;
+    struct stat st;
+    long        cpus     = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return -1;
+    }
+
+    if ((ret = decompress_open(fd, path, &fp)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (ret == 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)LOAD_PARALLEL_MIN && cpus > 1 &&
+        table->count == 0)
+    {
+        ret = load_parallel(table, fd, path, st.st_size, max_len,
+                            (cpus > LOAD_MAX_THREADS) ? LOAD_MAX_THREADS : (uint32_t)cpus);
+        close(fd);
+        return ret;
+    }
+
+    if (ret == 0 && (fp = fdopen(fd, "r")) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    ret = 0;
+
+    if ((frame = malloc(max_len)) == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    while (getline(&line, &line_cap, fp) >= 0)
+    {
+        line_no++;
+        strip(line);
+
+        if ((len = hex_to_bin(line, frame, max_len)) < 0)
+        {
+            printf("%s:%u: not a valid frame, ignoring the rest of the file\n", path, line_no);
+            table->bad_line = line_no;
+            break;
+        }
+
+        if (frame_table_append(table, frame, (uint32_t)len) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    // getline() also stops on a read error, such as corrupt compressed data.
+    if (ferror(fp))
+    {
+        ret = -1;
+    }
+
+    free(line);
+    free(frame);
+    fclose(fp);
+
+    return (ret < 0) ? -1 : (int)table->count;
+}
+
+void frame_table_free(struct frame_table *table)
+{
+    free(table->data);
+    free(table->offsets);
+    frame_table_init(table);
+}
+
+int frame_path_is_stream(const char *path)
+{
+    struct stat st;
+
+    return strcmp(path, "-") == 0 || (stat(path, &st) == 0 && !S_ISREG(st.st_mode));
+}
+
+static void *stream_thread(void *arg)
+{
+    struct frame_stream *stream = arg;
+    struct pollfd        pfd    = {.fd = stream->fd, .events = POLLIN};
+    uint32_t             next   = 0;
+    ssize_t              n      = 0;
+
+    for (;;)
+    {
+        struct stream_block *block = &stream->blocks[next];
+        int                  ready;
+
+        pthread_mutex_lock(&stream->lock);
+        while (block->full && !stream->closing)
+        {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        // Poll rather than block in read(), so that closing never waits on the writer.
+        while ((ready = poll(&pfd, 1, STREAM_POLL_MS)) <= 0 && !__atomic_load_n(&stream->closing, __ATOMIC_ACQUIRE))
+        {
+            if (ready < 0 && errno != EINTR)
+            {
+                break;
+            }
+        }
+
+        if (__atomic_load_n(&stream->closing, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        // Whatever is there, up to a block: a slow generator is not kept waiting for a full one.
+        while ((n = read(stream->fd, block->data, STREAM_BLOCK)) < 0 && errno == EINTR)
+        {
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        if (n > 0)
+        {
+            block->len  = (size_t)n;
+            block->full = 1;
+            next ^= 1;
+        }
+        else
+        {
+            stream->eof   = 1;
+            stream->error = (n < 0);
+        }
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+struct frame_stream *frame_stream_open(const char *path, uint32_t max_len, const volatile sig_atomic_t *stop)
+{
+    struct frame_stream *stream = calloc(1, sizeof(*stream));
+    sigset_t             all;
+    sigset_t             old;
+    int                  ret;
+
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+
+    stream->path      = path;
+    stream->max_len   = max_len;
+    stream->stop      = stop;
+    // Room for "xx " per byte and a carriage return; longer lines are not valid frames.
+    stream->carry_cap = (size_t)max_len * 3 + 2;
+
+    if ((stream->blocks[0].data = malloc(STREAM_BLOCK)) == NULL ||
+        (stream->blocks[1].data = malloc(STREAM_BLOCK)) == NULL || (stream->carry = malloc(stream->carry_cap)) == NULL)
+    {
+        goto fail;
+    }
+
+    stream->fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (stream->fd < 0)
+    {
+        goto fail;
+    }
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&stream->thread, NULL, stream_thread, stream);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret == 0)
+    {
+        return stream;
+    }
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    if (stream->fd != STDIN_FILENO)
+    {
+        close(stream->fd);
+    }
+
+fail:
+    free(stream->carry);
+    free(stream->blocks[1].data);
+    free(stream->blocks[0].data);
+    free(stream);
+
+    return NULL;
+}
+
+/*
+ * Wait until the reader has filled the current block. Returns 0 at the end
+ * of the input or when stopped.
+ */
+static int stream_wait(struct frame_stream *stream)
+{
+    struct stream_block *block = &stream->blocks[stream->current];
+    int                  full;
+
+    pthread_mutex_lock(&stream->lock);
+    while (!block->full && !stream->eof && !*stream->stop)
+    {
+        struct timespec deadline;
+
+        // Timed, because the stop signal does not wake a condition wait.
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += STREAM_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&stream->cond, &stream->lock, &deadline);
+    }
+    full = block->full;
+    pthread_mutex_unlock(&stream->lock);
+
+    return full;
+}
+
+// Hand the current block back to the reader.
+static void stream_release(struct frame_stream *stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->blocks[stream->current].full = 0;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    stream->current ^= 1;
+    stream->holding = 0;
+    stream->pos     = 0;
+}
+
+// A len larger than the carry buffer is a line too long to be a frame.
+static int stream_line(struct frame_stream *stream, const char *line, size_t len, uint8_t *frame)
+{
+    char bad       = 0;
+    int  frame_len = -1;
+
+    stream->line_no++;
+
+    if (len <= stream->carry_cap)
+    {
+        // As with files, a NUL ends the line.
+        len       = strnlen(line, len);
+        frame_len = decode_hex(line, len, frame, stream->max_len, &bad);
+    }
+
+    if (frame_len < 0)
+    {
+        if (bad != 0)
+        {
+            printf("Unknown Character (0x%02x|%c)", bad, bad);
+        }
+        printf("%s:%u: not a valid frame, ignoring the rest of the input\n", stream->path, stream->line_no);
+        stream->bad = 1;
+        return -1;
+    }
+
+    return frame_len;
+}
+
+int frame_stream_next(struct frame_stream *stream, uint8_t *frame)
+{
+    while (!stream->bad)
+    {
+        struct stream_block *block;
+        char                *start;
+        char                *nl;
+        size_t               len;
+
+        if (!stream->holding)
+        {
+            if (!stream_wait(stream))
+            {
+                // The last line may have no newline.
+                if (stream->carry_len > 0 && !*stream->stop)
+                {
+                    len               = stream->carry_len;
+                    stream->carry_len = 0;
+                    return stream_line(stream, stream->carry, len, frame);
+                }
+                return -1;
+            }
+            stream->holding = 1;
+        }
+
+        block = &stream->blocks[stream->current];
+        start = block->data + stream->pos;
+        len   = block->len - stream->pos;
+
+        if ((nl = memchr(start, '\n', len)) == NULL)
+        {
+            // Keep the start of the line and move on to the next block.
+            if (stream->carry_len + len > stream->carry_cap)
+            {
+                return stream_line(stream, NULL, SIZE_MAX, frame);
+            }
+
+            memcpy(stream->carry + stream->carry_len, start, len);
+            stream->carry_len += len;
+            stream_release(stream);
+            continue;
+        }
+
+        len         = (size_t)(nl - start);
+        stream->pos = (size_t)(nl + 1 - block->data);
+
+        if (stream->carry_len == 0)
+        {
+            return stream_line(stream, start, len, frame);
+        }
+
+        if (stream->carry_len + len > stream->carry_cap)
+        {
+            return stream_line(stream, NULL, SIZE_MAX, frame);
+        }
+
+        memcpy(stream->carry + stream->carry_len, start, len);
+        len               = stream->carry_len + len;
+        stream->carry_len = 0;
+
+        return stream_line(stream, stream->carry, len, frame);
+    }
+
+    return -1;
+}
+
+int frame_stream_close(struct frame_stream *stream)
+{
+    int error;
+
+    pthread_mutex_lock(&stream->lock);
+    __atomic_store_n(&stream->closing, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->thread, NULL);
+    error = stream->error;
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    if (stream->fd != STDIN_FILENO)
+    {
+        close(stream->fd);
+    }
+    free(stream->carry);
+    free(stream->blocks[1].data);
+    free(stream->blocks[0].data);
+    free(stream);
+
+    return error ? -1 : 0;
+}
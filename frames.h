@@ -0,0 +1,69 @@
+/*
+ * In-memory table of the frames of a -f frame file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_FRAMES_H
+#define SPIDEV_FRAMES_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The frames are stored back to back in `data`. Frame i spans
+ * [offsets[i], offsets[i + 1]), so the table holds count + 1 offsets.
+ * bad_line is the line at which loading stopped on invalid data, or 0.
+ */
+struct frame_table
+{
+    uint8_t  *data;
+    size_t    data_len;
+    size_t    data_size;
+    size_t   *offsets;
+    uint32_t  count;
+    uint32_t  size;
+    uint32_t  bad_line;
+};
+
+static inline const uint8_t *frame_table_data(const struct frame_table *table, uint32_t frame)
+{
+    return table->data + table->offsets[frame];
+}
+
+static inline uint32_t frame_table_len(const struct frame_table *table, uint32_t frame)
+{
+    return (uint32_t)(table->offsets[frame + 1] - table->offsets[frame]);
+}
+
+int  hex_to_bin(const char *hex, uint8_t *bin, uint32_t bin_length);
+void frame_table_init(struct frame_table *table);
+int  frame_table_append(struct frame_table *table, const uint8_t *data, uint32_t len);
+int  frame_table_load(struct frame_table *table, const char *path, uint32_t max_len);
+void frame_table_free(struct frame_table *table);
+
+/*
+ * Frames read incrementally from a pipe, FIFO or other stream that cannot
+ * be loaded up front ("-" is stdin). A reader thread fills two blocks in
+ * turn while the caller decodes the other, and waits while both are full,
+ * so a generator writing faster than the bus is held back by the pipe.
+ */
+struct frame_stream;
+
+int                  frame_path_is_stream(const char *path);
+struct frame_stream *frame_stream_open(const char *path, uint32_t max_len, const volatile sig_atomic_t *stop);
+
+/*
+ * Decode the next frame into `frame`, waiting for input if needed. Returns
+ * its length, or -1 at the end of the input, on an invalid line, or once
+ * *stop is set.
+ */
+int frame_stream_next(struct frame_stream *stream, uint8_t *frame);
+
+// Returns -1 if the input could not be read.
+int frame_stream_close(struct frame_stream *stream);
+
+#endif // SPIDEV_FRAMES_H
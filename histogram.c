@@ -0,0 +1,119 @@
+/*
+ * Fixed-size log-linear histogram for latency measurements.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+static uint32_t hist_index(uint64_t value)
+{
+    uint32_t exponent;
+
+    if (value < HIST_SUB_COUNT)
+    {
+        return (uint32_t)value;
+    }
+
+    exponent = 63 - (uint32_t)__builtin_clzll(value);
+
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+           (uint32_t)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+static uint64_t hist_upper_bound(uint32_t index)
+{
+    uint32_t group = index / HIST_SUB_COUNT;
+    uint32_t sub   = index % HIST_SUB_COUNT;
+
+    if (group == 0)
+    {
+        return index;
+    }
+
+    return (((uint64_t)(HIST_SUB_COUNT + sub + 1)) << (group - 1)) - 1;
+}
+
+void hist_init(struct histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+void hist_add(struct histogram *hist, uint64_t value)
+{
+    hist->buckets[hist_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+
+    if (value < hist->min)
+    {
+        hist->min = value;
+    }
+
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->min < dst->min)
+    {
+        dst->min = src->min;
+    }
+
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+uint64_t hist_percentile(const struct histogram *hist, double percent)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+
+    rank = (uint64_t)(percent / 100.0 * (double)hist->count + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+
+        if (seen >= rank)
+        {
+            uint64_t bound = hist_upper_bound(i);
+
+            return (bound > hist->max) ? hist->max : (bound < hist->min ? hist->min : bound);
+        }
+    }
+
+    return hist->max;
+}
+
+uint64_t hist_mean(const struct histogram *hist)
+{
+    return (hist->count == 0) ? 0 : hist->sum / hist->count;
+}
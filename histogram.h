@@ -0,0 +1,38 @@
+/*
+ * Fixed-size log-linear histogram for latency measurements.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_HISTOGRAM_H
+#define SPIDEV_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Every power of two is split into 2^HIST_SUB_BITS linear sub-buckets, which
+ * bounds the relative error to about 12% over the whole uint64_t range while
+ * keeping a histogram small enough to be embedded in per-frame statistics.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void     hist_init(struct histogram *hist);
+void     hist_add(struct histogram *hist, uint64_t value);
+void     hist_merge(struct histogram *dst, const struct histogram *src);
+uint64_t hist_percentile(const struct histogram *hist, double percent);
+uint64_t hist_mean(const struct histogram *hist);
+
+#endif // SPIDEV_HISTOGRAM_H
@@ -0,0 +1,384 @@
+/*
+ * Counters and latency histograms of a run, served in the Prometheus text
+ * format.
+ *
+ * A server thread answers each connection on a Unix socket with the
+ * current values and closes it. A request starting with "GET " gets an
+ * HTTP/1.0 response, so that `curl --unix-socket` and HTTP proxies work;
+ * anything else gets the bare text. Alternatively, or as well, the
+ * thread writes the text for the node exporter textfile collector every
+ * interval, through a temporary file and a rename.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define METRICS_POLL_MS 100
+#define METRICS_REQUEST_MS 100
+
+const uint64_t g_metrics_bounds_ns[METRICS_LATENCY_BUCKETS] = {
+    10 * NSEC_PER_USEC,  25 * NSEC_PER_USEC,  50 * NSEC_PER_USEC,  100 * NSEC_PER_USEC,
+    250 * NSEC_PER_USEC, 500 * NSEC_PER_USEC, 1 * NSEC_PER_MSEC,   2500 * NSEC_PER_USEC,
+    5 * NSEC_PER_MSEC,   10 * NSEC_PER_MSEC,  25 * NSEC_PER_MSEC,  50 * NSEC_PER_MSEC,
+    100 * NSEC_PER_MSEC, 250 * NSEC_PER_MSEC, 500 * NSEC_PER_MSEC, 1 * NSEC_PER_SEC,
+};
+
+static struct metrics_counters *s_writers[METRICS_MAX_WRITERS];
+static uint32_t                 s_writer_count = 0;
+static const char              *s_socket_path  = NULL;
+static const char              *s_file_path    = NULL;
+static uint64_t                 s_interval_ns  = 0;
+static int                      s_listen_fd    = -1;
+static int                      s_stop         = 0;
+static int                      s_running      = 0;
+static pthread_t                s_thread;
+
+struct metrics_counters *metrics_register(const char *device)
+{
+    struct metrics_counters *m;
+
+    if (s_writer_count == METRICS_MAX_WRITERS || posix_memalign((void **)&m, 64, sizeof(*m)) != 0)
+    {
+        return NULL;
+    }
+
+    memset(m, 0, sizeof(*m));
+    snprintf(m->device, sizeof(m->device), "%s", device);
+    s_writers[s_writer_count++] = m;
+
+    return m;
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint32_t metrics_snapshot(struct metrics_counters *out, uint32_t max)
+{
+    uint32_t count = (s_writer_count < max) ? s_writer_count : max;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const struct metrics_counters *m = s_writers[i];
+
+        out[i].frames          = load(&m->frames);
+        out[i].bytes           = load(&m->bytes);
+        out[i].ioctl_errors    = load(&m->ioctl_errors);
+        out[i].verified        = load(&m->verified);
+        out[i].verify_failures = load(&m->verify_failures);
+        out[i].latency_sum_ns  = load(&m->latency_sum_ns);
+        for (uint32_t bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++)
+        {
+            out[i].latency_buckets[bucket] = load(&m->latency_buckets[bucket]);
+        }
+        out[i].frame = load(&m->frame);
+        memcpy(out[i].device, m->device, sizeof(out[i].device));
+    }
+
+    return count;
+}
+
+/*
+ * The device as a label value, with the characters the format escapes.
+ */
+static void print_label(FILE *out, const char *device)
+{
+    fputs("{device=\"", out);
+    for (const char *c = device; *c != '\0'; c++)
+    {
+        if (*c == '\\' || *c == '"')
+        {
+            fputc('\\', out);
+            fputc(*c, out);
+        }
+        else if (*c == '\n')
+        {
+            fputs("\\n", out);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void print_counter(FILE *out, const char *name, const char *type, const char *help, size_t offset)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (uint32_t i = 0; i < s_writer_count; i++)
+    {
+        fputs(name, out);
+        print_label(out, s_writers[i]->device);
+        fprintf(out, "} %llu\n", (unsigned long long)load((const uint64_t *)((const char *)s_writers[i] + offset)));
+    }
+}
+
+static void print_latency(FILE *out)
+{
+    const char *name = "spidev_transfer_latency_seconds";
+
+    fprintf(out, "# HELP %s Time of each SPI_IOC_MESSAGE, per frame.\n# TYPE %s histogram\n", name, name);
+    for (uint32_t i = 0; i < s_writer_count; i++)
+    {
+        const struct metrics_counters *m     = s_writers[i];
+        uint64_t                       count = 0;
+
+        for (uint32_t bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++)
+        {
+            count += load(&m->latency_buckets[bucket]);
+            fprintf(out, "%s_bucket", name);
+            print_label(out, m->device);
+            if (bucket < METRICS_LATENCY_BUCKETS)
+            {
+                fprintf(out, ",le=\"%g\"} %llu\n", (double)g_metrics_bounds_ns[bucket] / NSEC_PER_SEC,
+                        (unsigned long long)count);
+            }
+            else
+            {
+                fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)count);
+            }
+        }
+
+        fprintf(out, "%s_sum", name);
+        print_label(out, m->device);
+        fprintf(out, "} %.9f\n", (double)load(&m->latency_sum_ns) / NSEC_PER_SEC);
+        fprintf(out, "%s_count", name);
+        print_label(out, m->device);
+        fprintf(out, "} %llu\n", (unsigned long long)count);
+    }
+}
+
+static void print_metrics(FILE *out)
+{
+    print_counter(out, "spidev_frames_total", "counter", "Frames transferred.",
+                  offsetof(struct metrics_counters, frames));
+    print_counter(out, "spidev_bytes_total", "counter", "Bytes transferred.", offsetof(struct metrics_counters, bytes));
+    print_counter(out, "spidev_ioctl_errors_total", "counter", "SPI_IOC_MESSAGE calls that failed.",
+                  offsetof(struct metrics_counters, ioctl_errors));
+    print_counter(out, "spidev_verified_total", "counter", "Frames whose response matched.",
+                  offsetof(struct metrics_counters, verified));
+    print_counter(out, "spidev_verify_failures_total", "counter", "Frames whose response did not match.",
+                  offsetof(struct metrics_counters, verify_failures));
+    print_counter(out, "spidev_frame_index", "gauge", "Index of the last frame transferred.",
+                  offsetof(struct metrics_counters, frame));
+    print_latency(out);
+}
+
+static void write_textfile(void)
+{
+    char  tmp[4096];
+    FILE *fp;
+    int   ok;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", s_file_path, (int)getpid()) >= sizeof(tmp) ||
+        (fp = fopen(tmp, "w")) == NULL)
+    {
+        return;
+    }
+
+    print_metrics(fp);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok || rename(tmp, s_file_path) < 0)
+    {
+        unlink(tmp);
+    }
+}
+
+/*
+ * Answer one connection. The request, if any, is read for up to
+ * METRICS_REQUEST_MS to tell HTTP from a bare connect.
+ */
+static void serve(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char          request[4] = {0};
+    ssize_t       got        = 0;
+    char         *text       = NULL;
+    size_t        text_len   = 0;
+    FILE         *out;
+
+    if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0)
+    {
+        got = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    }
+
+    if ((out = open_memstream(&text, &text_len)) == NULL)
+    {
+        return;
+    }
+    print_metrics(out);
+    if (fclose(out) != 0)
+    {
+        free(text);
+        return;
+    }
+
+    if (got == (ssize_t)sizeof(request) && memcmp(request, "GET ", sizeof(request)) == 0)
+    {
+        dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                text_len);
+    }
+
+    for (size_t done = 0; done < text_len;)
+    {
+        ssize_t n = send(fd, text + done, text_len - done, MSG_NOSIGNAL);
+
+        if (n <= 0)
+        {
+            break;
+        }
+        done += (size_t)n;
+    }
+
+    free(text);
+}
+
+static void *metrics_thread(void *arg)
+{
+    uint64_t next_ns = monotonic_ns() + s_interval_ns;
+
+    (void)arg;
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        if (s_listen_fd >= 0)
+        {
+            struct pollfd pfd = {.fd = s_listen_fd, .events = POLLIN};
+
+            if (poll(&pfd, 1, METRICS_POLL_MS) > 0)
+            {
+                int fd = accept4(s_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+                if (fd >= 0)
+                {
+                    serve(fd);
+                    close(fd);
+                }
+            }
+        }
+        else
+        {
+            usleep(METRICS_POLL_MS * 1000);
+        }
+
+        if (s_file_path != NULL && monotonic_ns() >= next_ns)
+        {
+            write_textfile();
+            next_ns = monotonic_ns() + s_interval_ns;
+        }
+    }
+
+    return NULL;
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat        st;
+    int                fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    // A socket left behind by an earlier run would make bind() fail.
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int metrics_start(const char *socket_path, const char *textfile_path, uint32_t interval_s)
+{
+    sigset_t all;
+    sigset_t old;
+
+    s_socket_path = socket_path;
+    s_file_path   = textfile_path;
+    s_interval_ns = (uint64_t)(interval_s ? interval_s : 1) * NSEC_PER_SEC;
+
+    if (socket_path != NULL && (s_listen_fd = open_socket(socket_path)) < 0)
+    {
+        return -1;
+    }
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_thread, NULL, metrics_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!s_running)
+    {
+        metrics_stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (s_running)
+    {
+        __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(s_thread, NULL);
+        s_running = 0;
+
+        // The final values, so that a scrape after the run sees all of it.
+        if (s_file_path != NULL)
+        {
+            write_textfile();
+        }
+    }
+
+    if (s_listen_fd >= 0)
+    {
+        close(s_listen_fd);
+        unlink(s_socket_path);
+        s_listen_fd = -1;
+    }
+
+    for (uint32_t i = 0; i < s_writer_count; i++)
+    {
+        free(s_writers[i]);
+    }
+    s_writer_count = 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Counters and latency histograms of a run, served in the Prometheus text
+ * format.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_METRICS_H
+#define SPIDEV_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define METRICS_MAX_WRITERS 16
+#define METRICS_LATENCY_BUCKETS 16
+#define METRICS_LABEL_MAX 128
+
+/*
+ * The counters of one transfer loop. Each loop gets a block of its own, on
+ * cache lines of its own, and is its only writer: it updates the counters
+ * with plain relaxed loads and stores, no read-modify-write, and the server
+ * thread reads them with relaxed loads.
+ */
+struct metrics_counters
+{
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t ioctl_errors;
+    uint64_t verified;
+    uint64_t verify_failures;
+    uint64_t latency_sum_ns;
+    uint64_t latency_buckets[METRICS_LATENCY_BUCKETS + 1]; // the last one is above every bound
+    uint64_t frame; // the frame index of the last transfer
+    char     device[METRICS_LABEL_MAX];
+} __attribute__((aligned(64)));
+
+// Upper bounds of the latency buckets: 1, 2.5 and 5 times 10 us up to 1 s.
+extern const uint64_t g_metrics_bounds_ns[METRICS_LATENCY_BUCKETS];
+
+static inline void metrics_bump(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_transfer(struct metrics_counters *m,
+                                    uint32_t                 frame,
+                                    uint32_t                 len,
+                                    uint64_t                 latency_ns,
+                                    enum stats_verify        verify)
+{
+    uint32_t bucket = 0;
+
+    while (bucket < METRICS_LATENCY_BUCKETS && latency_ns > g_metrics_bounds_ns[bucket])
+    {
+        bucket++;
+    }
+
+    metrics_bump(&m->frames, 1);
+    metrics_bump(&m->bytes, len);
+    metrics_bump(&m->latency_sum_ns, latency_ns);
+    metrics_bump(&m->latency_buckets[bucket], 1);
+    if (verify == STATS_VERIFY_OK)
+    {
+        metrics_bump(&m->verified, 1);
+    }
+    else if (verify == STATS_VERIFY_FAIL)
+    {
+        metrics_bump(&m->verify_failures, 1);
+    }
+    __atomic_store_n(&m->frame, frame, __ATOMIC_RELAXED);
+}
+
+/*
+ * A zeroed counter block for a transfer loop, labelled with its device.
+ * Call before metrics_start(). Returns NULL when all are taken.
+ */
+struct metrics_counters *metrics_register(const char *device);
+
+/*
+ * Copy the counters of up to `max` blocks into `out`, for readers other
+ * than the server. Returns the number of blocks copied.
+ */
+uint32_t metrics_snapshot(struct metrics_counters *out, uint32_t max);
+
+/*
+ * Serve the metrics to every connection on the Unix socket at
+ * socket_path, and/or write them to textfile_path every interval_s
+ * seconds and at metrics_stop(), replacing the file atomically.
+ */
+int  metrics_start(const char *socket_path, const char *textfile_path, uint32_t interval_s);
+void metrics_stop(void);
+
+#endif // SPIDEV_METRICS_H
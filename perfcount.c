@@ -0,0 +1,211 @@
+/*
+ * Hardware and software event counters around the transfer loop.
+ *
+ * The hardware events form one perf_event_open() group so that they are
+ * scheduled on the PMU together, and the software events another, so that
+ * a machine without a usable PMU (most VMs, or perf_event_paranoid)
+ * still reports context switches, faults and task clock.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "perfcount.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum perf_group
+{
+    GROUP_HARDWARE,
+    GROUP_SOFTWARE,
+    GROUP_COUNT,
+};
+
+struct perf_counter
+{
+    const char     *name;
+    enum perf_group group;
+    uint32_t        type;
+    uint64_t        config;
+    int             fd;
+    int             slot;
+    uint64_t        value;
+};
+
+static struct perf_counter s_counters[] = {
+    {"cycles", GROUP_HARDWARE, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0, 0},
+    {"instructions", GROUP_HARDWARE, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0, 0},
+    {"cache-references", GROUP_HARDWARE, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0, 0},
+    {"cache-misses", GROUP_HARDWARE, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0, 0},
+    {"branch-misses", GROUP_HARDWARE, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0, 0},
+    {"task-clock(ns)", GROUP_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, 0, 0},
+    {"context-switches", GROUP_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0, 0},
+    {"cpu-migrations", GROUP_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, -1, 0, 0},
+    {"page-faults", GROUP_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, 0, 0},
+};
+
+#define COUNTER_COUNT (sizeof(s_counters) / sizeof(s_counters[0]))
+
+static int      s_leaders[GROUP_COUNT] = {-1, -1};
+static int      s_members[GROUP_COUNT];
+static uint64_t s_scale_enabled[GROUP_COUNT];
+static uint64_t s_scale_running[GROUP_COUNT];
+
+static int perf_open(struct perf_counter *counter, int group_fd, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = counter->type;
+    attr.config         = counter->config;
+    attr.disabled       = (group_fd == -1);
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv     = exclude_kernel;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+int perfcount_start(void)
+{
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        struct perf_counter *counter = &s_counters[i];
+        int                 *leader  = &s_leaders[counter->group];
+
+        counter->fd = perf_open(counter, *leader, 0);
+
+        if (counter->fd < 0 && (errno == EACCES || errno == EPERM))
+        {
+            // perf_event_paranoid >= 2 only allows user-space counting.
+            counter->fd = perf_open(counter, *leader, 1);
+        }
+
+        if (counter->fd < 0)
+        {
+            continue;
+        }
+
+        if (*leader == -1)
+        {
+            *leader = counter->fd;
+        }
+
+        counter->slot = s_members[counter->group]++;
+    }
+
+    if (s_leaders[GROUP_HARDWARE] == -1 && s_leaders[GROUP_SOFTWARE] == -1)
+    {
+        return -1;
+    }
+
+    for (int group = 0; group < GROUP_COUNT; group++)
+    {
+        if (s_leaders[group] != -1)
+        {
+            ioctl(s_leaders[group], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(s_leaders[group], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    return 0;
+}
+
+void perfcount_stop(void)
+{
+    uint64_t data[3 + COUNTER_COUNT];
+
+    for (int group = 0; group < GROUP_COUNT; group++)
+    {
+        if (s_leaders[group] == -1)
+        {
+            continue;
+        }
+
+        ioctl(s_leaders[group], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        // PERF_FORMAT_GROUP: nr, time_enabled, time_running, then one value per member.
+        if (read(s_leaders[group], data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+        {
+            continue;
+        }
+
+        s_scale_enabled[group] = data[1];
+        s_scale_running[group] = data[2];
+
+        for (size_t i = 0; i < COUNTER_COUNT; i++)
+        {
+            if (s_counters[i].group == (enum perf_group)group && s_counters[i].fd >= 0 &&
+                (uint64_t)s_counters[i].slot < data[0])
+            {
+                s_counters[i].value = data[3 + s_counters[i].slot];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (s_counters[i].fd >= 0)
+        {
+            close(s_counters[i].fd);
+        }
+    }
+}
+
+static const struct perf_counter *find_counter(const char *name)
+{
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (strcmp(s_counters[i].name, name) == 0 && s_counters[i].fd >= 0)
+        {
+            return &s_counters[i];
+        }
+    }
+
+    return NULL;
+}
+
+void perfcount_report(FILE *out, uint64_t frames)
+{
+    const struct perf_counter *cycles       = find_counter("cycles");
+    const struct perf_counter *instructions = find_counter("instructions");
+
+    fprintf(out, "\n%-18s %16s %14s\n", "counter", "total", "per frame");
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+    {
+        const struct perf_counter *counter = &s_counters[i];
+        double                     value   = (double)counter->value;
+        uint64_t                   enabled = s_scale_enabled[counter->group];
+        uint64_t                   running = s_scale_running[counter->group];
+
+        if (counter->fd < 0)
+        {
+            fprintf(out, "%-18s %16s\n", counter->name, "<not supported>");
+            continue;
+        }
+
+        // The group was multiplexed off the PMU part of the time; extrapolate like perf stat does.
+        if (running > 0 && running < enabled)
+        {
+            value = value * (double)enabled / (double)running;
+        }
+
+        fprintf(out, "%-18s %16.0f %14.1f\n", counter->name, value, frames ? value / (double)frames : 0.0);
+    }
+
+    if (cycles != NULL && instructions != NULL && cycles->value > 0)
+    {
+        fprintf(out, "%-18s %16.2f\n", "insn per cycle", (double)instructions->value / (double)cycles->value);
+    }
+
+    fprintf(out, "%-18s %16" PRIu64 "\n", "frames", frames);
+}
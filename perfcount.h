@@ -0,0 +1,24 @@
+/*
+ * Hardware and software event counters around the transfer loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_PERFCOUNT_H
+#define SPIDEV_PERFCOUNT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Open and start the counters for the calling thread. Counters the PMU or
+ * perf_event_paranoid do not allow are skipped; returns -1 only when not
+ * even the software counters are available.
+ */
+int  perfcount_start(void);
+void perfcount_stop(void);
+void perfcount_report(FILE *out, uint64_t frames);
+
+#endif // SPIDEV_PERFCOUNT_H
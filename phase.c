@@ -0,0 +1,65 @@
+/*
+ * Optional per-phase timing of the transfer loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "phase.h"
+
+#ifdef SPIDEV_PHASE_TIMING
+
+#include <inttypes.h>
+
+struct phase_state g_phase_state;
+
+static const char *const s_phase_names[PHASE_COUNT] = {
+    [PHASE_PARSE] = "parse", [PHASE_IOCTL] = "ioctl", [PHASE_RECORD] = "record",
+    [PHASE_OUTPUT] = "output", [PHASE_SLEEP] = "sleep",
+};
+
+void phase_start(void)
+{
+    g_phase_state.start_ns    = monotonic_ns();
+    g_phase_state.start_ticks = phase_ticks();
+    g_phase_state.last        = g_phase_state.start_ticks;
+}
+
+void phase_report(FILE *out)
+{
+    uint64_t wall_ns    = monotonic_ns() - g_phase_state.start_ns;
+    uint64_t wall_ticks = phase_ticks() - g_phase_state.start_ticks;
+    double   ns_per_tick;
+    double   accounted = 0;
+
+    if (wall_ns == 0 || wall_ticks == 0)
+    {
+        return;
+    }
+
+    ns_per_tick = (double)wall_ns / (double)wall_ticks;
+
+    fprintf(out, "\n%-8s %12s %7s %10s %10s\n", "phase", "time(ms)", "share", "calls", "avg(us)");
+
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        double ns = (double)g_phase_state.ticks[i] * ns_per_tick;
+
+        accounted += ns;
+        fprintf(out, "%-8s %12.3f %6.1f%% %10" PRIu64 " %10.2f\n", s_phase_names[i], ns / NSEC_PER_MSEC,
+                100.0 * ns / (double)wall_ns, g_phase_state.calls[i],
+                g_phase_state.calls[i] ? ns / (double)g_phase_state.calls[i] / NSEC_PER_USEC : 0.0);
+    }
+
+    fprintf(out, "%-8s %12.3f %6.1f%%\n", "other", ((double)wall_ns - accounted) / NSEC_PER_MSEC,
+            100.0 * ((double)wall_ns - accounted) / (double)wall_ns);
+    fprintf(out, "%-8s %12.3f\n", "wall", (double)wall_ns / NSEC_PER_MSEC);
+    fprintf(out, "bus busy: %.3f ms on the wire, %.1f%% of wall time, %.1f%% of ioctl time\n",
+            (double)g_phase_state.wire_ns / NSEC_PER_MSEC, 100.0 * (double)g_phase_state.wire_ns / (double)wall_ns,
+            g_phase_state.ticks[PHASE_IOCTL]
+                ? 100.0 * (double)g_phase_state.wire_ns / ((double)g_phase_state.ticks[PHASE_IOCTL] * ns_per_tick)
+                : 0.0);
+}
+
+#endif // SPIDEV_PHASE_TIMING
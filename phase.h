@@ -0,0 +1,92 @@
+/*
+ * Optional per-phase timing of the transfer loop.
+ *
+ * Build with `make PHASE_TIMING=1` to enable. Otherwise every macro below
+ * expands to nothing and the loop carries no instrumentation at all.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_PHASE_H
+#define SPIDEV_PHASE_H
+
+#ifdef SPIDEV_PHASE_TIMING
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "timing.h"
+
+enum phase
+{
+    PHASE_PARSE,  // reading the next frame
+    PHASE_IOCTL,  // SPI_IOC_MESSAGE
+    PHASE_RECORD, // statistics and capture
+    PHASE_OUTPUT, // printing TX/RX
+    PHASE_SLEEP,  // inter-frame interval
+    PHASE_COUNT,
+};
+
+struct phase_state
+{
+    uint64_t last;
+    uint64_t ticks[PHASE_COUNT];
+    uint64_t calls[PHASE_COUNT];
+    uint64_t wire_ns;
+    uint64_t start_ticks;
+    uint64_t start_ns;
+};
+
+extern struct phase_state g_phase_state;
+
+/*
+ * The cheapest monotonic counter available: the TSC on x86, the virtual
+ * counter on arm64 and the vDSO clock elsewhere. phase_report() calibrates
+ * ticks against CLOCK_MONOTONIC over the whole run.
+ */
+static inline uint64_t phase_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return monotonic_ns();
+#endif
+}
+
+/*
+ * Charge the time since the previous mark to `phase`.
+ */
+static inline void phase_mark(enum phase phase)
+{
+    uint64_t now = phase_ticks();
+
+    g_phase_state.ticks[phase] += now - g_phase_state.last;
+    g_phase_state.calls[phase]++;
+    g_phase_state.last = now;
+}
+
+void phase_start(void);
+void phase_report(FILE *out);
+
+#define PHASE_START() phase_start()
+#define PHASE_MARK(phase) phase_mark(phase)
+#define PHASE_WIRE_NS(ns) (g_phase_state.wire_ns += (ns))
+#define PHASE_REPORT(out) phase_report(out)
+
+#else // SPIDEV_PHASE_TIMING
+
+#define PHASE_START() ((void)0)
+#define PHASE_MARK(phase) ((void)0)
+#define PHASE_WIRE_NS(ns) ((void)0)
+#define PHASE_REPORT(out) ((void)0)
+
+#endif // SPIDEV_PHASE_TIMING
+
+#endif // SPIDEV_PHASE_H
@@ -0,0 +1,53 @@
+/*
+ * USDT probes for perf, bpftrace and SystemTap.
+ *
+ * The probes come from the header-only <sys/sdt.h> (systemtap-sdt-dev).
+ * Each one is a single NOP in the transfer path plus an ELF note describing
+ * where its arguments live, so nothing is linked in and nothing runs unless
+ * a tracer attaches. Without the header, or when built with
+ * -DSPIDEV_NO_USDT, the probes expand to nothing.
+ *
+ * Provider "spidev_test":
+ *   frame__load(frame, len)                 a frame is ready to be sent
+ *   transfer__start(frame, len)             right before SPI_IOC_MESSAGE
+ *   transfer__done(frame, len, latency_ns)  the ioctl returned
+ *   verify(frame, result)                   RX checked: 0 ok, 1 mismatch
+ *   sched__wakeup(frame, lateness_ns)       back from an inter-frame sleep
+ *
+ * See tools/bpftrace for examples.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_PROBES_H
+#define SPIDEV_PROBES_H
+
+#if !defined(SPIDEV_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define SPIDEV_USDT 1
+#endif
+#endif
+
+#ifdef SPIDEV_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE_FRAME_LOAD(frame, len) DTRACE_PROBE2(spidev_test, frame__load, frame, len)
+#define PROBE_TRANSFER_START(frame, len) DTRACE_PROBE2(spidev_test, transfer__start, frame, len)
+#define PROBE_TRANSFER_DONE(frame, len, latency_ns) DTRACE_PROBE3(spidev_test, transfer__done, frame, len, latency_ns)
+#define PROBE_VERIFY(frame, result) DTRACE_PROBE2(spidev_test, verify, frame, result)
+#define PROBE_SCHED_WAKEUP(frame, lateness_ns) DTRACE_PROBE2(spidev_test, sched__wakeup, frame, lateness_ns)
+
+#else // SPIDEV_USDT
+
+#define PROBE_FRAME_LOAD(frame, len) ((void)0)
+#define PROBE_TRANSFER_START(frame, len) ((void)0)
+#define PROBE_TRANSFER_DONE(frame, len, latency_ns) ((void)0)
+#define PROBE_VERIFY(frame, result) ((void)0)
+#define PROBE_SCHED_WAKEUP(frame, lateness_ns) ((void)0)
+
+#endif // SPIDEV_USDT
+
+#endif // SPIDEV_PROBES_H
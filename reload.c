@@ -0,0 +1,279 @@
+/*
+ * Hot reload of the frame file.
+ *
+ * A background thread watches the directory of the frame file with
+ * inotify, so that editors that save by renaming a new file into place are
+ * seen too. After a change settles, it parses the file into a fresh table
+ * and publishes it with a single pointer store. The transfer loop picks it
+ * up at its next frame boundary with one atomic exchange and never waits
+ * for parsing; tables it no longer uses go back on a lock-free list that
+ * this thread frees, so the loop does not call free() either.
+ *
+ * A file that fails to parse is rejected and the previous frames stay in
+ * use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "reload.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define RELOAD_POLL_MS 100
+#define RELOAD_SETTLE_MS 20
+
+/*
+ * The table is the first member, so the transfer loop can be handed the
+ * table and give it back without knowing about the wrapper.
+ */
+struct reload_update
+{
+    struct frame_table    table;
+    struct reload_info    info;
+    struct reload_update *next;
+};
+
+static const struct frame_table *s_initial = NULL;
+static struct reload_update     *s_pending = NULL;
+static struct reload_update     *s_retired = NULL;
+static pthread_t                 s_thread;
+static int                       s_running = 0;
+static int                       s_stop    = 0;
+static int                       s_inotify = -1;
+static char                      s_path[PATH_MAX];
+static char                      s_name[NAME_MAX + 1];
+static uint32_t                  s_max_len;
+static uint32_t                  s_reloads  = 0;
+static uint32_t                  s_rejected = 0;
+
+static void free_update(struct reload_update *update)
+{
+    frame_table_free(&update->table);
+    free(update);
+}
+
+static void free_retired(void)
+{
+    struct reload_update *update = __atomic_exchange_n(&s_retired, NULL, __ATOMIC_ACQUIRE);
+
+    while (update != NULL)
+    {
+        struct reload_update *next = update->next;
+
+        free_update(update);
+        update = next;
+    }
+}
+
+static void reload(uint64_t changed_ns)
+{
+    struct reload_update *update = calloc(1, sizeof(*update));
+    struct reload_update *stale;
+
+    if (update == NULL)
+    {
+        return;
+    }
+
+    frame_table_init(&update->table);
+    // An empty table would leave the transfer loop spinning.
+    if (frame_table_load(&update->table, s_path, s_max_len) <= 0 || update->table.bad_line != 0)
+    {
+        printf("reload: %s rejected, the previous frames stay in use\n", s_path);
+        s_rejected++;
+        free_update(update);
+        return;
+    }
+
+    update->info.changed_ns = changed_ns;
+    update->info.ready_ns   = monotonic_ns();
+
+    // An update the loop has not taken yet is superseded, and was never seen.
+    stale = __atomic_exchange_n(&s_pending, update, __ATOMIC_ACQ_REL);
+    if (stale != NULL)
+    {
+        free_update(stale);
+    }
+
+    s_reloads++;
+}
+
+/*
+ * Read the queued inotify events; returns 1 if one of them is about the
+ * frame file.
+ */
+static int read_events(void)
+{
+    char    buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int     matched = 0;
+
+    while ((len = read(s_inotify, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            if (event->len > 0 && strcmp(event->name, s_name) == 0)
+            {
+                matched = 1;
+            }
+            p += sizeof(*event) + event->len;
+        }
+    }
+
+    return matched;
+}
+
+static void *watch(void *arg)
+{
+    struct pollfd pfd = {.fd = s_inotify, .events = POLLIN};
+
+    (void)arg;
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        uint64_t changed_ns;
+
+        free_retired();
+
+        if (poll(&pfd, 1, RELOAD_POLL_MS) <= 0 || !read_events())
+        {
+            continue;
+        }
+
+        // Let a burst of writes and renames settle before parsing.
+        changed_ns = monotonic_ns();
+        while (poll(&pfd, 1, RELOAD_SETTLE_MS) > 0)
+        {
+            read_events();
+        }
+
+        reload(changed_ns);
+    }
+
+    return NULL;
+}
+
+int reload_start(const char *path, uint32_t max_len, const struct frame_table *initial)
+{
+    char        dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    sigset_t    all;
+    sigset_t    old;
+
+    if (strlen(path) >= sizeof(s_path) || strlen(slash ? slash + 1 : path) >= sizeof(s_name))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(s_path, path);
+    strcpy(s_name, slash ? slash + 1 : path);
+
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else if (slash == path)
+    {
+        strcpy(dir, "/");
+    }
+    else
+    {
+        memcpy(dir, path, (size_t)(slash - path));
+        dir[slash - path] = '\0';
+    }
+
+    s_max_len = max_len;
+    s_initial = initial;
+
+    if ((s_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+        return -1;
+    }
+
+    if (inotify_add_watch(s_inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(s_inotify);
+        s_inotify = -1;
+        return -1;
+    }
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_thread, NULL, watch, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return s_running ? 0 : -1;
+}
+
+struct frame_table *reload_take(struct reload_info *info)
+{
+    struct reload_update *update;
+
+    // The common case costs a plain load.
+    if (__atomic_load_n(&s_pending, __ATOMIC_RELAXED) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((update = __atomic_exchange_n(&s_pending, NULL, __ATOMIC_ACQUIRE)) == NULL)
+    {
+        return NULL;
+    }
+
+    *info = update->info;
+    return &update->table;
+}
+
+void reload_retire(struct frame_table *table)
+{
+    struct reload_update *update = (struct reload_update *)table;
+
+    if (table == NULL || table == s_initial)
+    {
+        return;
+    }
+
+    update->next = __atomic_load_n(&s_retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s_retired, &update->next, update, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+void reload_stop(FILE *out)
+{
+    struct reload_update *pending;
+
+    if (!s_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_thread, NULL);
+    s_running = 0;
+    close(s_inotify);
+
+    free_retired();
+    if ((pending = __atomic_exchange_n(&s_pending, NULL, __ATOMIC_ACQUIRE)) != NULL)
+    {
+        free_update(pending);
+    }
+
+    fprintf(out, "reload: %u reloads, %u rejected\n", s_reloads, s_rejected);
+}
@@ -0,0 +1,40 @@
+/*
+ * Hot reload of the frame file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_RELOAD_H
+#define SPIDEV_RELOAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "frames.h"
+
+struct reload_info
+{
+    uint64_t changed_ns; // when the change was noticed
+    uint64_t ready_ns;   // when the new table was parsed
+};
+
+/*
+ * Watch `path` and parse it again, on a background thread, whenever it is
+ * written or replaced. `initial` is the table the transfer loop starts
+ * with; it stays owned by the caller.
+ */
+int reload_start(const char *path, uint32_t max_len, const struct frame_table *initial);
+
+/*
+ * Called by the transfer loop at frame boundaries: returns the newest
+ * table if one was published since the last call, or NULL, without
+ * blocking. The loop hands back the table it stops using with
+ * reload_retire(), and the background thread frees it.
+ */
+struct frame_table *reload_take(struct reload_info *info);
+void                reload_retire(struct frame_table *table);
+void                reload_stop(FILE *out);
+
+#endif // SPIDEV_RELOAD_H
@@ -14,16 +14,89 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include "budget.h"
+#include "capture.h"
+#include "characterize.h"
+#include "checkpoint.h"
+#include "devconfig.h"
+#include "emulate.h"
+#include "frames.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "perfcount.h"
+#include "phase.h"
+#include "probes.h"
+#include "reload.h"
+#include "spitrace.h"
+#include "stats.h"
+#include "timing.h"
+#include "top.h"
+#include "tune.h"
+#include "watchdog.h"
+
 #define BUF_MAX_SIZE 1024
+// SPI_IOC_MESSAGE() encodes the size of the transfer array in 14 bits.
+#define BATCH_MAX 256
+// --find-interval: frame pairs per step, resolution, and how close to a deadline to stop sleeping and spin.
+#define GAP_TRIALS 100
+#define GAP_RESOLUTION_NS NSEC_PER_USEC
+#define GAP_SPIN_NS (200 * NSEC_PER_USEC)
+// --characterize: messages per grid point, and how long to keep going once the minimum is reached.
+#define SWEEP_MIN_MESSAGES 20
+#define SWEEP_MAX_MESSAGES 1000
+#define SWEEP_POINT_NS (100 * NSEC_PER_MSEC)
+
+enum
+{
+    OPT_REPLAY = 256,
+    OPT_REPLAY_SPEED,
+    OPT_CAPTURE_FORMAT,
+    OPT_QUERY,
+    OPT_FROM,
+    OPT_TO,
+    OPT_MATCH_TX,
+    OPT_MATCH_RX,
+    OPT_STATS,
+    OPT_EXPECT,
+    OPT_TRACE_SPI,
+    OPT_PERF_COUNTERS,
+    OPT_BUDGET,
+    OPT_STATE_FILE,
+    OPT_EMULATE,
+    OPT_WATCH,
+    OPT_TX_FILE,
+    OPT_FRAME_SIZE,
+    OPT_BATCH,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_RESUME,
+    OPT_WATCHDOG,
+    OPT_WATCHDOG_ACTION,
+    OPT_TUNE_FILE,
+    OPT_FIND_INTERVAL,
+    OPT_CHARACTERIZE,
+    OPT_SIZES,
+    OPT_SPEEDS,
+    OPT_METRICS_SOCKET,
+    OPT_METRICS_FILE,
+    OPT_METRICS_INTERVAL,
+    OPT_TOP,
+};
 
 static const char *s_device   = "/dev/spidev1.0";
 static uint8_t     s_mode     = 0;
@@ -34,15 +107,92 @@ static uint32_t    s_size     = 0;
 static uint8_t     s_tx_buf[BUF_MAX_SIZE];
 static uint8_t     s_rx_buf[BUF_MAX_SIZE];
 static uint32_t    s_repeat      = 1;
-static uint32_t    s_interva_ms  = 10;
+static uint32_t    s_interval_us = 10000;
 static uint8_t     s_file_is_set = 0;
 static char        s_file_path[128];
 
+// The frame being transferred: the static buffers, or a part of the --tx-file mapping.
+static const uint8_t *s_tx = s_tx_buf;
+static uint8_t       *s_rx = s_rx_buf;
+
+static const char            *s_capture_path   = NULL;
+static enum capture_format    s_capture_format = CAPTURE_FORMAT_TEXT;
+static struct capture_writer *s_capture        = NULL;
+static uint64_t               s_capture_t0     = 0;
+static const char            *s_replay_path    = NULL;
+static double                 s_replay_speed   = 1.0;
+static const char            *s_query_path     = NULL;
+static struct capture_query   s_query          = {.to_ns = UINT64_MAX};
+static int                    s_stats_enabled  = 0;
+static struct stats           s_stats;
+static struct capture_pattern s_expect;
+static int                    s_trace_spi      = 0;
+static const char            *s_trace_csv_path = NULL;
+static int                    s_perf_counters  = 0;
+static uint64_t               s_transfer_count = 0; // SPI_IOC_MESSAGE calls
+static uint64_t               s_frame_count    = 0; // frames they carried
+static int                    s_quiet          = 0;
+static struct frame_table     s_frames;
+static struct frame_table    *s_table          = &s_frames;
+static struct frame_stream   *s_stream         = NULL;
+static int                    s_watch          = 0;
+static int                    s_budget         = 0;
+static long                   s_syscall_budget = -1;
+static struct budget_counts   s_budget_mark;
+static uint64_t               s_budget_frames  = 0;
+static uint64_t               s_budget_over    = 0;
+static struct budget_counts   s_budget_max;
+static uint32_t               s_budget_first   = 0;
+static struct budget_counts   s_budget_first_counts;
+static int                    s_budget_nrs[BUDGET_RECENT];
+static int                    s_budget_nr_len  = 0;
+static const char            *s_state_path     = NULL;
+static const char            *s_emulate_spec   = NULL;
+static struct emu_device     *s_emu            = NULL;
+static const char            *s_tx_file_path   = NULL;
+static const uint8_t         *s_tx_map         = NULL;
+static size_t                 s_tx_map_size    = 0;
+static uint32_t               s_frame_size     = 0;
+static uint32_t               s_batch          = 1;
+static uint8_t               *s_batch_rx       = NULL;
+
+static const char           *s_checkpoint_path   = NULL;
+static uint32_t              s_checkpoint_s      = 30;
+static int                   s_resume            = 0;
+static struct checkpoint_pos s_pos;
+static uint64_t              s_resumed_transfers = 0;
+
+static uint32_t             s_watchdog_ms     = 0;
+static enum watchdog_action s_watchdog_action = WATCHDOG_REPORT;
+static int                  s_watchdog_signo  = 0;
+
+static int          s_batch_set  = 0;
+static int          s_batch_auto = 0;
+static const char  *s_tune_path  = "/var/tmp/spidev_test.tune";
+static struct tune  s_tune;
+
+static uint32_t s_gap_trials = 0;
+
+static int         s_characterize     = 0;
+static const char *s_characterize_csv = NULL;
+static uint32_t    s_sweep_sizes[CHARACTERIZE_MAX_POINTS];
+static int         s_sweep_size_count = 0;
+static uint32_t    s_sweep_speeds[CHARACTERIZE_MAX_POINTS];
+static int         s_sweep_speed_count = 0;
+
+static const char              *s_metrics_socket = NULL;
+static const char              *s_metrics_file   = NULL;
+static uint32_t                 s_metrics_s      = 10;
+static struct metrics_counters *s_metrics        = NULL;
+static int                      s_top            = 0;
+
+static volatile sig_atomic_t s_stop = 0;
+
 static uint8_t s_default_data[] = {0xfd, 0x01, 0x51, 0xa7};
 
 static void print_usage(const char *prog)
 {
-    printf("Usage: %s [-DsbdlrifHOLC3] [X] \n", prog ? prog : "");
+    printf("Usage: %s [-DsbdlrifwqHOLC3] [X] \n", prog ? prog : "");
     printf("  -D --device   device to use (default /dev/spidev1.0)\n"
            "  -s --speed    max speed (Hz)\n"
            "  -d --delay    delay (usec)\n"
@@ -54,12 +204,47 @@ static void print_usage(const char *prog)
            "  -C --cs-high  chip select active high\n"
            "  -3 --3wire    SI/SO signals shared\n"
            "  -r --repeat   repeatly transmit frames\n"
-           "  -i --interval repeat interval, in ms\n"
-           "  -f --file     read spi frames from the file\n"
+           "  -i --interval repeat interval, in ms (fractions allowed)\n"
+           "  -f --file     read spi frames from the file, or as they arrive from a pipe (\"-\" is stdin)\n"
+           "  -w --capture  record timestamped transactions to the file\n"
+           "     --replay   replay a capture with its original timing\n"
+           "     --replay-speed  replay time scale (2 = twice as fast, 0 = as fast as possible)\n"
+           "     --capture-format  text (default), indexed or delta\n"
+           "     --query    print the records of an indexed capture matching:\n"
+           "       --from, --to          time range, in seconds from the capture start\n"
+           "       --match-tx, --match-rx  byte prefix, \"??\" matches any byte\n"
+           "     --stats[=hash]  per-frame statistics table at exit, keyed by frame index or TX data\n"
+           "     --expect   expected RX prefix, \"??\" matches any byte (loopback mode expects TX)\n"
+           "     --trace-spi[=CSV]  split ioctl time with the kernel spi tracepoints (needs tracefs)\n"
+           "     --perf-counters  report cycles, instructions, cache misses and context switches\n"
+           "  -q --quiet    do not print the TX and RX data of each frame\n"
+           "     --budget[=N]  fail if a steady-state frame makes more than N syscalls or any allocation\n"
+           "     --state-file  trust the device settings saved there by a previous run\n"
+           "     --emulate  talk to an emulated loop, nor, eeprom or adc instead of the device\n"
+           "     --watch    reload the frame file when it changes, at the next frame boundary\n"
+           "     --find-interval[=N]  bisect the shortest -i at which the response to a frame pair\n"
+           "                 still checks out, N pairs per step (100), then run with it\n"
+           "     --characterize[=CSV]  time messages over a grid of sizes and speeds, fit their cost\n"
+           "       --sizes   bytes per message, e.g. 1,64,1k (1 to 1024 in 17 steps)\n"
+           "       --speeds  clock speeds, e.g. 500k,2M (-s divided by 8, 4, 2 and 1)\n"
+           "     --metrics-socket  serve Prometheus metrics on this Unix socket\n"
+           "     --metrics-file  write them to this file every --metrics-interval s (10)\n"
+           "     --top      redraw throughput, latency and errors once per second instead of the frames\n"
+           "     --tx-file  send a binary file, mapped into memory, in frames of --frame-size bytes\n"
+           "       --frame-size  bytes per frame (default: the spidev bufsiz)\n"
+           "       --batch       frames per SPI_IOC_MESSAGE (default 1), or auto to measure the fastest\n"
+           "       --tune-file   where --batch auto keeps its choice per device (/var/tmp/spidev_test.tune)\n"
+           "     --checkpoint  save the position and statistics there every --checkpoint-interval s (30)\n"
+           "     --resume   continue from the --checkpoint file, with its statistics\n"
+           "     --watchdog  report a transfer that has not returned after this many ms\n"
+           "       --watchdog-action  report (default), abort, or a signal to send, e.g. TERM\n"
            "  -X --xdata    hexadecimal data\n\n"
            "Examples:\n"
            "  ./spidev_test -D /dev/spidev1.0 -s 1000000 -b 8 -r 2 -i 100 -X 0xaa 0xbb 0xcc\n"
-           "  ./spidev_test -D /dev/spidev1.0 -s 1000000 -b 8 -f ./example.cfg\n");
+           "  ./spidev_test -D /dev/spidev1.0 -s 1000000 -b 8 -f ./example.cfg\n"
+           "  ./spidev_test -D /dev/spidev1.0 -f ./example.cfg -w ./field.cap\n"
+           "  ./spidev_test -D /dev/spidev1.0 --replay ./field.cap --replay-speed 0.5\n"
+           "  ./spidev_test --query ./field.cap --from 10 --to 20 --match-rx \"?? ?? 00\"\n");
 
     if (prog)
     {
@@ -74,140 +259,157 @@ static void pabort(const char *s)
     abort();
 }
 
-static void strip(char *string)
+static void on_stop_signal(int sig)
 {
-    int count = 0;
+    (void)sig;
+    s_stop = 1;
+}
 
-    for (int i = 0; string[i]; i++)
+static enum stats_verify verify_rx(void)
+{
+    if (s_expect.len > 0)
     {
-        if (string[i] != '\r' && string[i] != '\n')
+        if (s_size < s_expect.len)
+        {
+            return STATS_VERIFY_FAIL;
+        }
+
+        for (uint32_t i = 0; i < s_expect.len; i++)
         {
-            string[count++] = string[i];
+            if ((s_rx[i] & s_expect.mask[i]) != s_expect.value[i])
+            {
+                return STATS_VERIFY_FAIL;
+            }
         }
+
+        return STATS_VERIFY_OK;
     }
 
-    string[count] = '\0';
+    if (s_mode & SPI_LOOP)
+    {
+        return (memcmp(s_tx, s_rx, s_size) == 0) ? STATS_VERIFY_OK : STATS_VERIFY_FAIL;
+    }
+
+    return STATS_VERIFY_NONE;
 }
 
-static int hex_to_bin(const char *hex, uint8_t *bin, uint32_t bin_length)
+/*
+ * Time the clock spends on the wire for one transfer, C̅S̅ delay included.
+ * Words wider than 8 bits occupy 2 (or 4) bytes in the buffers.
+ */
+static inline uint64_t wire_time_ns(uint32_t len, uint8_t bits, uint32_t speed_hz, uint16_t delay_us)
 {
-    size_t      hexLength = strlen(hex);
-    const char *hexEnd    = hex + hexLength;
-    uint8_t    *cur       = bin;
-    uint8_t     numChars  = hexLength & 1;
-    uint8_t     byte      = 0;
-    int         rval;
+    uint32_t word_size = (bits <= 8) ? 1 : (bits <= 16) ? 2 : 4;
 
-    if ((hexLength + 1) / 2 > bin_length)
+    if (speed_hz == 0)
     {
-        return -1;
+        return 0;
     }
 
-    while (hex < hexEnd)
-    {
-        if ('A' <= *hex && *hex <= 'F')
-        {
-            byte |= 10 + (*hex - 'A');
-        }
-        else if ('a' <= *hex && *hex <= 'f')
-        {
-            byte |= 10 + (*hex - 'a');
-        }
-        else if ('0' <= *hex && *hex <= '9')
-        {
-            byte |= *hex - '0';
-        }
-        else if (*hex == ' ')
-        {
-            hex++;
-            continue;
-        }
-        else
-        {
-            printf("Unknown Character (0x%02x|%c)", *hex, *hex);
-            return -1;
-        }
+    return (uint64_t)(len / word_size) * bits * NSEC_PER_SEC / speed_hz + (uint64_t)delay_us * NSEC_PER_USEC;
+}
 
-        hex++;
-        numChars++;
+/*
+ * Issue one SPI_IOC_MESSAGE, to the device or to the emulated peripheral.
+ */
+static int spi_message(int fd, struct spi_ioc_transfer *xfers, unsigned int count)
+{
+    int ret;
 
-        if (numChars >= 2)
-        {
-            numChars = 0;
-            *cur++   = byte;
-            byte     = 0;
-        }
-        else
-        {
-            byte <<= 4;
-        }
+    if (s_emu != NULL)
+    {
+        ret = emu_transfer(s_emu, xfers, count);
+    }
+    else
+    {
+        ret = ioctl(fd, SPI_IOC_MESSAGE(count), xfers);
     }
 
-    rval = (int)(cur - bin);
+    if (ret < 0 && s_metrics != NULL)
+    {
+        metrics_bump(&s_metrics->ioctl_errors, 1);
+    }
 
-    return rval;
+    return ret;
 }
 
-static int config_file_get_next(int *iterator, uint8_t *value, uint32_t *value_length)
+/*
+ * Verify, record and print the frame in s_tx/s_rx, which was on the wire
+ * between start_ns and end_ns.
+ */
+static void record_frame(uint32_t frame, uint64_t start_ns, uint64_t end_ns)
 {
-    char     line[BUF_MAX_SIZE + 1];
-    FILE    *fp = NULL;
-    long int pos;
-    int      len;
+    uint32_t          i;
+    enum stats_verify verify;
 
-    if ((iterator == NULL) || (value == NULL) || (value_length == NULL))
+    verify = verify_rx();
+    if (verify != STATS_VERIFY_NONE)
     {
-        return -1;
+        PROBE_VERIFY(frame, verify);
     }
 
-    if ((fp = fopen(s_file_path, "r")) == NULL)
+    if (s_stats_enabled)
     {
-        return -1;
+        stats_record(&s_stats, frame, s_tx, s_rx, s_size, end_ns - start_ns, verify);
     }
 
-    if (fseek(fp, *iterator, SEEK_SET) < 0)
+    if (s_metrics != NULL)
     {
-        return -1;
+        metrics_transfer(s_metrics, frame, s_size, end_ns - start_ns, verify);
     }
 
-    if (fgets(line, sizeof(line), fp) == NULL)
+    if (s_capture != NULL)
     {
-        return -1;
-    }
+        struct capture_record record;
 
-    if (strlen(line) + 1 == sizeof(line))
-    {
-        // The line is too long.
-        return -1;
+        if (s_capture_t0 == 0)
+        {
+            s_capture_t0 = start_ns;
+        }
+
+        record.t_ns     = start_ns - s_capture_t0;
+        record.speed_hz = s_speed;
+        record.delay_us = s_delay_us;
+        record.bits     = s_bits;
+        record.len      = s_size;
+        record.tx       = s_tx;
+        record.rx       = s_rx;
+
+        if (capture_write(s_capture, &record) < 0)
+        {
+            pabort("Failed to write capture");
+        }
     }
 
-    if ((pos = ftell(fp)) < 0)
+    PHASE_MARK(PHASE_RECORD);
+
+    if (s_quiet)
     {
-        return -1;
+        return;
     }
 
-    if (fp != NULL)
+    printf("TX: ");
+    for (i = 0; i < s_size; i++)
     {
-        fclose(fp);
+        printf("%.2x ", s_tx[i]);
     }
+    printf("\r\n");
 
-    strip(line);
-    len = hex_to_bin(line, value, *value_length);
-
-    if (len < 0)
+    printf("RX: ");
+    for (i = 0; i < s_size; i++)
     {
-        return -1;
+        printf("%.2x ", s_rx[i]);
     }
+    printf("\r\n");
 
-    *iterator     = (int)(pos);
-    *value_length = len;
-    return 0;
+    PHASE_MARK(PHASE_OUTPUT);
 }
 
-static void transfer(int fd)
+static void transfer(int fd, uint32_t frame)
 {
     int                     ret;
-    int                     i;
+    uint64_t                start_ns;
+    uint64_t                end_ns;
     struct spi_ioc_transfer transfer[2];
 
     memset(&transfer[0], 0, sizeof(transfer));
@@ -223,23 +425,31 @@ static void transfer(int fd)
     transfer[0].cs_change     = 0;
 
     // This part is the actual SPI transfer.
-    transfer[1].tx_buf        = (unsigned long)(s_tx_buf);
-    transfer[1].rx_buf        = (unsigned long)(s_rx_buf);
+    transfer[1].tx_buf        = (unsigned long)(s_tx);
+    transfer[1].rx_buf        = (unsigned long)(s_rx);
     transfer[1].len           = s_size;
     transfer[1].speed_hz      = s_speed;
     transfer[1].delay_usecs   = 0;
     transfer[1].bits_per_word = s_bits;
     transfer[1].cs_change     = 0;
 
+    PHASE_MARK(PHASE_OUTPUT);
+    PROBE_TRANSFER_START(frame, s_size);
+    start_ns = monotonic_ns();
+    if (s_watchdog_ms > 0)
+    {
+        watchdog_begin(frame, s_tx, s_size, start_ns);
+    }
+
     if (s_delay_us > 0)
     {
         // A C̅S̅ delay has been specified. Start transactions with both parts.
-        ret = ioctl(fd, SPI_IOC_MESSAGE(2), &transfer[0]);
+        ret = spi_message(fd, &transfer[0], 2);
     }
     else
     {
         // No C̅S̅ delay has been specified, so we skip the first part because it causes some SPI drivers to croak.
-        ret = ioctl(fd, SPI_IOC_MESSAGE(1), &transfer[1]);
+        ret = spi_message(fd, &transfer[1], 1);
     }
 
     if (ret < 0)
@@ -247,199 +457,1501 @@ static void transfer(int fd)
         pabort("Failed to send spi message");
     }
 
-    printf("TX: ");
-    for (i = 0; i < s_size; i++)
+    end_ns = monotonic_ns();
+    if (s_watchdog_ms > 0)
     {
-        printf("%.2x ", s_tx_buf[i]);
+        watchdog_end(end_ns);
     }
-    printf("\r\n");
+    s_transfer_count++;
+    s_frame_count++;
+    PHASE_MARK(PHASE_IOCTL);
+    PHASE_WIRE_NS(wire_time_ns(s_size, s_bits, s_speed, s_delay_us));
+    PROBE_TRANSFER_DONE(frame, s_size, end_ns - start_ns);
 
-    printf("RX: ");
-    for (i = 0; i < s_size; i++)
+    if (s_trace_spi)
     {
-        printf("%.2x ", s_rx_buf[i]);
+        spitrace_user(frame, start_ns, end_ns);
     }
-    printf("\r\n");
+
+    record_frame(frame, start_ns, end_ns);
 }
 
-static void parse_opts(int argc, char *argv[])
+/*
+ * Send up to `batch` frames of the --tx-file mapping, starting at *offset,
+ * in one SPI_IOC_MESSAGE, with C̅S̅ released between them. The transmit
+ * buffers point into the mapping. Returns the number of frames sent, and
+ * stores when the ioctl returned in *end_ns_p.
+ */
+static uint32_t transfer_batch(int fd, uint32_t frame, size_t *offset_p, uint32_t batch, uint64_t *end_ns_p)
 {
-    int   i, index;
-    char *p;
+    size_t                   offset = *offset_p;
+    struct spi_ioc_transfer  xfers[BATCH_MAX + 1];
+    struct spi_ioc_transfer *first  = &xfers[1];
+    uint32_t                 count  = 0;
+    size_t                   bytes  = 0;
+    uint64_t                 start_ns;
+    uint64_t                 end_ns;
 
-    while (1)
+    memset(xfers, 0, (batch + 1) * sizeof(xfers[0]));
+
+    // The C̅S̅ delay part, as in transfer().
+    xfers[0].speed_hz      = s_speed;
+    xfers[0].delay_usecs   = s_delay_us;
+    xfers[0].bits_per_word = s_bits;
+
+    while (count < batch && offset + bytes < s_tx_map_size)
     {
-        int                        c;
-        static const struct option opts[] = {
-            {"device", 1, 0, 'D'},  {"speed", 1, 0, 's'},  {"delay", 1, 0, 'd'},    {"bpw", 1, 0, 'b'},
-            {"loop", 0, 0, 'l'},    {"cpha", 0, 0, 'H'},   {"cpol", 0, 0, 'O'},     {"lsb", 0, 0, 'L'},
-            {"cs-high", 0, 0, 'C'}, {"3wire", 0, 0, '3'},  {"no-cs", 0, 0, 'N'},    {"ready", 0, 0, 'R'},
-            {"Xdata", 1, 0, 'X'},   {"repeat", 1, 0, 'r'}, {"interval", 1, 0, 'i'}, {"file", 1, 0, 'f'},
-            {NULL, 0, 0, 0},
-        };
+        struct spi_ioc_transfer *xfer = &xfers[1 + count];
+        size_t                   len  = s_tx_map_size - offset - bytes;
 
-        c = getopt_long(argc, argv, "D:r:i:s:d:b:f:lHOLC3NRX", opts, NULL);
-        if (c == -1)
+        if (len > s_frame_size)
         {
-            break;
+            len = s_frame_size;
         }
 
-        switch (c)
-        {
-        case 'D':
-            s_device = optarg;
-            break;
-        case 'f':
-            s_file_is_set = 1;
-            memset(s_file_path, 0, sizeof(s_file_path));
-            strncpy(s_file_path, optarg, sizeof(s_file_path) - 1);
-            break;
-        case 's':
-            s_speed = (uint32_t)atoi(optarg);
-            break;
-        case 'd':
-            s_delay_us = (uint16_t)atoi(optarg);
-            break;
-        case 'b':
-            s_bits = (uint8_t)atoi(optarg);
-            break;
-        case 'l':
-            s_mode |= SPI_LOOP;
-            break;
-        case 'H':
-            s_mode |= SPI_CPHA;
-            break;
-        case 'i':
-            s_interva_ms = (uint32_t)atoi(optarg);
-            break;
-        case 'O':
-            s_mode |= SPI_CPOL;
-            break;
-        case 'L':
-            s_mode |= SPI_LSB_FIRST;
-            break;
-        case 'C':
-            s_mode |= SPI_CS_HIGH;
-            break;
-        case '3':
-            s_mode |= SPI_3WIRE;
-            break;
-        case 'N':
-            s_mode |= SPI_NO_CS;
-            break;
-        case 'r':
-            s_repeat = (uint32_t)atoi(optarg);
-            break;
-        case 'R':
-            s_mode |= SPI_READY;
-            break;
-        case 'X':
-            i      = 0;
-            s_size = argc - optind;
+        xfer->tx_buf        = (unsigned long)(s_tx_map + offset + bytes);
+        xfer->rx_buf        = (unsigned long)(s_batch_rx + (size_t)count * s_frame_size);
+        xfer->len           = (uint32_t)len;
+        xfer->speed_hz      = s_speed;
+        xfer->bits_per_word = s_bits;
+        xfer->cs_change     = 1;
+        bytes += len;
+        count++;
+    }
 
-            if (s_size > BUF_MAX_SIZE)
-            {
-                printf("The hex data is too long");
-                exit(EXIT_FAILURE);
-            }
+    // cs_change on the last transfer would keep C̅S̅ asserted after the message.
+    xfers[count].cs_change = 0;
 
-            for (index = optind; index < argc; index++, i++)
-            {
-                s_tx_buf[i] = (uint8_t)strtol(argv[index], &p, 0);
-            }
-            break;
-        default:
-            print_usage(argv[0]);
-            break;
-        }
+    if (s_delay_us > 0)
+    {
+        first = &xfers[0];
     }
 
-    if (s_size == 0)
+    PHASE_MARK(PHASE_OUTPUT);
+    PROBE_TRANSFER_START(frame, (uint32_t)bytes);
+    start_ns = monotonic_ns();
+    if (s_watchdog_ms > 0)
     {
-        memcpy(s_tx_buf, s_default_data, sizeof(s_default_data));
-        s_size = sizeof(s_default_data);
+        watchdog_begin(frame, s_tx_map + offset, (uint32_t)bytes, start_ns);
     }
-}
 
-int main(int argc, char *argv[])
-{
-    int fd;
-    int index    = 0;
-    int iterator = 0;
+    if (spi_message(fd, first, count + (s_delay_us > 0)) < 0)
+    {
+        pabort("Failed to send spi message");
+    }
 
-    parse_opts(argc, argv);
+    end_ns = monotonic_ns();
+    if (s_watchdog_ms > 0)
+    {
+        watchdog_end(end_ns);
+    }
+    s_transfer_count++;
+    s_frame_count += count;
+    PHASE_MARK(PHASE_IOCTL);
+    PHASE_WIRE_NS(wire_time_ns((uint32_t)bytes, s_bits, s_speed, s_delay_us));
+    PROBE_TRANSFER_DONE(frame, (uint32_t)bytes, end_ns - start_ns);
 
-    fd = open(s_device, O_RDWR);
-    if (fd < 0)
+    // One message for the kernel tracepoints, under the index of its first frame.
+    if (s_trace_spi)
     {
-        pabort("Failed open SPI device");
+        spitrace_user(frame, start_ns, end_ns);
     }
 
-    /*
-     * spi mode
-     */
-    if (ioctl(fd, SPI_IOC_WR_MODE, &s_mode) == -1)
+    // The frames share the time of the message, in proportion to their length.
+    for (uint32_t i = 0; i < count; i++)
     {
-        pabort("Failed to set spi mode");
+        const struct spi_ioc_transfer *xfer = &xfers[1 + i];
+        size_t                         done = xfer->tx_buf - (unsigned long)(s_tx_map + offset);
+
+        s_tx   = (const uint8_t *)(unsigned long)xfer->tx_buf;
+        s_rx   = (uint8_t *)(unsigned long)xfer->rx_buf;
+        s_size = xfer->len;
+
+        if (!s_quiet)
+        {
+            printf("\n%u\n", frame + i);
+        }
+        record_frame(frame + i, start_ns + (end_ns - start_ns) * done / bytes,
+                     start_ns + (end_ns - start_ns) * (done + s_size) / bytes);
     }
 
-    if (ioctl(fd, SPI_IOC_RD_MODE, &s_mode) == -1)
+    *offset_p = offset + bytes;
+    *end_ns_p = end_ns;
+
+    return count;
+}
+
+/*
+ * Wait for the -i interval after a frame. The wakeup lateness is only
+ * measured when the sched__wakeup probe is compiled in.
+ */
+static void interval_sleep(uint32_t frame)
+{
+    if (s_interval_us == 0)
     {
-        pabort("Failed to get spi mode");
+        // usleep(0) still enters the kernel.
+        (void)frame;
+        return;
     }
 
-    /*
-     * bits per word
-     */
-    if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &s_bits) == -1)
+#ifdef SPIDEV_USDT
+    uint64_t deadline_ns = monotonic_ns() + s_interval_us * NSEC_PER_USEC;
+#endif
+
+    usleep(s_interval_us);
+
+#ifdef SPIDEV_USDT
+    PROBE_SCHED_WAKEUP(frame, monotonic_ns() - deadline_ns);
+#else
+    (void)frame;
+#endif
+}
+
+/*
+ * Switch to the newest reloaded frame table, if there is one, and hand the
+ * old one back to the reload thread. Returns 1 if the table changed.
+ */
+static int take_reload(void)
+{
+    struct reload_info  info;
+    struct frame_table *table = reload_take(&info);
+    uint64_t            now_ns;
+
+    if (table == NULL)
     {
-        pabort("Failed to set bits per word");
+        return 0;
     }
 
-    if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &s_bits) == -1)
+    now_ns = monotonic_ns();
+    reload_retire(s_table);
+    s_table = table;
+
+    printf("reload: %u frames, ready %.1f ms and in use %.1f ms after the change\n", table->count,
+           (double)(info.ready_ns - info.changed_ns) / NSEC_PER_MSEC, (double)(now_ns - info.changed_ns) / NSEC_PER_MSEC);
+    return 1;
+}
+
+/*
+ * Compare the syscalls and heap allocations of the frame that just completed
+ * with the budget. The first frame is not checked: it is where lazily
+ * initialized state, such as the stdio buffers, gets set up.
+ */
+static void check_budget(uint32_t frame)
+{
+    struct budget_counts now;
+    uint64_t             syscalls;
+    uint64_t             allocs;
+
+    budget_read(&now);
+    syscalls = now.syscalls - s_budget_mark.syscalls;
+    allocs   = now.allocs - s_budget_mark.allocs;
+
+    if (s_budget_frames++ > 0)
     {
-        pabort("Failed to get bits per word");
+        if (syscalls > s_budget_max.syscalls)
+        {
+            s_budget_max.syscalls = syscalls;
+        }
+
+        if (allocs > s_budget_max.allocs)
+        {
+            s_budget_max.allocs = allocs;
+        }
+
+        if ((syscalls > (uint64_t)s_syscall_budget || allocs > 0) && s_budget_over++ == 0)
+        {
+            s_budget_first        = frame;
+            s_budget_first_counts = (struct budget_counts){syscalls, allocs};
+            s_budget_nr_len       = budget_recent(s_budget_mark.syscalls, s_budget_nrs, BUDGET_RECENT);
+        }
     }
 
-    /*
-     * max speed hz
-     */
-    if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &s_speed) == -1)
+    budget_read(&s_budget_mark);
+}
+
+/*
+ * Print the budget summary. Returns -1 if any frame went over budget.
+ */
+static int report_budget(FILE *out)
+{
+    fprintf(out, "\nbudget: %" PRIu64 " steady-state frames, at most %" PRIu64 " syscalls (budget %ld)",
+            s_budget_frames > 0 ? s_budget_frames - 1 : 0, s_budget_max.syscalls, s_syscall_budget);
+
+    if (budget_allocs_counted())
+    {
+        fprintf(out, " and %" PRIu64 " allocations (budget 0) per frame\n", s_budget_max.allocs);
+    }
+    else
     {
-        pabort("Failed to set max speed hz");
+        fprintf(out, " per frame, allocations not counted (build with BUDGET_ALLOCS=1 on glibc)\n");
     }
 
-    if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &s_speed) == -1)
+    if (s_budget_over == 0)
     {
-        pabort("Failed to get max speed hz");
+        return 0;
     }
 
-    printf("spi mode: %d\n", s_mode);
-    printf("bits per word: %d\n", s_bits);
-    printf("max speed: %d Hz (%d KHz)\n", s_speed, s_speed / 1000);
+    fprintf(out, "budget: exceeded by %" PRIu64 " frames, first frame %u with %" PRIu64 " syscalls and %" PRIu64
+            " allocations\n", s_budget_over, s_budget_first, s_budget_first_counts.syscalls,
+            s_budget_first_counts.allocs);
 
-    for (uint32_t i = 0; i < s_repeat; i++)
+    if (s_budget_nr_len > 0)
     {
-        if (s_file_is_set)
+        fprintf(out, "budget: syscall numbers of frame %u:", s_budget_first);
+        for (int i = 0; i < s_budget_nr_len; i++)
         {
-            s_size = sizeof(s_tx_buf);
-            while (config_file_get_next(&iterator, s_tx_buf, &s_size) >= 0)
-            {
-                printf("\n%d.%d\n", i, index++);
-                transfer(fd);
-                usleep(s_interva_ms * 1000);
-                s_size = sizeof(s_tx_buf);
-            }
-        }
-        else
-        {
-            printf("\n%d\n", i++);
-            transfer(fd);
-            usleep(s_interva_ms * 1000);
+            fprintf(out, " %d", s_budget_nrs[i]);
         }
+        fprintf(out, "\n");
+    }
+
+    return -1;
+}
+
+/*
+ * The settings of the run, for the watchdog report.
+ */
+static void describe_device(FILE *out)
+{
+    fprintf(out, "watchdog: %s mode 0x%02x, %u bits, %u Hz, CS delay %u us, batch %u\n",
+            (s_emu != NULL) ? "emulated device" : s_device, s_mode, s_bits, s_speed, s_delay_us,
+            s_batch_auto ? s_tune.batch : s_batch);
+}
+
+/*
+ * Note that the run has got to (repeat, frame, offset), and hand the
+ * checkpoint writer a snapshot if it asked for one.
+ */
+static void mark_progress(uint32_t repeat, uint32_t frame, uint64_t offset)
+{
+    if (s_checkpoint_path == NULL)
+    {
+        return;
+    }
+
+    s_pos.repeat    = repeat;
+    s_pos.frame     = frame;
+    s_pos.offset    = offset;
+    s_pos.transfers = s_resumed_transfers + s_transfer_count;
+
+    if (checkpoint_due())
+    {
+        checkpoint_take(&s_pos);
     }
+}
+
+/*
+ * Identify what is being sent, so that a checkpoint is only resumed against
+ * the input it was taken from.
+ */
+static void input_id(char *buf, size_t size)
+{
+    const char *path = (s_tx_file_path != NULL) ? s_tx_file_path : s_file_is_set ? s_file_path : NULL;
+    struct stat st;
 
-    close(fd);
+    if (path != NULL && stat(path, &st) == 0)
+    {
+        snprintf(buf, size, "%s %s size=%lld mtime=%lld.%09ld", (s_tx_file_path != NULL) ? "tx-file" : "file", path,
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+    else
+    {
+        snprintf(buf, size, "data len=%u hash=%016" PRIx64, s_size, stats_hash(s_tx_buf, s_size));
+    }
+}
+
+/*
+ * Send the frames of a stream once, as they arrive. -r does not apply, and
+ * the interval is slept after every frame since the last one is not known
+ * in advance.
+ */
+static void stream_frames(int fd)
+{
+    int len;
+
+    for (uint32_t frame = 0; !s_stop && (len = frame_stream_next(s_stream, s_tx_buf)) >= 0; frame++)
+    {
+        s_size = (uint32_t)len;
+        PHASE_MARK(PHASE_PARSE);
+        PROBE_FRAME_LOAD(frame, s_size);
+        if (!s_quiet)
+        {
+            printf("\n%u\n", frame);
+        }
+        transfer(fd, frame);
+        interval_sleep(frame);
+        PHASE_MARK(PHASE_SLEEP);
+        if (s_budget)
+        {
+            check_budget(frame);
+        }
+    }
+}
+
+/*
+ * Wait until deadline_ns. Sleeping wakes up tens of microseconds late, so
+ * the last stretch is spun.
+ */
+static void wait_until_ns(uint64_t deadline_ns)
+{
+    if (deadline_ns > monotonic_ns() + GAP_SPIN_NS)
+    {
+        sleep_until_ns(deadline_ns - GAP_SPIN_NS);
+    }
+
+    while (monotonic_ns() < deadline_ns)
+    {
+    }
+}
+
+/*
+ * Send s_gap_trials frame pairs, frames 0 and 1 of the -f file or the -X
+ * data twice, with gap_ns from the return of each transfer to the start of
+ * the next. Returns how many pairs had a second response that did not
+ * check out.
+ */
+static uint32_t try_gap(int fd, uint64_t gap_ns)
+{
+    uint32_t errors  = 0;
+    uint64_t next_ns = 0;
+
+    for (uint32_t trial = 0; !s_stop && trial < s_gap_trials; trial++)
+    {
+        for (uint32_t frame = 0; frame < 2; frame++)
+        {
+            if (s_file_is_set)
+            {
+                uint32_t index = (s_table->count > 1) ? frame : 0;
+
+                s_size = frame_table_len(s_table, index);
+                memcpy(s_tx_buf, frame_table_data(s_table, index), s_size);
+            }
+
+            wait_until_ns(next_ns);
+            transfer(fd, frame);
+            next_ns = monotonic_ns() + gap_ns;
+        }
+
+        if (verify_rx() == STATS_VERIFY_FAIL)
+        {
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+/*
+ * --find-interval: bisect the shortest gap between transfers at which no
+ * response goes wrong, between 0 and -i, and set -i to it plus a 50%
+ * margin. A gap that passes is tried once more with ten times the pairs
+ * before it is believed, since the failures near the edge are sporadic.
+ */
+static void find_interval(int fd)
+{
+    uint64_t lo_ns  = 0;
+    uint64_t max_ns = (s_interval_us > 0) ? s_interval_us * NSEC_PER_USEC : 10 * NSEC_PER_MSEC;
+    uint64_t hi_ns  = max_ns;
+    uint32_t trials = s_gap_trials;
+    int      quiet  = s_quiet;
+    int      stats  = s_stats_enabled;
+    uint32_t errors;
+
+    if (s_replay_path != NULL || s_tx_file_path != NULL || s_stream != NULL ||
+        (s_file_is_set && s_table->count == 0))
+    {
+        printf("--find-interval sends the frames of a -f file, or the -X data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (s_expect.len == 0 && !(s_mode & SPI_LOOP))
+    {
+        printf("--find-interval needs --expect or -l to know the right response\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The pairs are not part of the run.
+    s_quiet         = 1;
+    s_stats_enabled = 0;
+
+    if ((errors = try_gap(fd, hi_ns)) > 0)
+    {
+        printf("interval: %u of %u responses wrong even %.3f ms apart\n", errors, s_gap_trials,
+               (double)hi_ns / NSEC_PER_MSEC);
+        exit(EXIT_FAILURE);
+    }
+
+    while (!s_stop)
+    {
+        while (!s_stop && hi_ns - lo_ns > GAP_RESOLUTION_NS)
+        {
+            uint64_t mid_ns = lo_ns + (hi_ns - lo_ns) / 2;
+
+            errors = try_gap(fd, mid_ns);
+            printf("interval: %8.3f ms, %u of %u responses wrong\n", (double)mid_ns / NSEC_PER_MSEC, errors,
+                   s_gap_trials);
+            if (errors > 0)
+            {
+                lo_ns = mid_ns;
+            }
+            else
+            {
+                hi_ns = mid_ns;
+            }
+        }
+
+        s_gap_trials = trials * 10;
+        errors       = try_gap(fd, hi_ns);
+        s_gap_trials = trials;
+        if (errors == 0)
+        {
+            break;
+        }
+
+        // Sporadic failures: start again above the gap that let one through.
+        printf("interval: %8.3f ms, %u of %u responses wrong on the second look\n", (double)hi_ns / NSEC_PER_MSEC,
+               errors, trials * 10);
+        if (hi_ns == max_ns)
+        {
+            exit(EXIT_FAILURE);
+        }
+        lo_ns = hi_ns;
+        hi_ns = (hi_ns * 2 + GAP_RESOLUTION_NS < max_ns) ? hi_ns * 2 + GAP_RESOLUTION_NS : max_ns;
+    }
+
+    s_quiet         = quiet;
+    s_stats_enabled = stats;
+
+    if (s_stop)
+    {
+        return;
+    }
+
+    s_interval_us = (uint32_t)((hi_ns * 3 / 2 + NSEC_PER_USEC - 1) / NSEC_PER_USEC);
+    printf("interval: shortest safe gap %.3f ms; with a 50%% margin, -i %.3f\n", (double)hi_ns / NSEC_PER_MSEC,
+           (double)s_interval_us / 1000);
+}
+
+/*
+ * --characterize: time transfer() over the grid of --sizes and --speeds,
+ * back to back, with a counting pattern as the TX data (checked in
+ * loopback mode). Each speed is set per transfer, as in the message.
+ */
+static int characterize_run(int fd)
+{
+    // Finer steps in the range where controllers tend to switch from PIO to DMA.
+    static const uint32_t sizes[] = {1, 2, 4, 8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+    struct characterize   ch;
+    uint64_t              times_ns[SWEEP_MAX_MESSAGES];
+    uint32_t              speed = s_speed;
+    int                   ret;
+
+    if (s_sweep_size_count == 0)
+    {
+        memcpy(s_sweep_sizes, sizes, sizeof(sizes));
+        s_sweep_size_count = sizeof(sizes) / sizeof(sizes[0]);
+    }
+
+    if (s_sweep_speed_count == 0)
+    {
+        for (uint32_t divider = 8; divider >= 1; divider /= 2)
+        {
+            s_sweep_speeds[s_sweep_speed_count++] = (speed / divider > 0) ? speed / divider : 1;
+        }
+    }
+
+    if (characterize_init(&ch, s_sweep_speeds, s_sweep_speed_count, s_sweep_sizes, s_sweep_size_count) < 0)
+    {
+        pabort("Failed to allocate the characterization");
+    }
+
+    s_quiet         = 1;
+    s_stats_enabled = 0;
+    for (uint32_t i = 0; i < BUF_MAX_SIZE; i++)
+    {
+        s_tx_buf[i] = (uint8_t)i;
+    }
+
+    for (int i = 0; !s_stop && i < s_sweep_speed_count; i++)
+    {
+        s_speed = s_sweep_speeds[i];
+        for (int j = 0; !s_stop && j < s_sweep_size_count; j++)
+        {
+            uint64_t start_ns = monotonic_ns();
+            uint32_t count    = 0;
+            uint32_t errors   = 0;
+
+            s_size = s_sweep_sizes[j];
+            while (!s_stop && count < SWEEP_MAX_MESSAGES &&
+                   (count < SWEEP_MIN_MESSAGES || monotonic_ns() - start_ns < SWEEP_POINT_NS))
+            {
+                uint64_t before_ns = monotonic_ns();
+
+                transfer(fd, count);
+                times_ns[count++] = monotonic_ns() - before_ns;
+                if (verify_rx() == STATS_VERIFY_FAIL)
+                {
+                    errors++;
+                }
+            }
+
+            characterize_add(&ch, s_speed, s_size, times_ns, count, errors,
+                             wire_time_ns(s_size, s_bits, s_speed, s_delay_us));
+        }
+        printf("characterize: %u Hz done\n", s_speed);
+    }
+    s_speed = speed;
+
+    ret = characterize_report(&ch, s_characterize_csv, stdout);
+    characterize_free(&ch);
+
+    return ret;
+}
+
+/*
+ * The largest message spidev accepts, from its bufsiz module parameter.
+ */
+static uint32_t spidev_bufsiz(void)
+{
+    FILE        *fp     = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+    unsigned int bufsiz = 4096;
+
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%u", &bufsiz) != 1)
+        {
+            bufsiz = 4096;
+        }
+        fclose(fp);
+    }
+
+    return bufsiz;
+}
+
+/*
+ * Map the --tx-file and size its frames and batches to what one message
+ * may carry.
+ */
+static void open_tx_file(void)
+{
+    struct stat st;
+    uint32_t    bufsiz = spidev_bufsiz();
+    int         tx_fd;
+
+    if ((tx_fd = open(s_tx_file_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(tx_fd, &st) < 0)
+    {
+        pabort("Failed to open the tx file");
+    }
+
+    s_tx_map_size = (size_t)st.st_size;
+    if (s_tx_map_size > 0)
+    {
+        void *map = mmap(NULL, s_tx_map_size, PROT_READ, MAP_PRIVATE, tx_fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            pabort("Failed to map the tx file");
+        }
+
+        madvise(map, s_tx_map_size, MADV_SEQUENTIAL);
+        s_tx_map = map;
+    }
+    close(tx_fd);
+
+    if (s_frame_size == 0)
+    {
+        s_frame_size = bufsiz;
+    }
+
+    if (s_frame_size > bufsiz)
+    {
+        printf("--frame-size %u is larger than the spidev bufsiz of %u bytes\n", s_frame_size, bufsiz);
+        exit(EXIT_FAILURE);
+    }
+
+    // --batch auto tries everything up to the largest batch that fits.
+    if (s_batch_auto || s_batch > BATCH_MAX)
+    {
+        s_batch = BATCH_MAX;
+    }
+    else if (s_batch == 0)
+    {
+        s_batch = 1;
+    }
+
+    // bufsiz bounds the whole message, not each transfer.
+    if ((uint64_t)s_batch * s_frame_size > bufsiz)
+    {
+        s_batch = bufsiz / s_frame_size;
+        if (!s_batch_auto)
+        {
+            printf("batch: %u frames of %u bytes per message to fit the spidev bufsiz of %u bytes\n", s_batch,
+                   s_frame_size, bufsiz);
+        }
+    }
+
+    if ((s_batch_rx = malloc((size_t)s_batch * s_frame_size)) == NULL)
+    {
+        pabort("Failed to allocate the rx buffer");
+    }
+}
+
+/*
+ * What a tuned batch is saved under: the device with its controller, or the
+ * emulated peripheral, and the speed and frame size it was measured with.
+ */
+static void tune_key(int fd, char *key, size_t size)
+{
+    char        link[64];
+    char        path[PATH_MAX];
+    struct stat st;
+
+    if (s_emu != NULL)
+    {
+        snprintf(path, sizeof(path), "emulate:%s", s_emulate_spec);
+    }
+    else if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode) ||
+             snprintf(link, sizeof(link), "/sys/dev/char/%u:%u", major(st.st_rdev), minor(st.st_rdev)) < 0 ||
+             realpath(link, path) == NULL)
+    {
+        // Without sysfs the node name is the best there is.
+        snprintf(path, sizeof(path), "%s", s_device);
+    }
+
+    snprintf(key, size, "%s speed=%u bits=%u frame=%u", path, s_speed, s_bits, s_frame_size);
+}
+
+static void send_tx_file(int fd)
+{
+    // A resumed run picks up the first repeat where the checkpoint left it.
+    size_t   offset = s_pos.offset;
+    uint32_t frame  = s_pos.frame;
+    uint32_t batch  = s_batch;
+
+    if (s_batch_auto)
+    {
+        char key[sizeof(s_tune.key)];
+
+        tune_key(fd, key, sizeof(key));
+        batch = tune_start(&s_tune, s_batch, key, s_tune_path);
+    }
+
+    for (uint32_t i = s_pos.repeat; !s_stop && i < s_repeat; i++, offset = 0, frame = 0)
+    {
+        while (!s_stop && offset < s_tx_map_size)
+        {
+            uint32_t first    = frame;
+            uint64_t start_ns = s_batch_auto ? monotonic_ns() : 0;
+            uint64_t end_ns;
+
+            PHASE_MARK(PHASE_PARSE);
+            frame += transfer_batch(fd, first, &offset, batch, &end_ns);
+            mark_progress(i, frame, offset);
+            if (i + 1 < s_repeat || offset < s_tx_map_size)
+            {
+                interval_sleep(first);
+            }
+            PHASE_MARK(PHASE_SLEEP);
+            if (s_batch_auto)
+            {
+                // Only the building of the message and the ioctl count: the -i sleep takes as long
+                // whatever the batch, and would make the largest batch win every time.
+                batch = tune_next(&s_tune, frame - first, end_ns - start_ns);
+            }
+            if (s_budget)
+            {
+                check_budget(first);
+            }
+        }
+    }
+}
+
+/*
+ * Resume from the checkpoint if asked to, then start taking new ones.
+ */
+static void start_checkpoints(void)
+{
+    char input[512];
+
+    if (s_checkpoint_path == NULL)
+    {
+        printf("--resume needs the --checkpoint file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (s_stream != NULL || s_replay_path != NULL)
+    {
+        printf("--checkpoint does not apply to streams and replays\n");
+        s_checkpoint_path = NULL;
+        return;
+    }
+
+    input_id(input, sizeof(input));
+
+    if (s_resume)
+    {
+        if (checkpoint_load(s_checkpoint_path, input, &s_pos, s_stats_enabled ? &s_stats : NULL) < 0)
+        {
+            printf("Cannot resume from %s\n", s_checkpoint_path);
+            exit(EXIT_FAILURE);
+        }
+
+        s_resumed_transfers = s_pos.transfers;
+        printf("resume: repeat %u, frame %u, after %" PRIu64 " transfers\n", s_pos.repeat, s_pos.frame,
+               s_pos.transfers);
+    }
+
+    if (checkpoint_start(s_checkpoint_path, s_checkpoint_s, input, s_stats_enabled ? &s_stats : NULL) < 0)
+    {
+        pabort("Failed to start the checkpoint writer");
+    }
+}
+
+static void parse_opts(int argc, char *argv[])
+{
+    int   i, index;
+    char *p;
+
+    while (1)
+    {
+        int                        c;
+        static const struct option opts[] = {
+            {"device", 1, 0, 'D'},  {"speed", 1, 0, 's'},  {"delay", 1, 0, 'd'},    {"bpw", 1, 0, 'b'},
+            {"loop", 0, 0, 'l'},    {"cpha", 0, 0, 'H'},   {"cpol", 0, 0, 'O'},     {"lsb", 0, 0, 'L'},
+            {"cs-high", 0, 0, 'C'}, {"3wire", 0, 0, '3'},  {"no-cs", 0, 0, 'N'},    {"ready", 0, 0, 'R'},
+            {"Xdata", 1, 0, 'X'},   {"repeat", 1, 0, 'r'}, {"interval", 1, 0, 'i'}, {"file", 1, 0, 'f'},
+            {"capture", 1, 0, 'w'}, {"replay", 1, 0, OPT_REPLAY},
+            {"replay-speed", 1, 0, OPT_REPLAY_SPEED},
+            {"capture-format", 1, 0, OPT_CAPTURE_FORMAT},
+            {"query", 1, 0, OPT_QUERY},
+            {"from", 1, 0, OPT_FROM},
+            {"to", 1, 0, OPT_TO},
+            {"match-tx", 1, 0, OPT_MATCH_TX},
+            {"match-rx", 1, 0, OPT_MATCH_RX},
+            {"stats", 2, 0, OPT_STATS},
+            {"expect", 1, 0, OPT_EXPECT},
+            {"trace-spi", 2, 0, OPT_TRACE_SPI},
+            {"perf-counters", 0, 0, OPT_PERF_COUNTERS},
+            {"quiet", 0, 0, 'q'},
+            {"budget", 2, 0, OPT_BUDGET},
+            {"state-file", 1, 0, OPT_STATE_FILE},
+            {"emulate", 1, 0, OPT_EMULATE},
+            {"watch", 0, 0, OPT_WATCH},
+            {"tx-file", 1, 0, OPT_TX_FILE},
+            {"frame-size", 1, 0, OPT_FRAME_SIZE},
+            {"batch", 1, 0, OPT_BATCH},
+            {"checkpoint", 1, 0, OPT_CHECKPOINT},
+            {"checkpoint-interval", 1, 0, OPT_CHECKPOINT_INTERVAL},
+            {"resume", 0, 0, OPT_RESUME},
+            {"watchdog", 1, 0, OPT_WATCHDOG},
+            {"watchdog-action", 1, 0, OPT_WATCHDOG_ACTION},
+            {"tune-file", 1, 0, OPT_TUNE_FILE},
+            {"find-interval", 2, 0, OPT_FIND_INTERVAL},
+            {"characterize", 2, 0, OPT_CHARACTERIZE},
+            {"sizes", 1, 0, OPT_SIZES},
+            {"speeds", 1, 0, OPT_SPEEDS},
+            {"metrics-socket", 1, 0, OPT_METRICS_SOCKET},
+            {"metrics-file", 1, 0, OPT_METRICS_FILE},
+            {"metrics-interval", 1, 0, OPT_METRICS_INTERVAL},
+            {"top", 0, 0, OPT_TOP},
+            {NULL, 0, 0, 0},
+        };
+
+        c = getopt_long(argc, argv, "D:r:i:s:d:b:f:w:lqHOLC3NRX", opts, NULL);
+        if (c == -1)
+        {
+            break;
+        }
+
+        switch (c)
+        {
+        case 'D':
+            s_device = optarg;
+            break;
+        case 'f':
+            s_file_is_set = 1;
+            memset(s_file_path, 0, sizeof(s_file_path));
+            strncpy(s_file_path, optarg, sizeof(s_file_path) - 1);
+            break;
+        case 'w':
+            s_capture_path = optarg;
+            break;
+        case OPT_REPLAY:
+            s_replay_path = optarg;
+            break;
+        case OPT_REPLAY_SPEED:
+            s_replay_speed = atof(optarg);
+            if (s_replay_speed < 0)
+            {
+                printf("The replay speed must not be negative");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_CAPTURE_FORMAT:
+            if (strcmp(optarg, "text") == 0)
+            {
+                s_capture_format = CAPTURE_FORMAT_TEXT;
+            }
+            else if (strcmp(optarg, "indexed") == 0)
+            {
+                s_capture_format = CAPTURE_FORMAT_INDEXED;
+            }
+            else if (strcmp(optarg, "delta") == 0)
+            {
+                s_capture_format = CAPTURE_FORMAT_DELTA;
+            }
+            else
+            {
+                print_usage(argv[0]);
+            }
+            break;
+        case OPT_QUERY:
+            s_query_path = optarg;
+            break;
+        case OPT_FROM:
+            s_query.from_ns = (uint64_t)(atof(optarg) * NSEC_PER_SEC);
+            break;
+        case OPT_TO:
+            s_query.to_ns = (uint64_t)(atof(optarg) * NSEC_PER_SEC);
+            break;
+        case OPT_MATCH_TX:
+        case OPT_MATCH_RX:
+            if (capture_parse_pattern(optarg, (c == OPT_MATCH_TX) ? &s_query.tx : &s_query.rx) < 0)
+            {
+                printf("Invalid match pattern: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STATS:
+            if (stats_init(&s_stats, (optarg && strcmp(optarg, "hash") == 0) ? STATS_KEY_TX_HASH : STATS_KEY_INDEX,
+                           STATS_MAX_FRAMES) < 0)
+            {
+                pabort("Failed to allocate statistics");
+            }
+            s_stats_enabled = 1;
+            break;
+        case OPT_EXPECT:
+            if (capture_parse_pattern(optarg, &s_expect) < 0)
+            {
+                printf("Invalid expected data: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_TRACE_SPI:
+            s_trace_spi      = 1;
+            s_trace_csv_path = optarg;
+            break;
+        case OPT_PERF_COUNTERS:
+            s_perf_counters = 1;
+            break;
+        case OPT_EMULATE:
+            s_emulate_spec = optarg;
+            break;
+        case OPT_WATCH:
+            s_watch = 1;
+            break;
+        case OPT_TX_FILE:
+            s_tx_file_path = optarg;
+            break;
+        case OPT_FRAME_SIZE:
+            s_frame_size = (uint32_t)atoi(optarg);
+            break;
+        case OPT_BATCH:
+            s_batch_set  = 1;
+            s_batch_auto = (strcmp(optarg, "auto") == 0);
+            s_batch      = (uint32_t)atoi(optarg);
+            break;
+        case OPT_TUNE_FILE:
+            s_tune_path = optarg;
+            break;
+        case OPT_CHARACTERIZE:
+            s_characterize     = 1;
+            s_characterize_csv = optarg;
+            break;
+        case OPT_SIZES:
+            s_sweep_size_count = characterize_parse_list(optarg, 1, s_sweep_sizes, CHARACTERIZE_MAX_POINTS);
+            for (int i = 0; i < s_sweep_size_count; i++)
+            {
+                if (s_sweep_sizes[i] > BUF_MAX_SIZE)
+                {
+                    s_sweep_size_count = -1;
+                }
+            }
+            if (s_sweep_size_count < 0)
+            {
+                printf("--sizes takes up to %d sizes of 1 to %d bytes, e.g. 1,16,256,1k\n", CHARACTERIZE_MAX_POINTS,
+                       BUF_MAX_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SPEEDS:
+            if ((s_sweep_speed_count = characterize_parse_list(optarg, 0, s_sweep_speeds, CHARACTERIZE_MAX_POINTS)) < 0)
+            {
+                printf("--speeds takes up to %d speeds in Hz, e.g. 500k,1M,10M\n", CHARACTERIZE_MAX_POINTS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_METRICS_SOCKET:
+            s_metrics_socket = optarg;
+            break;
+        case OPT_METRICS_FILE:
+            s_metrics_file = optarg;
+            break;
+        case OPT_METRICS_INTERVAL:
+            s_metrics_s = (uint32_t)atoi(optarg);
+            break;
+        case OPT_TOP:
+            s_top   = 1;
+            s_quiet = 1;
+            break;
+        case OPT_FIND_INTERVAL:
+            s_gap_trials = optarg ? (uint32_t)atoi(optarg) : GAP_TRIALS;
+            if (s_gap_trials == 0)
+            {
+                s_gap_trials = GAP_TRIALS;
+            }
+            break;
+        case OPT_CHECKPOINT:
+            s_checkpoint_path = optarg;
+            break;
+        case OPT_CHECKPOINT_INTERVAL:
+            s_checkpoint_s = (uint32_t)atoi(optarg);
+            break;
+        case OPT_RESUME:
+            s_resume = 1;
+            break;
+        case OPT_WATCHDOG:
+            s_watchdog_ms = (uint32_t)atoi(optarg);
+            break;
+        case OPT_WATCHDOG_ACTION:
+            if (watchdog_parse_action(optarg, &s_watchdog_action, &s_watchdog_signo) < 0)
+            {
+                printf("Unknown watchdog action %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STATE_FILE:
+            s_state_path = optarg;
+            break;
+        case 'q':
+            s_quiet = 1;
+            break;
+        case OPT_BUDGET:
+            s_budget = 1;
+            s_quiet  = 1;
+            if (optarg)
+            {
+                s_syscall_budget = atol(optarg);
+            }
+            break;
+        case 's':
+            s_speed = (uint32_t)atoi(optarg);
+            break;
+        case 'd':
+            s_delay_us = (uint16_t)atoi(optarg);
+            break;
+        case 'b':
+            s_bits = (uint8_t)atoi(optarg);
+            break;
+        case 'l':
+            s_mode |= SPI_LOOP;
+            break;
+        case 'H':
+            s_mode |= SPI_CPHA;
+            break;
+        case 'i':
+            s_interval_us = (uint32_t)(strtod(optarg, NULL) * 1000);
+            break;
+        case 'O':
+            s_mode |= SPI_CPOL;
+            break;
+        case 'L':
+            s_mode |= SPI_LSB_FIRST;
+            break;
+        case 'C':
+            s_mode |= SPI_CS_HIGH;
+            break;
+        case '3':
+            s_mode |= SPI_3WIRE;
+            break;
+        case 'N':
+            s_mode |= SPI_NO_CS;
+            break;
+        case 'r':
+            s_repeat = (uint32_t)atoi(optarg);
+            break;
+        case 'R':
+            s_mode |= SPI_READY;
+            break;
+        case 'X':
+            i      = 0;
+            s_size = argc - optind;
+
+            if (s_size > BUF_MAX_SIZE)
+            {
+                printf("The hex data is too long");
+                exit(EXIT_FAILURE);
+            }
+
+            for (index = optind; index < argc; index++, i++)
+            {
+                s_tx_buf[i] = (uint8_t)strtol(argv[index], &p, 0);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            break;
+        }
+    }
+
+    if (s_size == 0)
+    {
+        memcpy(s_tx_buf, s_default_data, sizeof(s_default_data));
+        s_size = sizeof(s_default_data);
+    }
+}
+
+/*
+ * Re-issue every transaction of a capture at its recorded offset, scaled by
+ * s_replay_speed. Deadlines are absolute so that the time spent printing and
+ * parsing the next record does not accumulate as drift.
+ */
+static void replay(int fd)
+{
+    struct capture_reader *reader;
+    struct capture_record  record;
+    struct histogram       lateness;
+    uint64_t               base_ns    = 0;
+    uint64_t               issue_ns   = 0;
+    uint64_t               last_t_ns  = 0;
+    uint32_t               rx_differs = 0;
+    uint32_t               index      = 0;
+    int                    ret        = 0;
+
+    hist_init(&lateness);
+
+    for (uint32_t i = 0; !s_stop && i < s_repeat; i++)
+    {
+        if ((reader = capture_reader_open(s_replay_path)) == NULL)
+        {
+            pabort("Failed to open capture");
+        }
+
+        base_ns = monotonic_ns();
+
+        while (!s_stop && (ret = capture_read(reader, &record)) > 0)
+        {
+            if (record.len > sizeof(s_tx_buf))
+            {
+                printf("The captured frame is too long\n");
+                exit(EXIT_FAILURE);
+            }
+
+            PHASE_MARK(PHASE_PARSE);
+            PROBE_FRAME_LOAD(index, record.len);
+
+            memcpy(s_tx_buf, record.tx, record.len);
+            s_size     = record.len;
+            s_speed    = record.speed_hz;
+            s_delay_us = record.delay_us;
+            s_bits     = record.bits;
+            last_t_ns  = record.t_ns;
+
+            if (s_replay_speed > 0)
+            {
+                uint64_t deadline_ns = base_ns + (uint64_t)((double)record.t_ns / s_replay_speed);
+
+                sleep_until_ns(deadline_ns);
+                PHASE_MARK(PHASE_SLEEP);
+                issue_ns = monotonic_ns();
+                PROBE_SCHED_WAKEUP(index, issue_ns - deadline_ns);
+                hist_add(&lateness, issue_ns - deadline_ns);
+            }
+
+            if (!s_quiet)
+            {
+                printf("\n%d.%d\n", i, index);
+            }
+            transfer(fd, index);
+
+            if (record.rx != NULL && memcmp(record.rx, s_rx_buf, record.len) != 0)
+            {
+                rx_differs++;
+            }
+
+            if (s_budget)
+            {
+                check_budget(index);
+            }
+            index++;
+        }
+
+        capture_reader_close(reader);
+
+        if (ret < 0)
+        {
+            printf("Malformed capture record after transaction %d\n", index);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("\nreplay: %" PRIu64 " transactions, rx differs from capture in %u\n", (uint64_t)index, rx_differs);
+
+    if (s_replay_speed > 0 && lateness.count > 0)
+    {
+        printf("replay: last pass recorded %.3f ms, scheduled %.3f ms, achieved %.3f ms (speed %.2f)\n",
+               (double)last_t_ns / NSEC_PER_MSEC, (double)last_t_ns / s_replay_speed / NSEC_PER_MSEC,
+               (double)(issue_ns - base_ns) / NSEC_PER_MSEC, s_replay_speed);
+        printf("replay: lateness min/avg/p50/p99/max = %.1f/%.1f/%.1f/%.1f/%.1f us\n",
+               (double)lateness.min / NSEC_PER_USEC, (double)hist_mean(&lateness) / NSEC_PER_USEC,
+               (double)hist_percentile(&lateness, 50) / NSEC_PER_USEC,
+               (double)hist_percentile(&lateness, 99) / NSEC_PER_USEC, (double)lateness.max / NSEC_PER_USEC);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int              fd;
+    int              index  = 0;
+    int              status = 0;
+    struct devconfig config;
+    const char      *failed;
+
+    parse_opts(argc, argv);
+
+    if (s_query_path != NULL)
+    {
+        return (capture_run_query(s_query_path, &s_query, stdout) < 0) ? EXIT_FAILURE : 0;
+    }
+
+    if (s_batch_set && s_tx_file_path == NULL)
+    {
+        printf("--batch packs the frames of a --tx-file, it does nothing for other input\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (s_tx_file_path != NULL)
+    {
+        open_tx_file();
+    }
+    else if (s_file_is_set && s_replay_path == NULL && frame_path_is_stream(s_file_path))
+    {
+        if ((s_stream = frame_stream_open(s_file_path, sizeof(s_tx_buf), &s_stop)) == NULL)
+        {
+            pabort("Failed to open the frame stream");
+        }
+    }
+    else if (s_file_is_set && s_replay_path == NULL)
+    {
+        frame_table_init(&s_frames);
+        if (frame_table_load(&s_frames, s_file_path, sizeof(s_tx_buf)) < 0)
+        {
+            pabort("Failed to read the frame file");
+        }
+
+        if (s_watch && reload_start(s_file_path, sizeof(s_tx_buf), &s_frames) < 0)
+        {
+            pabort("Failed to watch the frame file");
+        }
+    }
+
+    if (s_stats_enabled && (s_replay_path != NULL || s_stream != NULL))
+    {
+        // A capture or a stream has no file position that comes round again on the next repeat, so an index would
+        // only count up into the "other" row; the same commands are told apart by their data instead.
+        s_stats.key = STATS_KEY_TX_HASH;
+    }
+
+    if (s_syscall_budget < 0)
+    {
+        // The transfer ioctl, and the interval sleep if there is one.
+        s_syscall_budget = (s_interval_us > 0) ? 2 : 1;
+    }
+
+    if (s_replay_path != NULL && s_mode == 0)
+    {
+        struct capture_reader *reader = capture_reader_open(s_replay_path);
+
+        if (reader == NULL)
+        {
+            pabort("Failed to open capture");
+        }
+
+        s_mode = capture_reader_mode(reader);
+        capture_reader_close(reader);
+    }
+
+    if (s_emulate_spec != NULL)
+    {
+        // The emulated peripheral takes whatever mode, word size and speed it is given.
+        fd = -1;
+        if ((s_emu = emu_open(s_emulate_spec, s_speed)) == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        fd = open(s_device, O_RDWR);
+        if (fd < 0)
+        {
+            pabort("Failed open SPI device");
+        }
+
+        config.mode  = s_mode;
+        config.bits  = s_bits;
+        config.speed = s_speed;
+
+        if (devconfig_apply(fd, s_state_path, &config, &failed) < 0)
+        {
+            pabort(failed);
+        }
+
+        s_mode  = config.mode;
+        s_bits  = config.bits;
+        s_speed = config.speed;
+    }
+
+    printf("spi mode: %d\n", s_mode);
+    printf("bits per word: %d\n", s_bits);
+    printf("max speed: %d Hz (%d KHz)\n", s_speed, s_speed / 1000);
+
+    // A single transfer has nothing to stop early, so spare it the syscalls.
+    if (s_repeat > 1 || s_file_is_set || s_replay_path != NULL || s_tx_file_path != NULL || s_gap_trials > 0 ||
+        s_characterize)
+    {
+        signal(SIGINT, on_stop_signal);
+        signal(SIGTERM, on_stop_signal);
+    }
+
+    if (s_gap_trials > 0)
+    {
+        find_interval(fd);
+    }
+
+    if (s_trace_spi && spitrace_start(s_device, s_trace_csv_path) < 0)
+    {
+        printf("Continuing without kernel spi tracing\n");
+        s_trace_spi = 0;
+    }
+
+    if (s_perf_counters && perfcount_start() < 0)
+    {
+        printf("Continuing without performance counters\n");
+        s_perf_counters = 0;
+    }
+
+    PHASE_START();
+
+    if (s_capture_path != NULL && (s_capture = capture_writer_open(s_capture_path, s_mode, s_capture_format)) == NULL)
+    {
+        pabort("Failed to create capture");
+    }
+
+    if (s_checkpoint_path != NULL || s_resume)
+    {
+        start_checkpoints();
+    }
+
+    if (s_watchdog_ms > 0 && watchdog_start(s_watchdog_ms, s_watchdog_action, s_watchdog_signo, describe_device) < 0)
+    {
+        pabort("Failed to start the watchdog");
+    }
+
+    if (s_metrics_socket != NULL || s_metrics_file != NULL || s_top)
+    {
+        char device[METRICS_LABEL_MAX];
+
+        snprintf(device, sizeof(device), "%s%s", (s_emu != NULL) ? "emulate:" : "",
+                 (s_emu != NULL) ? s_emulate_spec : s_device);
+        if ((s_metrics = metrics_register(device)) == NULL)
+        {
+            pabort("Failed to allocate the metrics");
+        }
+    }
+
+    if ((s_metrics_socket != NULL || s_metrics_file != NULL) &&
+        metrics_start(s_metrics_socket, s_metrics_file, s_metrics_s) < 0)
+    {
+        pabort("Failed to start the metrics");
+    }
+
+    if (s_top && top_start(stdout) < 0)
+    {
+        pabort("Failed to start the dashboard");
+    }
+
+    if (s_budget)
+    {
+        if (budget_start() < 0)
+        {
+            pabort("Failed to install the syscall counter (needs seccomp user notification, Linux 5.5)");
+        }
+        budget_read(&s_budget_mark);
+    }
+
+    if (s_characterize)
+    {
+        if (characterize_run(fd) < 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    else if (s_replay_path != NULL)
+    {
+        replay(fd);
+    }
+    else if (s_tx_file_path != NULL)
+    {
+        send_tx_file(fd);
+    }
+    else if (s_stream != NULL)
+    {
+        stream_frames(fd);
+    }
+    else
+    {
+        uint32_t first_frame = s_pos.frame;
+
+        for (uint32_t i = s_pos.repeat; !s_stop && i < s_repeat; i++, first_frame = 0)
+        {
+            if (s_file_is_set)
+            {
+                for (uint32_t frame = first_frame; !s_stop && frame < s_table->count; frame++)
+                {
+                    if (s_watch && take_reload())
+                    {
+                        frame = 0;
+                    }
+                    s_size = frame_table_len(s_table, frame);
+                    memcpy(s_tx_buf, frame_table_data(s_table, frame), s_size);
+                    PHASE_MARK(PHASE_PARSE);
+                    PROBE_FRAME_LOAD(frame, s_size);
+                    if (!s_quiet)
+                    {
+                        printf("\n%d.%d\n", i, index);
+                    }
+                    index++;
+                    transfer(fd, frame);
+                    mark_progress(i, frame + 1, 0);
+                    if (i + 1 < s_repeat || frame + 1 < s_table->count)
+                    {
+                        interval_sleep(frame);
+                    }
+                    PHASE_MARK(PHASE_SLEEP);
+                    if (s_budget)
+                    {
+                        check_budget(frame);
+                    }
+                }
+            }
+            else
+            {
+                PROBE_FRAME_LOAD(0, s_size);
+                if (!s_quiet)
+                {
+                    printf("\n%d\n", i);
+                }
+                transfer(fd, 0);
+                mark_progress(i + 1, 0, 0);
+                if (i + 1 < s_repeat)
+                {
+                    interval_sleep(0);
+                }
+                PHASE_MARK(PHASE_SLEEP);
+                if (s_budget)
+                {
+                    check_budget(0);
+                }
+            }
+        }
+    }
+
+    if (s_checkpoint_path != NULL)
+    {
+        checkpoint_stop(&s_pos);
+    }
+
+    watchdog_stop();
+
+    if (s_top)
+    {
+        top_stop();
+    }
+
+    if (s_metrics != NULL)
+    {
+        metrics_stop();
+        s_metrics = NULL;
+    }
+
+    if (s_budget)
+    {
+        budget_stop();
+        if (report_budget(stdout) < 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    PHASE_REPORT(stdout);
+
+    if (s_perf_counters)
+    {
+        perfcount_stop();
+        perfcount_report(stdout, s_frame_count);
+    }
+
+    if (s_trace_spi)
+    {
+        spitrace_stop(stdout);
+    }
+
+    if (capture_writer_close(s_capture) < 0)
+    {
+        pabort("Failed to write capture");
+    }
+
+    if (s_stats_enabled)
+    {
+        stats_print(&s_stats, stdout);
+        stats_free(&s_stats);
+    }
+
+    if (s_batch_auto && s_tx_file_path != NULL)
+    {
+        tune_report(&s_tune, stdout);
+    }
+
+    if (s_emu != NULL)
+    {
+        emu_report(s_emu, stdout);
+        emu_close(s_emu);
+    }
+
+    if (s_watch)
+    {
+        reload_retire(s_table);
+        reload_stop(stdout);
+    }
+
+    if (s_stream != NULL && frame_stream_close(s_stream) < 0)
+    {
+        perror("Failed to read the frame stream");
+        status = EXIT_FAILURE;
+    }
+
+    if (s_tx_map != NULL)
+    {
+        munmap((void *)s_tx_map, s_tx_map_size);
+    }
+    free(s_batch_rx);
+
+    frame_table_free(&s_frames);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
 
-    return 0;
+    return status;
 }
@@ -0,0 +1,775 @@
+/*
+ * Correlation of SPI core tracepoints with spidev_test transactions.
+ *
+ * The spi:spi_message_{submit,start,done} and spi:spi_transfer_{start,stop}
+ * tracepoints are enabled through tracefs, filtered on our bus and chip
+ * select, and stamped with the "mono" trace clock so that they share a time
+ * base with CLOCK_MONOTONIC. All of it is set up in a trace instance of our
+ * own, so the global buffer and its settings are left as they were and
+ * other tracers keep running. A background thread drains the per-CPU
+ * trace_pipe files, puts the events back in timestamp order across CPUs
+ * and groups them per transaction, from spi_message_submit to the
+ * spi_message_done that closes it. The completed transactions are matched,
+ * in order, against the ioctl calls recorded by spitrace_user(). Each
+ * match splits the ioctl into:
+ *
+ *   entry       ioctl entry to spi_message_submit (syscall, spidev copy)
+ *   queue       submit to spi_message_start (SPI core queueing)
+ *   run         start to spi_message_done (controller)
+ *   wire        first spi_transfer_start to last spi_transfer_stop
+ *   completion  done to ioctl return (wakeup, copy back)
+ *
+ * Text trace output has microsecond resolution, which bounds the precision
+ * of every component.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "spitrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "timing.h"
+
+#define TRACE_MAX_CPUS 256
+#define TRACE_LINE_MAX 4096
+#define TRACE_POLL_MS 100
+#define USER_RING_SIZE 4096
+#define KERNEL_FIFO_SIZE 256
+#define PENDING_SLOTS 64
+#define TRACE_EVENT_MAX 8192
+// Events are stamped a little before they are committed to the buffer.
+#define TRACE_COMMIT_SLACK_NS (1 * NSEC_PER_MSEC)
+
+// In the order of the events of one message, which breaks ties between equal (microsecond) timestamps.
+enum trace_event_type
+{
+    EVENT_SUBMIT,
+    EVENT_START,
+    EVENT_TRANSFER_START,
+    EVENT_TRANSFER_STOP,
+    EVENT_DONE,
+};
+
+struct trace_event
+{
+    uint64_t t_ns;
+    uint64_t msg;
+    uint32_t type;
+};
+
+struct user_call
+{
+    uint32_t frame;
+    uint64_t enter_ns;
+    uint64_t exit_ns;
+};
+
+struct kernel_message
+{
+    uint64_t msg;
+    uint64_t submit_ns;
+    uint64_t start_ns;
+    uint64_t done_ns;
+    uint64_t xfer_start_ns;
+    uint64_t xfer_stop_ns;
+    uint64_t age;
+};
+
+struct cpu_pipe
+{
+    int      fd;
+    uint64_t seen_ns; // every event of this CPU up to here has been read
+    size_t   len;
+    char     line[TRACE_LINE_MAX];
+};
+
+static const char *const s_tracefs_roots[] = {"/sys/kernel/tracing", "/sys/kernel/debug/tracing"};
+static const char *const s_events[]        = {"spi_message_submit", "spi_message_start", "spi_transfer_start",
+                                              "spi_transfer_stop", "spi_message_done"}; // by enum trace_event_type
+
+#define EVENT_COUNT (sizeof(s_events) / sizeof(s_events[0]))
+
+static struct
+{
+    const char *root;
+    char        instance[128];
+    int         bus;
+    int         chip_select;
+    pthread_t   thread;
+    int         thread_started;
+    int         stop;
+    FILE       *csv;
+
+    struct cpu_pipe *cpus;
+    int              cpu_count;
+
+    struct user_call ring[USER_RING_SIZE];
+    uint32_t         ring_head;
+    uint32_t         ring_tail;
+    uint64_t         ring_dropped;
+
+    struct trace_event events[TRACE_EVENT_MAX];
+    uint32_t           event_count;
+
+    struct kernel_message pending[PENDING_SLOTS];
+    uint64_t              pending_age;
+    struct kernel_message fifo[KERNEL_FIFO_SIZE];
+    uint32_t              fifo_head;
+    uint32_t              fifo_tail;
+
+    uint64_t         matched;
+    uint64_t         unmatched_user;
+    uint64_t         unmatched_kernel;
+    struct histogram entry;
+    struct histogram queue;
+    struct histogram run;
+    struct histogram wire;
+    struct histogram completion;
+} s_trace;
+
+static int tracefs_write(const char *file, const char *value)
+{
+    char    path[256];
+    int     fd;
+    ssize_t ret;
+
+    snprintf(path, sizeof(path), "%s/%s", s_trace.instance, file);
+
+    if ((fd = open(path, O_WRONLY | O_TRUNC)) < 0)
+    {
+        return -1;
+    }
+
+    ret = write(fd, value, strlen(value));
+    close(fd);
+
+    return (ret == (ssize_t)strlen(value)) ? 0 : -1;
+}
+
+static int set_events(int enable)
+{
+    char file[128];
+    char filter[96];
+    int  ret = 0;
+
+    snprintf(filter, sizeof(filter), "bus_num == %d && chip_select == %d", s_trace.bus, s_trace.chip_select);
+
+    for (size_t i = 0; i < EVENT_COUNT; i++)
+    {
+        snprintf(file, sizeof(file), "events/spi/%s/filter", s_events[i]);
+        if (tracefs_write(file, enable ? filter : "0") < 0)
+        {
+            ret = -1;
+        }
+
+        snprintf(file, sizeof(file), "events/spi/%s/enable", s_events[i]);
+        if (tracefs_write(file, enable ? "1" : "0") < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static uint64_t span_ns(uint64_t from, uint64_t to)
+{
+    // Kernel timestamps are truncated to microseconds and may land just before a user timestamp.
+    return (to > from) ? to - from : 0;
+}
+
+static void match(const struct user_call *user, const struct kernel_message *kernel)
+{
+    uint64_t entry      = span_ns(user->enter_ns, kernel->submit_ns);
+    uint64_t queue      = span_ns(kernel->submit_ns, kernel->start_ns);
+    uint64_t run        = span_ns(kernel->start_ns, kernel->done_ns);
+    uint64_t completion = span_ns(kernel->done_ns, user->exit_ns);
+    uint64_t wire       = 0;
+
+    hist_add(&s_trace.entry, entry);
+    hist_add(&s_trace.queue, queue);
+    hist_add(&s_trace.run, run);
+    hist_add(&s_trace.completion, completion);
+
+    if (kernel->xfer_start_ns != 0 && kernel->xfer_stop_ns != 0)
+    {
+        wire = span_ns(kernel->xfer_start_ns, kernel->xfer_stop_ns);
+        hist_add(&s_trace.wire, wire);
+    }
+
+    s_trace.matched++;
+
+    if (s_trace.csv != NULL)
+    {
+        fprintf(s_trace.csv, "%u,%" PRIu64 ",%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", user->frame, user->enter_ns,
+                (double)entry / NSEC_PER_USEC, (double)queue / NSEC_PER_USEC, (double)run / NSEC_PER_USEC,
+                (double)wire / NSEC_PER_USEC, (double)completion / NSEC_PER_USEC,
+                (double)(user->exit_ns - user->enter_ns) / NSEC_PER_USEC);
+    }
+}
+
+/*
+ * Pair completed kernel messages with ioctl calls. Both arrive in order; a
+ * call whose window ends before the message was submitted never reached the
+ * kernel (or its events were lost), and a message submitted before the call
+ * began belongs to another process using the same device.
+ */
+static void correlate(int draining)
+{
+    while (s_trace.fifo_tail != s_trace.fifo_head)
+    {
+        const struct kernel_message *kernel = &s_trace.fifo[s_trace.fifo_tail % KERNEL_FIFO_SIZE];
+        uint32_t                     head   = __atomic_load_n(&s_trace.ring_head, __ATOMIC_ACQUIRE);
+        const struct user_call      *user;
+
+        if (s_trace.ring_tail == head)
+        {
+            if (!draining)
+            {
+                // The ioctl that produced this message may not have been recorded yet.
+                return;
+            }
+
+            s_trace.unmatched_kernel++;
+            s_trace.fifo_tail++;
+            continue;
+        }
+
+        user = &s_trace.ring[s_trace.ring_tail % USER_RING_SIZE];
+
+        if (user->exit_ns < kernel->submit_ns)
+        {
+            s_trace.unmatched_user++;
+            __atomic_store_n(&s_trace.ring_tail, s_trace.ring_tail + 1, __ATOMIC_RELEASE);
+        }
+        else if (kernel->submit_ns + NSEC_PER_USEC < user->enter_ns)
+        {
+            s_trace.unmatched_kernel++;
+            s_trace.fifo_tail++;
+        }
+        else
+        {
+            match(user, kernel);
+            s_trace.fifo_tail++;
+            __atomic_store_n(&s_trace.ring_tail, s_trace.ring_tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * Close a message at its spi_message_done. One whose submit or start was
+ * lost cannot be split and is only counted.
+ */
+static void complete(struct kernel_message *message)
+{
+    if (message->submit_ns == 0 || message->start_ns == 0)
+    {
+        s_trace.unmatched_kernel++;
+        memset(message, 0, sizeof(*message));
+        return;
+    }
+
+    if (s_trace.fifo_head - s_trace.fifo_tail == KERNEL_FIFO_SIZE)
+    {
+        s_trace.unmatched_kernel++;
+        s_trace.fifo_tail++;
+    }
+
+    s_trace.fifo[s_trace.fifo_head++ % KERNEL_FIFO_SIZE] = *message;
+    memset(message, 0, sizeof(*message));
+}
+
+/*
+ * Open a record for a new transaction of `msg`, evicting the oldest open
+ * one, whose done was lost, if the table is full.
+ */
+static struct kernel_message *open_message(uint64_t msg)
+{
+    struct kernel_message *slot = &s_trace.pending[0];
+
+    for (int i = 0; i < PENDING_SLOTS && slot->age != 0; i++)
+    {
+        struct kernel_message *message = &s_trace.pending[i];
+
+        if (message->age == 0 || message->age < slot->age)
+        {
+            slot = message;
+        }
+    }
+
+    if (slot->age != 0)
+    {
+        s_trace.unmatched_kernel++;
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->msg = msg;
+    slot->age = ++s_trace.pending_age;
+    return slot;
+}
+
+/*
+ * The oldest open transaction of `msg`, or of those the one not started
+ * yet. spidev builds its spi_message on the stack, so consecutive calls
+ * carry the same pointer; it only tells apart the transactions that are
+ * open at the same time.
+ */
+static struct kernel_message *find_message(uint64_t msg, int unstarted)
+{
+    struct kernel_message *oldest = NULL;
+
+    for (int i = 0; i < PENDING_SLOTS; i++)
+    {
+        struct kernel_message *message = &s_trace.pending[i];
+
+        if (message->age != 0 && message->msg == msg && (!unstarted || message->start_ns == 0) &&
+            (oldest == NULL || message->age < oldest->age))
+        {
+            oldest = message;
+        }
+    }
+
+    return oldest;
+}
+
+/*
+ * Transfer events carry the spi_transfer pointer, so they are attributed to
+ * the message that started last and is not done yet.
+ */
+static struct kernel_message *running_message(void)
+{
+    struct kernel_message *running = NULL;
+
+    for (int i = 0; i < PENDING_SLOTS; i++)
+    {
+        struct kernel_message *message = &s_trace.pending[i];
+
+        if (message->age != 0 && message->start_ns != 0 && (running == NULL || message->start_ns > running->start_ns))
+        {
+            running = message;
+        }
+    }
+
+    return running;
+}
+
+static void apply_event(const struct trace_event *event)
+{
+    struct kernel_message *message;
+
+    switch (event->type)
+    {
+    case EVENT_SUBMIT:
+        open_message(event->msg)->submit_ns = event->t_ns;
+        break;
+    case EVENT_START:
+        if ((message = find_message(event->msg, 1)) == NULL)
+        {
+            message = open_message(event->msg);
+        }
+        message->start_ns = event->t_ns;
+        break;
+    case EVENT_TRANSFER_START:
+        if ((message = running_message()) != NULL && message->xfer_start_ns == 0)
+        {
+            message->xfer_start_ns = event->t_ns;
+        }
+        break;
+    case EVENT_TRANSFER_STOP:
+        if ((message = running_message()) != NULL)
+        {
+            message->xfer_stop_ns = event->t_ns;
+        }
+        break;
+    case EVENT_DONE:
+        if ((message = find_message(event->msg, 0)) != NULL)
+        {
+            message->done_ns = event->t_ns;
+            complete(message);
+        }
+        break;
+    }
+}
+
+static int compare_events(const void *a, const void *b)
+{
+    const struct trace_event *x = a;
+    const struct trace_event *y = b;
+
+    if (x->t_ns != y->t_ns)
+    {
+        return (x->t_ns > y->t_ns) - (x->t_ns < y->t_ns);
+    }
+
+    return (int)x->type - (int)y->type;
+}
+
+/*
+ * Apply the buffered events in timestamp order, up to the time before
+ * which every CPU has been read (all of them when `all` is set). The
+ * events of one transaction are usually spread over several CPUs.
+ */
+static void flush_events(int all)
+{
+    uint64_t settled_ns = UINT64_MAX;
+    uint32_t done       = 0;
+
+    for (int i = 0; !all && i < s_trace.cpu_count; i++)
+    {
+        if (s_trace.cpus[i].seen_ns < settled_ns)
+        {
+            settled_ns = s_trace.cpus[i].seen_ns;
+        }
+    }
+
+    qsort(s_trace.events, s_trace.event_count, sizeof(s_trace.events[0]), compare_events);
+
+    while (done < s_trace.event_count && (all || s_trace.events[done].t_ns < settled_ns))
+    {
+        apply_event(&s_trace.events[done++]);
+    }
+
+    s_trace.event_count -= done;
+    memmove(s_trace.events, s_trace.events + done, s_trace.event_count * sizeof(s_trace.events[0]));
+}
+
+/*
+ * Parse "<task>-<pid> [cpu] <flags> <secs>.<usecs>: <event>: spiB.C <ptr> ...".
+ */
+static void handle_line(struct cpu_pipe *cpu, const char *line)
+{
+    const char        *event = strstr(line, ": spi_");
+    const char        *stamp;
+    const char        *details;
+    unsigned long long ptr;
+    uint64_t           secs  = 0;
+    uint64_t           t_ns  = 0;
+    uint64_t           scale = NSEC_PER_SEC;
+    int                frac  = 0;
+    size_t             type;
+
+    if (event == NULL || (details = strstr(event + 2, ": ")) == NULL)
+    {
+        return;
+    }
+
+    for (stamp = event; stamp > line && (stamp[-1] == '.' || ('0' <= stamp[-1] && stamp[-1] <= '9')); stamp--)
+    {
+    }
+
+    for (; stamp < event; stamp++)
+    {
+        if (*stamp == '.')
+        {
+            frac = 1;
+            continue;
+        }
+
+        if (frac)
+        {
+            scale /= 10;
+            t_ns += (uint64_t)(*stamp - '0') * scale;
+        }
+        else
+        {
+            secs = secs * 10 + (uint64_t)(*stamp - '0');
+        }
+    }
+
+    t_ns += secs * NSEC_PER_SEC;
+
+    event += 2;
+    details += 2;
+
+    for (type = 0; type < EVENT_COUNT; type++)
+    {
+        if (strncmp(event, s_events[type], strlen(s_events[type])) == 0 && event[strlen(s_events[type])] == ':')
+        {
+            break;
+        }
+    }
+
+    if (type == EVENT_COUNT || sscanf(details, "spi%*d.%*d %llx", &ptr) != 1)
+    {
+        return;
+    }
+
+    // Each CPU delivers its events in time order.
+    cpu->seen_ns = t_ns;
+
+    if (s_trace.event_count == TRACE_EVENT_MAX)
+    {
+        flush_events(1);
+    }
+
+    s_trace.events[s_trace.event_count++] = (struct trace_event){t_ns, ptr, (uint32_t)type};
+}
+
+/*
+ * Read what is available on one CPU and handle every complete line.
+ * Returns the number of bytes read, 0 when the pipe is empty.
+ */
+static ssize_t drain_cpu(struct cpu_pipe *cpu)
+{
+    uint64_t now_ns = monotonic_ns();
+    ssize_t  len    = read(cpu->fd, cpu->line + cpu->len, sizeof(cpu->line) - 1 - cpu->len);
+    char    *begin;
+    char    *end;
+
+    if (len <= 0)
+    {
+        // Whatever this CPU traced before the read is out.
+        if (now_ns - TRACE_COMMIT_SLACK_NS > cpu->seen_ns)
+        {
+            cpu->seen_ns = now_ns - TRACE_COMMIT_SLACK_NS;
+        }
+        return 0;
+    }
+
+    cpu->len += (size_t)len;
+    cpu->line[cpu->len] = '\0';
+
+    for (begin = cpu->line; (end = strchr(begin, '\n')) != NULL; begin = end + 1)
+    {
+        *end = '\0';
+        handle_line(cpu, begin);
+    }
+
+    cpu->len -= (size_t)(begin - cpu->line);
+    memmove(cpu->line, begin, cpu->len);
+
+    if (cpu->len == sizeof(cpu->line) - 1)
+    {
+        // A line longer than the buffer (huge tx=[...] dump); drop it.
+        cpu->len = 0;
+    }
+
+    return len;
+}
+
+static void *trace_thread(void *arg)
+{
+    struct pollfd fds[TRACE_MAX_CPUS];
+
+    (void)arg;
+
+    for (int i = 0; i < s_trace.cpu_count; i++)
+    {
+        fds[i].fd     = s_trace.cpus[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    while (!__atomic_load_n(&s_trace.stop, __ATOMIC_ACQUIRE))
+    {
+        poll(fds, (nfds_t)s_trace.cpu_count, TRACE_POLL_MS);
+
+        // Every CPU, not only the readable ones: an empty read is what tells that a CPU has nothing older.
+        for (int i = 0; i < s_trace.cpu_count; i++)
+        {
+            while (drain_cpu(&s_trace.cpus[i]) > 0)
+            {
+            }
+        }
+
+        flush_events(0);
+        correlate(0);
+    }
+
+    // The events of the last transactions are already in the buffers: read until every pipe is empty.
+    for (int busy = 1; busy;)
+    {
+        busy = 0;
+
+        for (int i = 0; i < s_trace.cpu_count; i++)
+        {
+            busy |= (drain_cpu(&s_trace.cpus[i]) > 0);
+        }
+    }
+
+    flush_events(1);
+    correlate(1);
+    return NULL;
+}
+
+static void close_cpus(void)
+{
+    for (int i = 0; i < s_trace.cpu_count; i++)
+    {
+        close(s_trace.cpus[i].fd);
+    }
+
+    free(s_trace.cpus);
+    s_trace.cpus      = NULL;
+    s_trace.cpu_count = 0;
+}
+
+int spitrace_start(const char *device, const char *csv_path)
+{
+    const char *name = strrchr(device, '/');
+    char        path[256];
+
+    name = (name != NULL) ? name + 1 : device;
+
+    if (sscanf(name, "spidev%d.%d", &s_trace.bus, &s_trace.chip_select) != 2)
+    {
+        fprintf(stderr, "spi trace: cannot derive bus and chip select from %s\n", device);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(s_tracefs_roots) / sizeof(s_tracefs_roots[0]) && s_trace.root == NULL; i++)
+    {
+        snprintf(path, sizeof(path), "%s/events/spi/spi_message_submit", s_tracefs_roots[i]);
+
+        if (access(path, F_OK) == 0)
+        {
+            s_trace.root = s_tracefs_roots[i];
+        }
+    }
+
+    if (s_trace.root == NULL)
+    {
+        fprintf(stderr, "spi trace: tracefs with spi events not found\n");
+        return -1;
+    }
+
+    // A new instance starts empty, with tracing on and the default clock.
+    snprintf(s_trace.instance, sizeof(s_trace.instance), "%s/instances/spidev_test.%d", s_trace.root, (int)getpid());
+    if (mkdir(s_trace.instance, 0700) < 0)
+    {
+        fprintf(stderr, "spi trace: cannot create %s: %s\n", s_trace.instance, strerror(errno));
+        s_trace.instance[0] = '\0';
+        return -1;
+    }
+
+    if (tracefs_write("trace_clock", "mono") < 0 || set_events(1) < 0)
+    {
+        fprintf(stderr, "spi trace: cannot configure %s: %s\n", s_trace.instance, strerror(errno));
+        spitrace_stop(NULL);
+        return -1;
+    }
+
+    if ((s_trace.cpus = calloc(TRACE_MAX_CPUS, sizeof(*s_trace.cpus))) == NULL)
+    {
+        spitrace_stop(NULL);
+        return -1;
+    }
+
+    for (int cpu = 0; cpu < TRACE_MAX_CPUS; cpu++)
+    {
+        snprintf(path, sizeof(path), "%s/per_cpu/cpu%d/trace_pipe", s_trace.instance, cpu);
+
+        if ((s_trace.cpus[s_trace.cpu_count].fd = open(path, O_RDONLY | O_NONBLOCK)) < 0)
+        {
+            break;
+        }
+
+        s_trace.cpu_count++;
+    }
+
+    if (csv_path != NULL)
+    {
+        if ((s_trace.csv = fopen(csv_path, "w")) == NULL)
+        {
+            fprintf(stderr, "spi trace: cannot create %s\n", csv_path);
+            spitrace_stop(NULL);
+            return -1;
+        }
+
+        fprintf(s_trace.csv, "frame,enter_ns,entry_us,queue_us,run_us,wire_us,completion_us,total_us\n");
+    }
+
+    hist_init(&s_trace.entry);
+    hist_init(&s_trace.queue);
+    hist_init(&s_trace.run);
+    hist_init(&s_trace.wire);
+    hist_init(&s_trace.completion);
+
+    if (s_trace.cpu_count == 0 || pthread_create(&s_trace.thread, NULL, trace_thread, NULL) != 0)
+    {
+        spitrace_stop(NULL);
+        return -1;
+    }
+    s_trace.thread_started = 1;
+
+    return 0;
+}
+
+void spitrace_user(uint32_t frame, uint64_t enter_ns, uint64_t exit_ns)
+{
+    uint32_t          head = s_trace.ring_head;
+    struct user_call *call;
+
+    if (head - __atomic_load_n(&s_trace.ring_tail, __ATOMIC_ACQUIRE) == USER_RING_SIZE)
+    {
+        s_trace.ring_dropped++;
+        return;
+    }
+
+    call           = &s_trace.ring[head % USER_RING_SIZE];
+    call->frame    = frame;
+    call->enter_ns = enter_ns;
+    call->exit_ns  = exit_ns;
+
+    __atomic_store_n(&s_trace.ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void print_component(FILE *out, const char *name, const struct histogram *hist)
+{
+    fprintf(out, "%-11s %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, hist->count ? (double)hist->min / NSEC_PER_USEC : 0.0,
+            (double)hist_mean(hist) / NSEC_PER_USEC, (double)hist_percentile(hist, 50) / NSEC_PER_USEC,
+            (double)hist_percentile(hist, 99) / NSEC_PER_USEC, (double)hist->max / NSEC_PER_USEC);
+}
+
+void spitrace_stop(FILE *out)
+{
+    if (s_trace.thread_started)
+    {
+        __atomic_store_n(&s_trace.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(s_trace.thread, NULL);
+        s_trace.thread_started = 0;
+    }
+
+    close_cpus();
+
+    // Removing the instance drops its buffer; it fails while a trace_pipe is open (or someone else has a file
+    // of it open), in which case at least the events stop.
+    if (s_trace.instance[0] != '\0')
+    {
+        set_events(0);
+        rmdir(s_trace.instance);
+        s_trace.instance[0] = '\0';
+    }
+
+    if (s_trace.csv != NULL)
+    {
+        fclose(s_trace.csv);
+        s_trace.csv = NULL;
+    }
+
+    if (out == NULL)
+    {
+        return;
+    }
+
+    fprintf(out, "\nspi trace: %" PRIu64 " ioctls matched, %" PRIu64 " without kernel events, %" PRIu64
+                 " foreign messages, %" PRIu64 " dropped\n",
+            s_trace.matched, s_trace.unmatched_user, s_trace.unmatched_kernel, s_trace.ring_dropped);
+    fprintf(out, "%-11s %9s %9s %9s %9s %9s\n", "component", "min(us)", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+    print_component(out, "entry", &s_trace.entry);
+    print_component(out, "queue", &s_trace.queue);
+    print_component(out, "run", &s_trace.run);
+    print_component(out, "wire", &s_trace.wire);
+    print_component(out, "completion", &s_trace.completion);
+}
@@ -0,0 +1,35 @@
+/*
+ * Correlation of SPI core tracepoints with spidev_test transactions.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_SPITRACE_H
+#define SPIDEV_SPITRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Enable the spi:* tracepoints for the bus and chip select of `device` in a
+ * tracefs instance of our own and start the reader thread. Per-transaction
+ * breakdowns go to `csv_path` when it is not NULL. Returns -1 when tracefs
+ * is not available.
+ */
+int spitrace_start(const char *device, const char *csv_path);
+
+/*
+ * Record one of our SPI_IOC_MESSAGE calls. Never blocks; records are
+ * dropped when the reader thread falls behind.
+ */
+void spitrace_user(uint32_t frame, uint64_t enter_ns, uint64_t exit_ns);
+
+/*
+ * Drain the trace buffers, remove the trace instance and print a summary
+ * of the kernel-side breakdown.
+ */
+void spitrace_stop(FILE *out);
+
+#endif // SPIDEV_SPITRACE_H
@@ -0,0 +1,209 @@
+/*
+ * Constant-memory per-frame transfer statistics.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t stats_hash(const uint8_t *data, uint32_t len)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+int stats_init(struct stats *stats, enum stats_key key, uint32_t capacity)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if ((stats->frames = calloc(capacity, sizeof(*stats->frames))) == NULL)
+    {
+        return -1;
+    }
+
+    stats->key      = key;
+    stats->capacity = capacity;
+    hist_init(&stats->other.latency);
+
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        hist_init(&stats->frames[i].latency);
+    }
+
+    return 0;
+}
+
+/*
+ * Find the row of a frame. Rows keyed by TX hash use open addressing with
+ * linear probing; a full table sends new frames to the `other` row.
+ */
+static struct frame_stats *stats_row(struct stats *stats, uint32_t index, uint64_t tx_hash)
+{
+    struct frame_stats *row;
+
+    if (stats->key == STATS_KEY_INDEX)
+    {
+        if (index >= stats->capacity)
+        {
+            return &stats->other;
+        }
+
+        row = &stats->frames[index];
+        if (row->count == 0)
+        {
+            stats->used = (index + 1 > stats->used) ? index + 1 : stats->used;
+        }
+        return row;
+    }
+
+    for (uint32_t probe = 0; probe < stats->capacity; probe++)
+    {
+        row = &stats->frames[(tx_hash + probe) % stats->capacity];
+
+        if (row->count == 0)
+        {
+            row->index = stats->used++;
+            return row;
+        }
+
+        if (row->tx_hash == tx_hash)
+        {
+            return row;
+        }
+    }
+
+    return &stats->other;
+}
+
+void stats_record(struct stats      *stats,
+                  uint32_t           index,
+                  const uint8_t     *tx,
+                  const uint8_t     *rx,
+                  uint32_t           len,
+                  uint64_t           latency_ns,
+                  enum stats_verify  verify)
+{
+    uint64_t            tx_hash = stats_hash(tx, len);
+    uint64_t            rx_hash = stats_hash(rx, len);
+    struct frame_stats *row     = stats_row(stats, index, tx_hash);
+
+    if (row->count == 0)
+    {
+        row->tx_hash = tx_hash;
+        row->len     = len;
+        memcpy(row->tx_head, tx, (len < sizeof(row->tx_head)) ? len : sizeof(row->tx_head));
+
+        if (stats->key == STATS_KEY_INDEX)
+        {
+            row->index = index;
+        }
+    }
+    else if (row->rx_hash != rx_hash)
+    {
+        row->rx_changes++;
+    }
+
+    row->rx_hash = rx_hash;
+    row->count++;
+    hist_add(&row->latency, latency_ns);
+
+    if (verify != STATS_VERIFY_NONE)
+    {
+        row->verified++;
+        row->mismatches += (verify == STATS_VERIFY_FAIL);
+    }
+}
+
+static int compare_rows(const void *a, const void *b)
+{
+    const struct frame_stats *x = *(const struct frame_stats *const *)a;
+    const struct frame_stats *y = *(const struct frame_stats *const *)b;
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static void print_row(const struct frame_stats *row, const char *name, FILE *out)
+{
+    char     head[3 * sizeof(row->tx_head) + 1];
+    char     mismatches[24] = "-";
+    uint32_t shown          = (row->len < sizeof(row->tx_head)) ? row->len : sizeof(row->tx_head);
+    char    *p              = head;
+
+    *p = '\0';
+    for (uint32_t i = 0; i < shown; i++)
+    {
+        p += sprintf(p, (i == 0) ? "%.2x" : " %.2x", row->tx_head[i]);
+    }
+
+    if (row->verified > 0)
+    {
+        snprintf(mismatches, sizeof(mismatches), "%" PRIu64, row->mismatches);
+    }
+
+    fprintf(out, "%6s %5u %10" PRIu64 " %10" PRIu64 " %10s %9.1f %9.1f %9.1f %9.1f  %s%s\n", name, row->len,
+            row->count, row->rx_changes, mismatches, (double)row->latency.min / NSEC_PER_USEC,
+            (double)hist_percentile(&row->latency, 50) / NSEC_PER_USEC,
+            (double)hist_percentile(&row->latency, 99) / NSEC_PER_USEC, (double)row->latency.max / NSEC_PER_USEC,
+            head, (row->len > shown) ? " ..." : "");
+}
+
+void stats_print(const struct stats *stats, FILE *out)
+{
+    const struct frame_stats **rows;
+    uint32_t                   count = 0;
+    char                       name[16];
+
+    if ((rows = malloc((stats->capacity ? stats->capacity : 1) * sizeof(*rows))) == NULL)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < stats->capacity; i++)
+    {
+        if (stats->frames[i].count > 0)
+        {
+            rows[count++] = &stats->frames[i];
+        }
+    }
+
+    qsort(rows, count, sizeof(*rows), compare_rows);
+
+    fprintf(out, "\n%6s %5s %10s %10s %10s %9s %9s %9s %9s  %s\n", "frame", "len", "count", "rx-change", "mismatch",
+            "min(us)", "p50(us)", "p99(us)", "max(us)", "tx");
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "%u", rows[i]->index);
+        print_row(rows[i], name, out);
+    }
+
+    if (stats->other.count > 0)
+    {
+        print_row(&stats->other, "other", out);
+    }
+
+    free(rows);
+}
+
+void stats_free(struct stats *stats)
+{
+    free(stats->frames);
+    stats->frames = NULL;
+}
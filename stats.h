@@ -0,0 +1,74 @@
+/*
+ * Constant-memory per-frame transfer statistics.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_STATS_H
+#define SPIDEV_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+#define STATS_MAX_FRAMES 1024
+
+enum stats_key
+{
+    STATS_KEY_INDEX,   // row per frame index within the frame file
+    STATS_KEY_TX_HASH, // row per distinct TX data
+};
+
+struct frame_stats
+{
+    uint64_t         tx_hash;
+    uint64_t         rx_hash;
+    uint32_t         len;
+    uint32_t         index;
+    uint64_t         count;
+    uint64_t         rx_changes;
+    uint64_t         verified;
+    uint64_t         mismatches;
+    uint8_t          tx_head[8];
+    struct histogram latency;
+};
+
+/*
+ * All rows are allocated up front by stats_init(). Frames that do not fit
+ * are accounted in the `other` row, so recording never allocates.
+ */
+struct stats
+{
+    enum stats_key      key;
+    uint32_t            capacity;
+    uint32_t            used;
+    struct frame_stats *frames;
+    struct frame_stats  other;
+};
+
+/*
+ * Result of checking the received data of a frame.
+ */
+enum stats_verify
+{
+    STATS_VERIFY_NONE = -1,
+    STATS_VERIFY_OK   = 0,
+    STATS_VERIFY_FAIL = 1,
+};
+
+uint64_t stats_hash(const uint8_t *data, uint32_t len);
+int      stats_init(struct stats *stats, enum stats_key key, uint32_t capacity);
+void     stats_record(struct stats       *stats,
+                      uint32_t            index,
+                      const uint8_t      *tx,
+                      const uint8_t      *rx,
+                      uint32_t            len,
+                      uint64_t            latency_ns,
+                      enum stats_verify   verify);
+void     stats_print(const struct stats *stats, FILE *out);
+void     stats_free(struct stats *stats);
+
+#endif // SPIDEV_STATS_H
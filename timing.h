@@ -0,0 +1,47 @@
+/*
+ * Clock helpers shared by spidev_test and its companion modules.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_TIMING_H
+#define SPIDEV_TIMING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * Monotonic time in nanoseconds. CLOCK_MONOTONIC is served from the vDSO on
+ * every architecture we care about, so this does not enter the kernel.
+ */
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Sleep until the absolute CLOCK_MONOTONIC deadline, restarting on signals.
+ */
+static inline void sleep_until_ns(uint64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t)(deadline_ns / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(deadline_ns % NSEC_PER_SEC);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+#endif // SPIDEV_TIMING_H
@@ -0,0 +1,725 @@
+/*
+ * Virtual spidev character device, served from user space through CUSE.
+ *
+ * spidev_cuse creates /dev/<name> (spidev-emu0.0 by default) implementing
+ * the spidev ioctl ABI, so that spidev_test and any other unmodified spidev
+ * client can be run and profiled end to end without hardware. Messages are
+ * answered by one of the emulated peripherals of spidev_test (--emulate,
+ * loopback by default) or by a response script (--script), optionally
+ * after a fixed per-message latency.
+ *
+ * The CUSE protocol is spoken directly on /dev/cuse, without libfuse. The
+ * ioctls are registered as unrestricted: the kernel does not know where a
+ * spi_ioc_transfer points, so each SPI_IOC_MESSAGE takes up to three
+ * rounds: fetch the transfer array, fetch the TX buffers and map the RX
+ * buffers it names, then answer.
+ *
+ * A response script has one rule per line, "<tx prefix> = <rx data>", in
+ * hex with "??" matching any byte. The first rule whose prefix matches the
+ * TX bytes of a message supplies the start of its RX bytes, the rest reads
+ * 0xff. Messages that match no rule are looped back. '#' starts a comment.
+ *
+ *   9f = ff ef 40 18
+ *   03 ?? ?? ?? = ff ff ff ff 12 34
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/fuse.h>
+#include <linux/spi/spidev.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "emulate.h"
+#include "timing.h"
+
+#define MAX_TRANSFERS 64
+// TX and RX of a message together must fit the 128 KiB the kernel moves per ioctl.
+#define MAX_MESSAGE (32 << 10)
+#define MAX_RULES 256
+#define READ_BUF_SIZE (MAX_MESSAGE + MAX_TRANSFERS * sizeof(struct spi_ioc_transfer) + 4096)
+
+struct rule
+{
+    struct capture_pattern tx;
+    struct capture_pattern rx;
+};
+
+static const char         *s_cuse_path  = "/dev/cuse";
+static const char         *s_name       = "spidev-emu0.0";
+static const char         *s_emulate    = "loop";
+static const char         *s_script     = NULL;
+static uint64_t            s_latency_ns = 0;
+static struct emu_device  *s_emu        = NULL;
+static struct rule         s_rules[MAX_RULES];
+static uint32_t            s_rule_count = 0;
+static uint32_t            s_mode       = 0;
+static uint8_t             s_bits       = 8;
+static uint32_t            s_speed      = 500000;
+static uint64_t            s_messages   = 0;
+
+static volatile sig_atomic_t s_stop = 0;
+
+static uint8_t s_read_buf[READ_BUF_SIZE];
+static uint8_t s_tx[MAX_MESSAGE];
+static uint8_t s_rx[MAX_MESSAGE];
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [-n name] [--emulate spec | --script file] [--latency-us n]\n", prog);
+    puts("  -n --name        device name under /dev (default spidev-emu0.0)\n"
+         "     --emulate     peripheral model, as spidev_test --emulate (default loop)\n"
+         "     --script      answer messages from a response script\n"
+         "     --latency-us  extra time each message takes\n"
+         "     --cuse        CUSE control device (default /dev/cuse)\n");
+    exit(EXIT_FAILURE);
+}
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    s_stop = 1;
+}
+
+static int load_script(const char *path)
+{
+    FILE  *fp;
+    char  *line = NULL;
+    size_t cap  = 0;
+    int    ret  = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    for (uint32_t line_no = 1; getline(&line, &cap, fp) >= 0; line_no++)
+    {
+        char *eq;
+        char *hash = strchr(line, '#');
+
+        if (hash != NULL)
+        {
+            *hash = '\0';
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0')
+        {
+            continue;
+        }
+
+        if ((eq = strchr(line, '=')) == NULL || s_rule_count == MAX_RULES)
+        {
+            printf("%s:%u: expected \"<tx prefix> = <rx data>\"\n", path, line_no);
+            ret = -1;
+            break;
+        }
+
+        *eq = '\0';
+        if (capture_parse_pattern(line, &s_rules[s_rule_count].tx) < 0 ||
+            capture_parse_pattern(eq + 1, &s_rules[s_rule_count].rx) < 0)
+        {
+            printf("%s:%u: invalid hex data\n", path, line_no);
+            ret = -1;
+            break;
+        }
+
+        s_rule_count++;
+    }
+
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+static void script_message(const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+    for (uint32_t r = 0; r < s_rule_count; r++)
+    {
+        const struct rule *rule = &s_rules[r];
+        uint32_t           i;
+
+        if (rule->tx.len > len)
+        {
+            continue;
+        }
+
+        for (i = 0; i < rule->tx.len; i++)
+        {
+            if ((tx[i] & rule->tx.mask[i]) != rule->tx.value[i])
+            {
+                break;
+            }
+        }
+
+        if (i == rule->tx.len)
+        {
+            memset(rx, 0xff, len);
+            memcpy(rx, rule->rx.value, rule->rx.len < len ? rule->rx.len : len);
+            return;
+        }
+    }
+
+    memcpy(rx, tx, len);
+}
+
+/*
+ * Run a message whose TX bytes are laid out back to back in s_tx, zeros
+ * for transfers without a TX buffer, and leave its RX bytes in s_rx.
+ */
+static int run_message(const struct spi_ioc_transfer *xfers, uint32_t count, uint32_t total)
+{
+    struct spi_ioc_transfer local[MAX_TRANSFERS];
+    uint64_t                start_ns = monotonic_ns();
+    uint32_t                offset   = 0;
+    int                     ret      = (int)total;
+
+    if (s_script != NULL)
+    {
+        script_message(s_tx, s_rx, total);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            local[i]        = xfers[i];
+            local[i].tx_buf = (uintptr_t)(s_tx + offset);
+            local[i].rx_buf = (uintptr_t)(s_rx + offset);
+            offset += xfers[i].len;
+
+            // As spidev does, transfers that leave them at 0 get the device settings.
+            if (local[i].speed_hz == 0)
+            {
+                local[i].speed_hz = s_speed;
+            }
+            if (local[i].bits_per_word == 0)
+            {
+                local[i].bits_per_word = s_bits;
+            }
+        }
+
+        ret = emu_transfer(s_emu, local, count);
+    }
+
+    if (s_latency_ns > 0)
+    {
+        sleep_until_ns(start_ns + s_latency_ns);
+    }
+
+    s_messages++;
+    return ret;
+}
+
+static int reply(int fd, uint64_t unique, int error, const struct iovec *data, int data_count)
+{
+    struct fuse_out_header out;
+    struct iovec           iov[4];
+    size_t                 len = sizeof(out);
+
+    iov[0].iov_base = &out;
+    iov[0].iov_len  = sizeof(out);
+
+    for (int i = 0; i < data_count; i++)
+    {
+        iov[i + 1] = data[i];
+        len += data[i].iov_len;
+    }
+
+    out.len    = (uint32_t)len;
+    out.error  = -error;
+    out.unique = unique;
+
+    if (writev(fd, iov, data_count + 1) < 0 && errno != ENOENT)
+    {
+        // ENOENT: the request was interrupted and is gone.
+        perror("reply");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int reply_ioctl(int fd, uint64_t unique, int32_t result, const void *data, size_t len)
+{
+    struct fuse_ioctl_out out;
+    struct iovec          iov[2];
+
+    memset(&out, 0, sizeof(out));
+    out.result      = result;
+    iov[0].iov_base = &out;
+    iov[0].iov_len  = sizeof(out);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+
+    return reply(fd, unique, 0, iov, (len > 0) ? 2 : 1);
+}
+
+/*
+ * Ask the kernel to repeat the ioctl with the given user memory copied in
+ * and out.
+ */
+static int reply_retry(int fd, uint64_t unique, const struct fuse_ioctl_iovec *iovs, uint32_t in_iovs,
+                       uint32_t out_iovs)
+{
+    struct fuse_ioctl_out out;
+    struct iovec          iov[2];
+
+    memset(&out, 0, sizeof(out));
+    out.flags       = FUSE_IOCTL_RETRY;
+    out.in_iovs     = in_iovs;
+    out.out_iovs    = out_iovs;
+    iov[0].iov_base = &out;
+    iov[0].iov_len  = sizeof(out);
+    iov[1].iov_base = (void *)iovs;
+    iov[1].iov_len  = (in_iovs + out_iovs) * sizeof(*iovs);
+
+    return reply(fd, unique, 0, iov, 2);
+}
+
+static int do_message(int fd, uint64_t unique, const struct fuse_ioctl_in *in, const uint8_t *data)
+{
+    static struct fuse_ioctl_iovec iovs[2 * MAX_TRANSFERS + 1];
+    const struct spi_ioc_transfer *xfers    = (const struct spi_ioc_transfer *)data;
+    uint32_t                       size     = _IOC_SIZE(in->cmd);
+    uint32_t                       count    = size / sizeof(struct spi_ioc_transfer);
+    uint32_t                       in_iovs  = 1;
+    uint32_t                       out_iovs = 0;
+    uint32_t                       total    = 0;
+    uint32_t                       tx_total = 0;
+    uint32_t                       rx_total = 0;
+    const uint8_t                 *tx;
+    uint32_t                       offset;
+    uint32_t                       packed;
+    int                            ret;
+
+    if (count == 0 || count > MAX_TRANSFERS || size % sizeof(struct spi_ioc_transfer) != 0)
+    {
+        return reply(fd, unique, EINVAL, NULL, 0);
+    }
+
+    iovs[0].base = in->arg;
+    iovs[0].len  = size;
+
+    // Round 1: fetch the transfer array.
+    if (in->in_size < size)
+    {
+        return reply_retry(fd, unique, iovs, 1, 0);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        total += xfers[i].len;
+        if (xfers[i].tx_buf)
+        {
+            tx_total += xfers[i].len;
+        }
+        if (xfers[i].rx_buf)
+        {
+            rx_total += xfers[i].len;
+        }
+    }
+
+    if (total > MAX_MESSAGE)
+    {
+        return reply(fd, unique, EMSGSIZE, NULL, 0);
+    }
+
+    // Round 2: fetch the TX data and map the RX buffers, unless there are none.
+    if (in->in_size == size && in->out_size == 0 && (tx_total > 0 || rx_total > 0))
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (xfers[i].tx_buf && xfers[i].len)
+            {
+                iovs[in_iovs].base = xfers[i].tx_buf;
+                iovs[in_iovs].len  = xfers[i].len;
+                in_iovs++;
+            }
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (xfers[i].rx_buf && xfers[i].len)
+            {
+                iovs[in_iovs + out_iovs].base = xfers[i].rx_buf;
+                iovs[in_iovs + out_iovs].len  = xfers[i].len;
+                out_iovs++;
+            }
+        }
+
+        return reply_retry(fd, unique, iovs, in_iovs, out_iovs);
+    }
+
+    if (in->in_size != size + tx_total || in->out_size != rx_total)
+    {
+        return reply(fd, unique, EINVAL, NULL, 0);
+    }
+
+    // Round 3: run the message and return the RX data.
+    tx     = data + size;
+    offset = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (xfers[i].tx_buf)
+        {
+            memcpy(s_tx + offset, tx, xfers[i].len);
+            tx += xfers[i].len;
+        }
+        else
+        {
+            memset(s_tx + offset, 0, xfers[i].len);
+        }
+        offset += xfers[i].len;
+    }
+
+    ret = run_message(xfers, count, total);
+
+    // Pack the RX bytes of the transfers that have an RX buffer.
+    offset = 0;
+    packed = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (xfers[i].rx_buf)
+        {
+            memmove(s_rx + packed, s_rx + offset, xfers[i].len);
+            packed += xfers[i].len;
+        }
+        offset += xfers[i].len;
+    }
+
+    return reply_ioctl(fd, unique, ret, s_rx, rx_total);
+}
+
+/*
+ * The configuration ioctls: the value is copied in (WR) or out (RD) in a
+ * second round, as the kernel does not copy anything for unrestricted
+ * ioctls.
+ */
+static int do_setting(int fd, uint64_t unique, const struct fuse_ioctl_in *in, const uint8_t *data)
+{
+    struct fuse_ioctl_iovec iov;
+    uint32_t                size  = _IOC_SIZE(in->cmd);
+    int                     write = (_IOC_DIR(in->cmd) & _IOC_WRITE) != 0;
+    uint32_t                value = 0;
+    uint8_t                 byte;
+
+    if (in->in_size == 0 && in->out_size == 0)
+    {
+        iov.base = in->arg;
+        iov.len  = size;
+        return reply_retry(fd, unique, &iov, write ? 1 : 0, write ? 0 : 1);
+    }
+
+    if (write)
+    {
+        value = (size == 1) ? data[0] : *(const uint32_t *)data;
+    }
+
+    switch (in->cmd)
+    {
+    case SPI_IOC_WR_MODE:
+        s_mode = (s_mode & ~0xffu) | value;
+        break;
+    case SPI_IOC_WR_MODE32:
+        s_mode = value;
+        break;
+    case SPI_IOC_WR_LSB_FIRST:
+        s_mode = value ? (s_mode | SPI_LSB_FIRST) : (s_mode & ~(uint32_t)SPI_LSB_FIRST);
+        break;
+    case SPI_IOC_WR_BITS_PER_WORD:
+        s_bits = (uint8_t)(value ? value : 8);
+        break;
+    case SPI_IOC_WR_MAX_SPEED_HZ:
+        s_speed = value;
+        break;
+    case SPI_IOC_RD_MODE:
+    case SPI_IOC_RD_MODE32:
+        value = s_mode & ((size == 1) ? 0xffu : 0xffffffffu);
+        break;
+    case SPI_IOC_RD_LSB_FIRST:
+        value = (s_mode & SPI_LSB_FIRST) ? 1 : 0;
+        break;
+    case SPI_IOC_RD_BITS_PER_WORD:
+        value = s_bits;
+        break;
+    case SPI_IOC_RD_MAX_SPEED_HZ:
+        value = s_speed;
+        break;
+    }
+
+    if (write)
+    {
+        return reply_ioctl(fd, unique, 0, NULL, 0);
+    }
+
+    byte = (uint8_t)value;
+    return reply_ioctl(fd, unique, 0, (size == 1) ? (const void *)&byte : (const void *)&value, size);
+}
+
+static int do_ioctl(int fd, const struct fuse_in_header *hdr, const struct fuse_ioctl_in *in)
+{
+    const uint8_t *data = (const uint8_t *)(in + 1);
+
+    if (_IOC_TYPE(in->cmd) != SPI_IOC_MAGIC)
+    {
+        return reply(fd, hdr->unique, ENOTTY, NULL, 0);
+    }
+
+    if (_IOC_NR(in->cmd) == 0 && _IOC_DIR(in->cmd) == _IOC_WRITE)
+    {
+        return do_message(fd, hdr->unique, in, data);
+    }
+
+    switch (in->cmd)
+    {
+    case SPI_IOC_RD_MODE:
+    case SPI_IOC_WR_MODE:
+    case SPI_IOC_RD_MODE32:
+    case SPI_IOC_WR_MODE32:
+    case SPI_IOC_RD_LSB_FIRST:
+    case SPI_IOC_WR_LSB_FIRST:
+    case SPI_IOC_RD_BITS_PER_WORD:
+    case SPI_IOC_WR_BITS_PER_WORD:
+    case SPI_IOC_RD_MAX_SPEED_HZ:
+    case SPI_IOC_WR_MAX_SPEED_HZ:
+        return do_setting(fd, hdr->unique, in, data);
+    }
+
+    return reply(fd, hdr->unique, ENOTTY, NULL, 0);
+}
+
+/*
+ * read() and write() are half duplex, as on spidev: a write discards what
+ * is received, a read clocks out zeros.
+ */
+static int do_rw(int fd, const struct fuse_in_header *hdr)
+{
+    struct spi_ioc_transfer xfer;
+    struct fuse_write_out   write_out;
+    struct iovec            iov;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.speed_hz      = s_speed;
+    xfer.bits_per_word = s_bits;
+
+    if (hdr->opcode == FUSE_WRITE)
+    {
+        const struct fuse_write_in *in = (const struct fuse_write_in *)(hdr + 1);
+
+        if (in->size > MAX_MESSAGE)
+        {
+            return reply(fd, hdr->unique, EMSGSIZE, NULL, 0);
+        }
+
+        xfer.len = in->size;
+        memcpy(s_tx, in + 1, in->size);
+        run_message(&xfer, 1, in->size);
+
+        memset(&write_out, 0, sizeof(write_out));
+        write_out.size = in->size;
+        iov.iov_base   = &write_out;
+        iov.iov_len    = sizeof(write_out);
+    }
+    else
+    {
+        const struct fuse_read_in *in = (const struct fuse_read_in *)(hdr + 1);
+
+        if (in->size > MAX_MESSAGE)
+        {
+            return reply(fd, hdr->unique, EMSGSIZE, NULL, 0);
+        }
+
+        xfer.len = in->size;
+        memset(s_tx, 0, in->size);
+        run_message(&xfer, 1, in->size);
+
+        iov.iov_base = s_rx;
+        iov.iov_len  = in->size;
+    }
+
+    return reply(fd, hdr->unique, 0, &iov, 1);
+}
+
+static int do_init(int fd, const struct fuse_in_header *hdr)
+{
+    const struct cuse_init_in *in = (const struct cuse_init_in *)(hdr + 1);
+    struct cuse_init_out       out;
+    char                       info[64];
+    struct iovec               iov[2];
+
+    if (in->major != FUSE_KERNEL_VERSION)
+    {
+        printf("Unsupported CUSE protocol %u.%u\n", in->major, in->minor);
+        return -1;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.major     = FUSE_KERNEL_VERSION;
+    out.minor     = (in->minor < FUSE_KERNEL_MINOR_VERSION) ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+    out.flags     = CUSE_UNRESTRICTED_IOCTL;
+    out.max_read  = MAX_MESSAGE;
+    out.max_write = MAX_MESSAGE;
+
+    iov[0].iov_base = &out;
+    iov[0].iov_len  = sizeof(out);
+    iov[1].iov_base = info;
+    iov[1].iov_len  = (size_t)snprintf(info, sizeof(info), "DEVNAME=%s", s_name) + 1;
+
+    return reply(fd, hdr->unique, 0, iov, 2);
+}
+
+static int serve(int fd)
+{
+    while (!s_stop)
+    {
+        const struct fuse_in_header *hdr = (const struct fuse_in_header *)s_read_buf;
+        ssize_t                      len = read(fd, s_read_buf, sizeof(s_read_buf));
+        int                          ret = 0;
+
+        if (len < 0)
+        {
+            if (errno == EINTR || errno == ENOENT || errno == EAGAIN)
+            {
+                continue;
+            }
+            if (errno == ENODEV)
+            {
+                return 0;
+            }
+            perror("read");
+            return -1;
+        }
+
+        if ((size_t)len < sizeof(*hdr))
+        {
+            continue;
+        }
+
+        switch (hdr->opcode)
+        {
+        case CUSE_INIT:
+            if ((ret = do_init(fd, hdr)) == 0)
+            {
+                printf("Serving /dev/%s\n", s_name);
+                fflush(stdout);
+            }
+            break;
+        case FUSE_OPEN:
+        {
+            struct fuse_open_out out;
+            struct iovec         iov = {&out, sizeof(out)};
+
+            memset(&out, 0, sizeof(out));
+            out.open_flags = FOPEN_DIRECT_IO | FOPEN_NONSEEKABLE;
+            ret            = reply(fd, hdr->unique, 0, &iov, 1);
+            break;
+        }
+        case FUSE_RELEASE:
+        case FUSE_FLUSH:
+        case FUSE_FSYNC:
+            ret = reply(fd, hdr->unique, 0, NULL, 0);
+            break;
+        case FUSE_READ:
+        case FUSE_WRITE:
+            ret = do_rw(fd, hdr);
+            break;
+        case FUSE_IOCTL:
+            ret = do_ioctl(fd, hdr, (const struct fuse_ioctl_in *)(hdr + 1));
+            break;
+        case FUSE_INTERRUPT:
+        case FUSE_FORGET:
+            // No reply is expected for these.
+            break;
+        default:
+            ret = reply(fd, hdr->unique, ENOSYS, NULL, 0);
+            break;
+        }
+
+        if (ret < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        {"name", 1, 0, 'n'},       {"emulate", 1, 0, 'e'}, {"script", 1, 0, 'S'},
+        {"latency-us", 1, 0, 'l'}, {"cuse", 1, 0, 'c'},    {NULL, 0, 0, 0},
+    };
+    struct sigaction sa;
+    int              fd;
+    int              c;
+    int              ret;
+
+    while ((c = getopt_long(argc, argv, "n:", opts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            s_name = optarg;
+            break;
+        case 'e':
+            s_emulate = optarg;
+            break;
+        case 'S':
+            s_script = optarg;
+            break;
+        case 'l':
+            s_latency_ns = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+            break;
+        case 'c':
+            s_cuse_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+        }
+    }
+
+    if (s_script != NULL ? load_script(s_script) < 0 : (s_emu = emu_open(s_emulate, s_speed)) == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = open(s_cuse_path, O_RDWR)) < 0)
+    {
+        perror(s_cuse_path);
+        return EXIT_FAILURE;
+    }
+
+    // Without SA_RESTART, so that a signal breaks out of the blocking read.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    ret = serve(fd);
+    close(fd);
+
+    printf("%" PRIu64 " messages\n", s_messages);
+
+    if (s_emu != NULL)
+    {
+        emu_report(s_emu, stdout);
+        emu_close(s_emu);
+    }
+
+    return (ret < 0) ? EXIT_FAILURE : 0;
+}
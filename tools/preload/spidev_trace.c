@@ -0,0 +1,659 @@
+/*
+ * SPI ioctl tracer for any process, loaded with LD_PRELOAD.
+ *
+ *   $ LD_PRELOAD=tools/preload/spidev_trace.so SPIDEV_TRACE_STATS=1 my-service
+ *
+ * open() and ioctl() are interposed. File descriptors of spidev nodes are
+ * remembered at open; every SPI_IOC_MESSAGE on them is timed and copied,
+ * TX and RX, into a ring buffer owned by the calling thread, and the
+ * configuration ioctls are counted. A collector thread drains the rings
+ * into the capture writer and the statistics of spidev_test, so the
+ * traced thread never takes a lock or makes an extra syscall. When a ring
+ * is full, the message is counted as dropped rather than waited for.
+ *
+ * At exit a report goes to stderr (or SPIDEV_TRACE_REPORT): message and
+ * transfer counts, transfers and bytes per ioctl, latency and size
+ * percentiles, and with SPIDEV_TRACE_STATS=1 the per-TX-data table.
+ * SPIDEV_TRACE_CAPTURE names a capture file, in SPIDEV_TRACE_FORMAT (text,
+ * indexed or delta), that spidev_test --replay and --query can read.
+ *
+ * Descriptors duplicated with dup() and children after fork() are not
+ * traced.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/spi/spidev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "histogram.h"
+#include "stats.h"
+#include "timing.h"
+
+#define SPIDEV_MAJOR 153
+#define TRACE_MAX_FD 65536
+#define TRACE_RING_SIZE (1 << 20)
+#define TRACE_MAX_MESSAGE (TRACE_RING_SIZE / 8)
+#define TRACE_MAX_TRANSFERS 256
+#define TRACE_IDLE_NS (10 * NSEC_PER_MSEC)
+
+enum trace_config
+{
+    CONFIG_MODE,
+    CONFIG_BITS,
+    CONFIG_SPEED,
+    CONFIG_LSB,
+    CONFIG_COUNT,
+};
+
+/*
+ * One message in a ring, followed by len TX bytes and len RX bytes, padded
+ * to 8 bytes.
+ */
+struct trace_entry
+{
+    uint64_t t_ns;
+    uint64_t latency_ns;
+    uint32_t len;
+    uint32_t speed_hz;
+    uint32_t delay_us;
+    uint16_t transfers;
+    uint8_t  bits;
+    uint8_t  failed;
+};
+
+/*
+ * Single-producer single-consumer byte ring: the owning thread writes,
+ * the collector reads. head and tail only grow.
+ */
+struct trace_ring
+{
+    uint64_t           head;
+    uint64_t           tail;
+    uint64_t           dropped;
+    struct trace_ring *next;
+    uint8_t            data[TRACE_RING_SIZE];
+};
+
+static int (*s_real_open)(const char *, int, ...);
+static int (*s_real_openat)(int, const char *, int, ...);
+static int (*s_real_close)(int);
+static int (*s_real_ioctl)(int, unsigned long, ...);
+
+static uint8_t            s_spidev_fd[TRACE_MAX_FD];
+static struct trace_ring *s_rings   = NULL;
+static int                s_enabled = 1;
+static pthread_once_t     s_once    = PTHREAD_ONCE_INIT;
+static pthread_t          s_collector;
+static int                s_running = 0;
+static int                s_stop    = 0;
+static uint8_t            s_mode    = 0;
+static uint8_t            s_bits    = 8;
+static uint32_t           s_speed   = 0;
+static uint64_t           s_config_writes[CONFIG_COUNT];
+static uint64_t           s_config_reads[CONFIG_COUNT];
+
+// Only the collector touches these.
+static const char            *s_capture_path   = NULL;
+static enum capture_format    s_capture_format = CAPTURE_FORMAT_TEXT;
+static struct capture_writer *s_capture        = NULL;
+static uint64_t               s_t0             = 0;
+static struct stats           s_stats;
+static int                    s_stats_enabled  = 0;
+static struct histogram       s_latency;
+static struct histogram       s_sizes;
+static uint64_t               s_messages       = 0;
+static uint64_t               s_transfers      = 0;
+static uint64_t               s_bytes          = 0;
+static uint64_t               s_failures       = 0;
+static uint8_t               *s_entry_buf      = NULL;
+
+static __thread struct trace_ring *t_ring;
+
+static void resolve(void)
+{
+    s_real_open   = dlsym(RTLD_NEXT, "open");
+    s_real_openat = dlsym(RTLD_NEXT, "openat");
+    s_real_close  = dlsym(RTLD_NEXT, "close");
+    s_real_ioctl  = dlsym(RTLD_NEXT, "ioctl");
+}
+
+static void ring_copy_out(const struct trace_ring *ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t offset = pos & (TRACE_RING_SIZE - 1);
+    size_t first  = (len < TRACE_RING_SIZE - offset) ? len : TRACE_RING_SIZE - offset;
+
+    memcpy(dst, ring->data + offset, first);
+    memcpy((uint8_t *)dst + first, ring->data, len - first);
+}
+
+static void ring_copy_in(struct trace_ring *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t offset = pos & (TRACE_RING_SIZE - 1);
+    size_t first  = (len < TRACE_RING_SIZE - offset) ? len : TRACE_RING_SIZE - offset;
+
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, len - first);
+}
+
+static size_t entry_size(uint32_t len)
+{
+    return (sizeof(struct trace_entry) + 2 * (size_t)len + 7) & ~(size_t)7;
+}
+
+static void drain(struct trace_ring *ring)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (ring->tail != head)
+    {
+        struct trace_entry entry;
+        const uint8_t     *tx;
+        const uint8_t     *rx;
+
+        ring_copy_out(ring, ring->tail, &entry, sizeof(entry));
+        ring_copy_out(ring, ring->tail + sizeof(entry), s_entry_buf, 2 * (size_t)entry.len);
+        tx = s_entry_buf;
+        rx = s_entry_buf + entry.len;
+
+        s_messages++;
+        s_transfers += entry.transfers;
+        s_bytes += entry.len;
+
+        if (entry.failed)
+        {
+            s_failures++;
+        }
+        else
+        {
+            hist_add(&s_latency, entry.latency_ns);
+            hist_add(&s_sizes, entry.len);
+
+            if (s_stats_enabled)
+            {
+                stats_record(&s_stats, (uint32_t)s_messages, tx, rx, entry.len, entry.latency_ns, STATS_VERIFY_NONE);
+            }
+
+            // The capture is created on the first message, once the mode is known.
+            if (s_capture_path != NULL && s_capture == NULL)
+            {
+                if ((s_capture = capture_writer_open(s_capture_path, s_mode, s_capture_format)) == NULL)
+                {
+                    fprintf(stderr, "spidev_trace: cannot create %s\n", s_capture_path);
+                }
+                s_capture_path = NULL;
+            }
+
+            if (s_capture != NULL)
+            {
+                struct capture_record record;
+
+                if (s_t0 == 0)
+                {
+                    s_t0 = entry.t_ns;
+                }
+
+                record.t_ns     = entry.t_ns - s_t0;
+                record.speed_hz = entry.speed_hz;
+                record.delay_us = entry.delay_us;
+                record.bits     = entry.bits;
+                record.len      = entry.len;
+                record.tx       = tx;
+                record.rx       = rx;
+
+                if (capture_write(s_capture, &record) < 0)
+                {
+                    fprintf(stderr, "spidev_trace: capture write failed, capture stopped\n");
+                    capture_writer_close(s_capture);
+                    s_capture = NULL;
+                }
+            }
+        }
+
+        __atomic_store_n(&ring->tail, ring->tail + entry_size(entry.len), __ATOMIC_RELEASE);
+    }
+}
+
+static void drain_all(void)
+{
+    for (struct trace_ring *ring = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        drain(ring);
+    }
+}
+
+static void *collect(void *arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        drain_all();
+        sleep_until_ns(monotonic_ns() + TRACE_IDLE_NS);
+    }
+
+    drain_all();
+    return NULL;
+}
+
+static void start_collector(void)
+{
+    const char *format = getenv("SPIDEV_TRACE_FORMAT");
+    sigset_t    all;
+    sigset_t    old;
+
+    hist_init(&s_latency);
+    hist_init(&s_sizes);
+
+    if ((s_entry_buf = malloc(2 * TRACE_MAX_MESSAGE)) == NULL)
+    {
+        s_enabled = 0;
+        return;
+    }
+
+    if (getenv("SPIDEV_TRACE_STATS") != NULL &&
+        stats_init(&s_stats, STATS_KEY_TX_HASH, STATS_MAX_FRAMES) == 0)
+    {
+        s_stats_enabled = 1;
+    }
+
+    if (format != NULL && strcmp(format, "indexed") == 0)
+    {
+        s_capture_format = CAPTURE_FORMAT_INDEXED;
+    }
+    else if (format != NULL && strcmp(format, "delta") == 0)
+    {
+        s_capture_format = CAPTURE_FORMAT_DELTA;
+    }
+
+    s_capture_path = getenv("SPIDEV_TRACE_CAPTURE");
+
+    // Keep the process' signals away from the collector.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_collector, NULL, collect, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!s_running)
+    {
+        s_enabled = 0;
+    }
+}
+
+static void track(int fd, const char *path)
+{
+    struct stat st;
+
+    if (fd < 0 || fd >= TRACE_MAX_FD || !s_enabled)
+    {
+        return;
+    }
+
+    if ((path != NULL && strncmp(path, "/dev/spidev", 11) == 0) ||
+        (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) && major(st.st_rdev) == SPIDEV_MAJOR))
+    {
+        pthread_once(&s_once, start_collector);
+        __atomic_store_n(&s_spidev_fd[fd], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static struct trace_ring *thread_ring(void)
+{
+    struct trace_ring *ring = t_ring;
+
+    if (ring == NULL)
+    {
+        if ((ring = calloc(1, sizeof(*ring))) == NULL)
+        {
+            return NULL;
+        }
+
+        ring->next = __atomic_load_n(&s_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&s_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+
+        t_ring = ring;
+    }
+
+    return ring;
+}
+
+/*
+ * Copy one completed message into the thread's ring. The TX and RX bytes
+ * of all its transfers are concatenated into a single capture record.
+ */
+static void record_message(const struct spi_ioc_transfer *xfers, unsigned int count, uint64_t t_ns,
+                           uint64_t latency_ns, int failed)
+{
+    struct trace_ring *ring = thread_ring();
+    struct trace_entry entry;
+    uint64_t           pos;
+    uint32_t           len = 0;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    for (unsigned int i = 0; i < count; i++)
+    {
+        len += xfers[i].len;
+        entry.delay_us += xfers[i].delay_usecs;
+        if (entry.speed_hz == 0)
+        {
+            entry.speed_hz = xfers[i].speed_hz;
+        }
+        if (entry.bits == 0)
+        {
+            entry.bits = xfers[i].bits_per_word;
+        }
+    }
+
+    if (len > TRACE_MAX_MESSAGE ||
+        TRACE_RING_SIZE - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < entry_size(len))
+    {
+        ring->dropped++;
+        return;
+    }
+
+    entry.t_ns       = t_ns;
+    entry.latency_ns = latency_ns;
+    entry.len        = len;
+    entry.transfers  = (uint16_t)count;
+    entry.failed     = (uint8_t)failed;
+    entry.speed_hz   = entry.speed_hz ? entry.speed_hz : s_speed;
+    entry.bits       = entry.bits ? entry.bits : s_bits;
+
+    pos = ring->head;
+    ring_copy_in(ring, pos, &entry, sizeof(entry));
+    pos += sizeof(entry);
+
+    // Missing TX buffers clock out zeros; missing RX buffers read as zeros.
+    for (int dir = 0; dir < 2; dir++)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            uint64_t buf = dir ? xfers[i].rx_buf : xfers[i].tx_buf;
+
+            if (buf != 0)
+            {
+                ring_copy_in(ring, pos, (const void *)(uintptr_t)buf, xfers[i].len);
+            }
+            else
+            {
+                for (uint32_t j = 0; j < xfers[i].len; j++)
+                {
+                    ring->data[(pos + j) & (TRACE_RING_SIZE - 1)] = 0;
+                }
+            }
+            pos += xfers[i].len;
+        }
+    }
+
+    __atomic_store_n(&ring->head, ring->head + entry_size(len), __ATOMIC_RELEASE);
+}
+
+static void count_config(unsigned long request, const void *arg)
+{
+    int kind;
+
+    switch (request)
+    {
+    case SPI_IOC_WR_MODE:
+    case SPI_IOC_RD_MODE:
+    case SPI_IOC_WR_MODE32:
+    case SPI_IOC_RD_MODE32:
+        kind = CONFIG_MODE;
+        break;
+    case SPI_IOC_WR_BITS_PER_WORD:
+    case SPI_IOC_RD_BITS_PER_WORD:
+        kind = CONFIG_BITS;
+        break;
+    case SPI_IOC_WR_MAX_SPEED_HZ:
+    case SPI_IOC_RD_MAX_SPEED_HZ:
+        kind = CONFIG_SPEED;
+        break;
+    case SPI_IOC_WR_LSB_FIRST:
+    case SPI_IOC_RD_LSB_FIRST:
+        kind = CONFIG_LSB;
+        break;
+    default:
+        return;
+    }
+
+    if (_IOC_DIR(request) & _IOC_WRITE)
+    {
+        __atomic_fetch_add(&s_config_writes[kind], 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&s_config_reads[kind], 1, __ATOMIC_RELAXED);
+    }
+
+    // Remember what the device runs at, for transfers that do not say.
+    if (kind == CONFIG_MODE)
+    {
+        s_mode = *(const uint8_t *)arg;
+    }
+    else if (kind == CONFIG_BITS)
+    {
+        s_bits = *(const uint8_t *)arg;
+    }
+    else if (kind == CONFIG_SPEED)
+    {
+        s_speed = *(const uint32_t *)arg;
+    }
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    int    fd;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    if (s_real_open == NULL)
+    {
+        resolve();
+    }
+
+    fd = s_real_open(path, flags, mode);
+    track(fd, path);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    int    fd;
+
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list ap;
+
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    if (s_real_openat == NULL)
+    {
+        resolve();
+    }
+
+    fd = s_real_openat(dirfd, path, flags, mode);
+    track(fd, path);
+    return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+
+int close(int fd)
+{
+    if (s_real_close == NULL)
+    {
+        resolve();
+    }
+
+    if (fd >= 0 && fd < TRACE_MAX_FD)
+    {
+        __atomic_store_n(&s_spidev_fd[fd], 0, __ATOMIC_RELAXED);
+    }
+
+    return s_real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list  ap;
+    void    *arg;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int      ret;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (s_real_ioctl == NULL)
+    {
+        resolve();
+    }
+
+    if (fd < 0 || fd >= TRACE_MAX_FD || !__atomic_load_n(&s_spidev_fd[fd], __ATOMIC_RELAXED) ||
+        _IOC_TYPE(request) != SPI_IOC_MAGIC || !s_enabled)
+    {
+        return s_real_ioctl(fd, request, arg);
+    }
+
+    if (_IOC_NR(request) != 0)
+    {
+        ret = s_real_ioctl(fd, request, arg);
+        if (ret >= 0)
+        {
+            count_config(request, arg);
+        }
+        return ret;
+    }
+
+    start_ns = monotonic_ns();
+    ret      = s_real_ioctl(fd, request, arg);
+    end_ns   = monotonic_ns();
+
+    if (_IOC_DIR(request) == _IOC_WRITE && _IOC_SIZE(request) % sizeof(struct spi_ioc_transfer) == 0 &&
+        _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer) <= TRACE_MAX_TRANSFERS)
+    {
+        record_message(arg, _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer), start_ns, end_ns - start_ns,
+                       ret < 0);
+    }
+
+    return ret;
+}
+
+static void on_fork_child(void)
+{
+    // The collector did not survive the fork.
+    s_enabled = 0;
+    memset(s_spidev_fd, 0, sizeof(s_spidev_fd));
+}
+
+__attribute__((constructor)) static void trace_init(void)
+{
+    resolve();
+    pthread_atfork(NULL, NULL, on_fork_child);
+}
+
+__attribute__((destructor)) static void trace_report(void)
+{
+    const char *path    = getenv("SPIDEV_TRACE_REPORT");
+    FILE       *out     = stderr;
+    uint64_t    dropped = 0;
+
+    if (!s_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_collector, NULL);
+    s_running = 0;
+
+    for (struct trace_ring *ring = s_rings; ring != NULL; ring = ring->next)
+    {
+        dropped += ring->dropped;
+    }
+
+    if (path != NULL && (out = fopen(path, "w")) == NULL)
+    {
+        out = stderr;
+    }
+
+    fprintf(out, "spidev_trace: pid %d, %" PRIu64 " messages (%" PRIu64 " failed, %" PRIu64 " dropped)\n",
+            (int)getpid(), s_messages, s_failures, dropped);
+
+    if (s_messages > 0)
+    {
+        fprintf(out, "spidev_trace: %" PRIu64 " transfers, %.2f per message; %" PRIu64 " bytes, %.1f per message\n",
+                s_transfers, (double)s_transfers / s_messages, s_bytes, (double)s_bytes / s_messages);
+    }
+
+    fprintf(out, "spidev_trace: configuration ioctls (write/read): mode %" PRIu64 "/%" PRIu64 ", bits %" PRIu64
+            "/%" PRIu64 ", speed %" PRIu64 "/%" PRIu64 ", lsb %" PRIu64 "/%" PRIu64 "\n",
+            s_config_writes[CONFIG_MODE], s_config_reads[CONFIG_MODE], s_config_writes[CONFIG_BITS],
+            s_config_reads[CONFIG_BITS], s_config_writes[CONFIG_SPEED], s_config_reads[CONFIG_SPEED],
+            s_config_writes[CONFIG_LSB], s_config_reads[CONFIG_LSB]);
+
+    if (s_latency.count > 0)
+    {
+        fprintf(out, "spidev_trace: latency min/avg/p50/p99/max = %.1f/%.1f/%.1f/%.1f/%.1f us\n",
+                (double)s_latency.min / NSEC_PER_USEC, (double)hist_mean(&s_latency) / NSEC_PER_USEC,
+                (double)hist_percentile(&s_latency, 50) / NSEC_PER_USEC,
+                (double)hist_percentile(&s_latency, 99) / NSEC_PER_USEC, (double)s_latency.max / NSEC_PER_USEC);
+        fprintf(out, "spidev_trace: message size min/p50/p99/max = %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64
+                " bytes\n", s_sizes.min, hist_percentile(&s_sizes, 50), hist_percentile(&s_sizes, 99), s_sizes.max);
+    }
+
+    if (s_stats_enabled)
+    {
+        stats_print(&s_stats, out);
+        stats_free(&s_stats);
+    }
+
+    if (s_capture != NULL && capture_writer_close(s_capture) < 0)
+    {
+        fprintf(out, "spidev_trace: capture write failed\n");
+    }
+
+    if (out != stderr)
+    {
+        fclose(out);
+    }
+}
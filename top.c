@@ -0,0 +1,210 @@
+/*
+ * Live dashboard of the bus activity, redrawn once per second.
+ *
+ * The dashboard only reads the metrics counter blocks, which the transfer
+ * loops update with plain relaxed stores, so drawing it costs the loops
+ * nothing but the cache line transfers of one snapshot per second. Rates
+ * and latency percentiles are over the last second, from the difference
+ * of two snapshots; the percentiles are the upper bounds of the histogram
+ * buckets they fall in.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "top.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "timing.h"
+
+#define TOP_NAP_US 100000
+
+static FILE                   *s_out;
+static int                     s_tty;
+static uint64_t                s_start_ns;
+static struct metrics_counters s_last[METRICS_MAX_WRITERS];
+static struct metrics_counters s_now[METRICS_MAX_WRITERS];
+static uint64_t                s_last_ns;
+static int                     s_stop    = 0;
+static int                     s_running = 0;
+static pthread_t               s_thread;
+
+/*
+ * The bucket bound below which `percent` of the latencies between the two
+ * snapshots fall, as "<250us", or ">1s" above every bound.
+ */
+static void format_percentile(char                          *text,
+                              size_t                         size,
+                              const struct metrics_counters *now,
+                              const struct metrics_counters *last,
+                              double                         percent)
+{
+    uint64_t total = now->frames - last->frames;
+    uint64_t seen  = 0;
+    uint32_t bucket;
+
+    if (total == 0)
+    {
+        snprintf(text, size, "-");
+        return;
+    }
+
+    for (bucket = 0; bucket < METRICS_LATENCY_BUCKETS; bucket++)
+    {
+        seen += now->latency_buckets[bucket] - last->latency_buckets[bucket];
+        if (seen * 100 >= total * percent)
+        {
+            break;
+        }
+    }
+
+    if (bucket == METRICS_LATENCY_BUCKETS)
+    {
+        snprintf(text, size, ">%gs", (double)g_metrics_bounds_ns[bucket - 1] / NSEC_PER_SEC);
+    }
+    else if (g_metrics_bounds_ns[bucket] < NSEC_PER_MSEC)
+    {
+        snprintf(text, size, "<%gus", (double)g_metrics_bounds_ns[bucket] / NSEC_PER_USEC);
+    }
+    else if (g_metrics_bounds_ns[bucket] < NSEC_PER_SEC)
+    {
+        snprintf(text, size, "<%gms", (double)g_metrics_bounds_ns[bucket] / NSEC_PER_MSEC);
+    }
+    else
+    {
+        snprintf(text, size, "<%gs", (double)g_metrics_bounds_ns[bucket] / NSEC_PER_SEC);
+    }
+}
+
+static void draw(uint32_t count, uint64_t now_ns)
+{
+    double   seconds = (double)(now_ns - s_last_ns) / NSEC_PER_SEC;
+    uint64_t up_s    = (now_ns - s_start_ns) / NSEC_PER_SEC;
+
+    if (s_tty)
+    {
+        // Home, then clear each line as it is overwritten and the rest of the screen at the end.
+        fprintf(s_out, "\033[H");
+        fprintf(s_out, "spidev_test --top, up %02u:%02u:%02u\033[K\n\033[K\n", (unsigned)(up_s / 3600),
+                (unsigned)(up_s / 60 % 60), (unsigned)(up_s % 60));
+    }
+
+    if (s_tty || s_last_ns == s_start_ns)
+    {
+        fprintf(s_out, "%-24s %10s %10s %10s %8s %8s %8s %8s %12s%s\n", "DEVICE", "FRAME", "FRAMES/S", "KB/S", "P50",
+                "P99", "MISMATCH", "IOCTL", "TOTAL", s_tty ? "\033[K" : "");
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const struct metrics_counters *now  = &s_now[i];
+        const struct metrics_counters *last = &s_last[i];
+        char                           p50[16];
+        char                           p99[16];
+
+        format_percentile(p50, sizeof(p50), now, last, 50);
+        format_percentile(p99, sizeof(p99), now, last, 99);
+        fprintf(s_out, "%-24.24s %10llu %10.1f %10.1f %8s %8s %8llu %8llu %12llu%s\n", now->device,
+                (unsigned long long)now->frame, (double)(now->frames - last->frames) / seconds,
+                (double)(now->bytes - last->bytes) / seconds / 1000, p50, p99,
+                (unsigned long long)now->verify_failures, (unsigned long long)now->ioctl_errors,
+                (unsigned long long)now->frames, s_tty ? "\033[K" : "");
+    }
+
+    if (s_tty)
+    {
+        fprintf(s_out, "\033[J");
+    }
+    fflush(s_out);
+}
+
+/*
+ * Take a snapshot and draw it. With `if_changed`, only if a frame has been
+ * transferred since the last one.
+ */
+static void refresh(int if_changed)
+{
+    uint64_t now_ns  = monotonic_ns();
+    uint32_t count   = metrics_snapshot(s_now, METRICS_MAX_WRITERS);
+    int      changed = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        changed |= (s_now[i].frames != s_last[i].frames);
+    }
+
+    if (now_ns == s_last_ns || (if_changed && !changed))
+    {
+        return;
+    }
+
+    draw(count, now_ns);
+    memcpy(s_last, s_now, count * sizeof(s_now[0]));
+    s_last_ns = now_ns;
+}
+
+static void *top_thread(void *arg)
+{
+    uint64_t next_ns = s_start_ns + NSEC_PER_SEC;
+
+    (void)arg;
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        usleep(TOP_NAP_US);
+        if (monotonic_ns() >= next_ns)
+        {
+            refresh(0);
+            next_ns += NSEC_PER_SEC;
+        }
+    }
+
+    return NULL;
+}
+
+int top_start(FILE *out)
+{
+    sigset_t all;
+    sigset_t old;
+
+    s_out      = out;
+    s_tty      = isatty(fileno(out));
+    s_start_ns = monotonic_ns();
+    s_last_ns  = s_start_ns;
+    metrics_snapshot(s_last, METRICS_MAX_WRITERS);
+
+    if (s_tty)
+    {
+        fprintf(s_out, "\033[H\033[2J");
+        fflush(s_out);
+    }
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_thread, NULL, top_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return s_running ? 0 : -1;
+}
+
+void top_stop(void)
+{
+    if (!s_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_thread, NULL);
+    s_running = 0;
+
+    // The last, partial second, so the totals on screen are final.
+    refresh(1);
+}
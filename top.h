@@ -0,0 +1,22 @@
+/*
+ * Live dashboard of the bus activity, redrawn once per second.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_TOP_H
+#define SPIDEV_TOP_H
+
+#include <stdio.h>
+
+/*
+ * Draw a row per metrics counter block to `out` from a background thread:
+ * over the whole screen on a terminal, as a line per device and second
+ * otherwise. The blocks must be registered before.
+ */
+int  top_start(FILE *out);
+void top_stop(void);
+
+#endif // SPIDEV_TOP_H
@@ -0,0 +1,264 @@
+/*
+ * Automatic choice of the number of frames per SPI_IOC_MESSAGE.
+ *
+ * How many frames are worth packing into one message depends on the
+ * controller driver, its DMA threshold and the frame size, so it is
+ * measured rather than guessed. The calibration uses the frames the run
+ * sends anyway, in order: each candidate batch (powers of two up to what
+ * fits in the spidev bufsiz) carries the run for a short step, and the one
+ * with the most frames per second wins and is saved for the device. The
+ * throughput is then watched over windows of messages, and a lasting drop
+ * below the rate seen just after choosing starts a new calibration.
+ *
+ * Only the time spent building and sending the messages counts, not the
+ * -i sleep between them: that is the same for every batch, so with it the
+ * largest batch would always look fastest. A step or window ends after
+ * enough of that time, or after enough messages when they are short and
+ * far apart.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "tune.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define TUNE_STEP_NS (50 * NSEC_PER_MSEC)
+#define TUNE_STEP_MESSAGES 8
+#define TUNE_STEP_MAX_MESSAGES 64
+#define TUNE_WINDOW_NS NSEC_PER_SEC
+#define TUNE_WINDOW_MESSAGES 256
+#define TUNE_DROP 0.8
+#define TUNE_SLOW_WINDOWS 3
+#define TUNE_LINE_MAX (PATH_MAX + 128)
+
+/*
+ * Whether a line of the file, "batch=N busy_rate=R key", is for our key. Stores
+ * the batch it holds.
+ */
+static int line_matches(const struct tune *tune, char *line, uint32_t *batch)
+{
+    unsigned int saved;
+    int          key_at = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "batch=%u busy_rate=%*f %n", &saved, &key_at) != 1 || key_at == 0 ||
+        strcmp(line + key_at, tune->key) != 0)
+    {
+        return 0;
+    }
+
+    *batch = saved;
+    return 1;
+}
+
+static uint32_t load_batch(const struct tune *tune)
+{
+    char     line[TUNE_LINE_MAX];
+    uint32_t batch = 0;
+    FILE    *fp;
+
+    if (tune->path == NULL || (fp = fopen(tune->path, "r")) == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_matches(tune, line, &batch);
+    }
+
+    fclose(fp);
+    return batch;
+}
+
+/*
+ * Rewrite the file with the line of the key replaced, next to its final
+ * name and renamed into place.
+ */
+static void save_batch(const struct tune *tune, uint32_t batch, double rate)
+{
+    char  tmp[TUNE_LINE_MAX];
+    char  line[TUNE_LINE_MAX];
+    FILE *in;
+    FILE *out;
+    int   ok;
+
+    if (tune->path == NULL || (size_t)snprintf(tmp, sizeof(tmp), "%s.%d", tune->path, (int)getpid()) >= sizeof(tmp))
+    {
+        return;
+    }
+
+    if ((out = fopen(tmp, "w")) == NULL)
+    {
+        return;
+    }
+
+    if ((in = fopen(tune->path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), in) != NULL)
+        {
+            uint32_t other;
+
+            if (!line_matches(tune, line, &other))
+            {
+                fprintf(out, "%s\n", line);
+            }
+        }
+        fclose(in);
+    }
+
+    ok = fprintf(out, "batch=%u busy_rate=%.0f %s\n", batch, rate, tune->key) > 0;
+
+    if (fclose(out) != 0 || !ok || rename(tmp, tune->path) < 0)
+    {
+        unlink(tmp);
+    }
+}
+
+static void begin_calibration(struct tune *tune)
+{
+    tune->phase    = TUNE_CALIBRATE;
+    tune->current  = 0;
+    tune->batch    = tune->candidates[0];
+    tune->frames   = 0;
+    tune->ns       = 0;
+    tune->messages = 0;
+    tune->calibrations++;
+}
+
+static void begin_run(struct tune *tune, uint32_t batch)
+{
+    tune->phase        = TUNE_RUN;
+    tune->batch        = batch;
+    tune->frames       = 0;
+    tune->ns           = 0;
+    tune->messages     = 0;
+    tune->reference    = 0;
+    tune->slow_windows = 0;
+}
+
+uint32_t tune_start(struct tune *tune, uint32_t max_batch, const char *key, const char *path)
+{
+    uint32_t saved;
+
+    memset(tune, 0, sizeof(*tune));
+    tune->path = path;
+    snprintf(tune->key, sizeof(tune->key), "%s", key);
+
+    for (uint32_t batch = 1; batch < max_batch && tune->candidate_count < TUNE_MAX_CANDIDATES - 1; batch *= 2)
+    {
+        tune->candidates[tune->candidate_count++] = batch;
+    }
+    tune->candidates[tune->candidate_count++] = max_batch;
+
+    if ((saved = load_batch(tune)) >= 1 && saved <= max_batch)
+    {
+        printf("tune: batch %u, saved for this device\n", saved);
+        begin_run(tune, saved);
+    }
+    else
+    {
+        begin_calibration(tune);
+    }
+
+    return tune->batch;
+}
+
+static void choose(struct tune *tune)
+{
+    uint32_t best = 0;
+
+    for (uint32_t i = 1; i < tune->candidate_count; i++)
+    {
+        if (tune->rates[i] > tune->rates[best])
+        {
+            best = i;
+        }
+    }
+
+    printf("tune: batch %u, %.0f frames/s (", tune->candidates[best], tune->rates[best]);
+    for (uint32_t i = 0; i < tune->candidate_count; i++)
+    {
+        printf("%s%u: %.0f", i ? ", " : "", tune->candidates[i], tune->rates[i]);
+    }
+    printf(")\n");
+
+    save_batch(tune, tune->candidates[best], tune->rates[best]);
+    begin_run(tune, tune->candidates[best]);
+}
+
+uint32_t tune_next(struct tune *tune, uint32_t frames, uint64_t ns)
+{
+    double rate;
+
+    tune->frames += frames;
+    tune->ns += ns;
+    tune->messages++;
+
+    if (tune->phase == TUNE_CALIBRATE)
+    {
+        if (tune->messages < TUNE_STEP_MESSAGES ||
+            (tune->ns < TUNE_STEP_NS && tune->messages < TUNE_STEP_MAX_MESSAGES))
+        {
+            return tune->batch;
+        }
+
+        tune->rates[tune->current] = (double)tune->frames * NSEC_PER_SEC / (double)tune->ns;
+        tune->frames               = 0;
+        tune->ns                   = 0;
+        tune->messages             = 0;
+
+        if (++tune->current == tune->candidate_count)
+        {
+            choose(tune);
+        }
+        else
+        {
+            tune->batch = tune->candidates[tune->current];
+        }
+
+        return tune->batch;
+    }
+
+    if (tune->ns < TUNE_WINDOW_NS && tune->messages < TUNE_WINDOW_MESSAGES)
+    {
+        return tune->batch;
+    }
+
+    rate           = (double)tune->frames * NSEC_PER_SEC / (double)tune->ns;
+    tune->frames   = 0;
+    tune->ns       = 0;
+    tune->messages = 0;
+
+    if (tune->reference == 0)
+    {
+        tune->reference = rate;
+    }
+    else if (rate < tune->reference * TUNE_DROP)
+    {
+        if (++tune->slow_windows == TUNE_SLOW_WINDOWS)
+        {
+            printf("tune: throughput fell to %.0f frames/s from %.0f, tuning again\n", rate, tune->reference);
+            begin_calibration(tune);
+        }
+    }
+    else
+    {
+        tune->slow_windows = 0;
+    }
+
+    return tune->batch;
+}
+
+void tune_report(const struct tune *tune, FILE *out)
+{
+    fprintf(out, "tune: batch %u at exit, %u calibration%s\n", tune->batch, tune->calibrations,
+            (tune->calibrations == 1) ? "" : "s");
+}
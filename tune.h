@@ -0,0 +1,57 @@
+/*
+ * Automatic choice of the number of frames per SPI_IOC_MESSAGE.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_TUNE_H
+#define SPIDEV_TUNE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TUNE_MAX_CANDIDATES 16
+
+enum tune_phase
+{
+    TUNE_CALIBRATE, // trying each candidate in turn
+    TUNE_RUN,       // sending with the best one, watching the throughput
+};
+
+struct tune
+{
+    enum tune_phase phase;
+    const char     *path;
+    char            key[PATH_MAX + 64];
+    uint32_t        candidates[TUNE_MAX_CANDIDATES];
+    double          rates[TUNE_MAX_CANDIDATES]; // frames per second
+    uint32_t        candidate_count;
+    uint32_t        current; // index into candidates
+    uint32_t        batch;
+    uint64_t        frames;  // in the current step or window
+    uint64_t        ns;
+    uint32_t        messages;
+    double          reference; // frames per second of the first window after choosing
+    uint32_t        slow_windows;
+    uint32_t        calibrations;
+};
+
+/*
+ * Set up tuning for batches of 1 to max_batch frames. `key` names the
+ * device, controller and transfer shape; a batch saved under it in `path`
+ * by an earlier run is used straight away, otherwise the run starts with a
+ * calibration. Returns the batch for the first message.
+ */
+uint32_t tune_start(struct tune *tune, uint32_t max_batch, const char *key, const char *path);
+
+/*
+ * Account a message of `frames` frames that took `ns` to build and send,
+ * without the -i sleep after it. Returns the batch for the next message.
+ */
+uint32_t tune_next(struct tune *tune, uint32_t frames, uint64_t ns);
+void     tune_report(const struct tune *tune, FILE *out);
+
+#endif // SPIDEV_TUNE_H
@@ -0,0 +1,228 @@
+/*
+ * Watchdog for SPI_IOC_MESSAGE ioctls that do not return.
+ *
+ * The transfer loop notes the start and the end of each transaction in a
+ * small ring with relaxed stores. A background thread checks the newest
+ * entry every quarter of the timeout; once a transaction has been in
+ * flight for longer than the timeout, it prints the frame, the settings and
+ * the transactions before it, then acts as configured. The ioctl itself is
+ * never interrupted: a controller that hangs in the kernel usually cannot
+ * be.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#include "watchdog.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define WATCHDOG_DUMP_BYTES 32
+
+struct watchdog_state g_watchdog;
+
+static const struct
+{
+    const char *name;
+    int         signo;
+} s_signals[] = {
+    {"TERM", SIGTERM}, {"INT", SIGINT}, {"KILL", SIGKILL}, {"QUIT", SIGQUIT}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+};
+
+static uint64_t             s_timeout_ns;
+static enum watchdog_action s_action;
+static int                  s_signo;
+static pthread_t            s_thread;
+static int                  s_running = 0;
+static int                  s_stop    = 0;
+
+// Prints the device and its settings in a report.
+static void (*s_describe)(FILE *out) = NULL;
+
+int watchdog_parse_action(const char *spec, enum watchdog_action *action, int *signo)
+{
+    char *end;
+    long  number;
+
+    if (strcmp(spec, "report") == 0)
+    {
+        *action = WATCHDOG_REPORT;
+        return 0;
+    }
+
+    if (strcmp(spec, "abort") == 0)
+    {
+        *action = WATCHDOG_ABORT;
+        return 0;
+    }
+
+    if (strncmp(spec, "SIG", 3) == 0)
+    {
+        spec += 3;
+    }
+
+    for (size_t i = 0; i < sizeof(s_signals) / sizeof(s_signals[0]); i++)
+    {
+        if (strcmp(spec, s_signals[i].name) == 0)
+        {
+            *action = WATCHDOG_SIGNAL;
+            *signo  = s_signals[i].signo;
+            return 0;
+        }
+    }
+
+    number = strtol(spec, &end, 10);
+    if (*spec == '\0' || *end != '\0' || number <= 0 || number >= NSIG)
+    {
+        return -1;
+    }
+
+    *action = WATCHDOG_SIGNAL;
+    *signo  = (int)number;
+    return 0;
+}
+
+static void report(uint64_t seq, const struct watchdog_slot *slot, uint64_t now_ns)
+{
+    const uint8_t *tx  = __atomic_load_n(&slot->tx, __ATOMIC_RELAXED);
+    uint32_t       len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+
+    fprintf(stderr, "\nwatchdog: transaction %" PRIu64 " (frame %u, %u bytes) has not returned after %.1f ms\n", seq,
+            __atomic_load_n(&slot->frame, __ATOMIC_RELAXED), len,
+            (double)(now_ns - __atomic_load_n(&slot->start_ns, __ATOMIC_RELAXED)) / NSEC_PER_MSEC);
+
+    if (s_describe != NULL)
+    {
+        s_describe(stderr);
+    }
+
+    // The loop is blocked in the ioctl, so the buffer holds still.
+    fprintf(stderr, "watchdog: TX:");
+    for (uint32_t i = 0; tx != NULL && i < len && i < WATCHDOG_DUMP_BYTES; i++)
+    {
+        fprintf(stderr, " %02x", tx[i]);
+    }
+    fprintf(stderr, "%s\n", (len > WATCHDOG_DUMP_BYTES) ? " ..." : "");
+
+    fprintf(stderr, "watchdog: before it:\n");
+    for (uint64_t back = (seq > WATCHDOG_HISTORY) ? WATCHDOG_HISTORY - 1 : seq - 1; back > 0; back--)
+    {
+        const struct watchdog_slot *prev     = &g_watchdog.history[(seq - 1 - back) % WATCHDOG_HISTORY];
+        uint64_t                    start_ns = __atomic_load_n(&prev->start_ns, __ATOMIC_RELAXED);
+        uint64_t                    end_ns   = __atomic_load_n(&prev->end_ns, __ATOMIC_RELAXED);
+
+        fprintf(stderr, "  %10" PRIu64 "  frame %6u  %5u bytes  %10.1f us  %.1f ms ago\n", seq - back,
+                __atomic_load_n(&prev->frame, __ATOMIC_RELAXED), __atomic_load_n(&prev->len, __ATOMIC_RELAXED),
+                (double)(end_ns - start_ns) / NSEC_PER_USEC, (double)(now_ns - end_ns) / NSEC_PER_MSEC);
+    }
+    fflush(stderr);
+}
+
+static void *watchdog_thread(void *arg)
+{
+    uint64_t period_us   = s_timeout_ns / NSEC_PER_USEC / 4;
+    uint64_t reported    = 0;
+    uint64_t reported_ns = 0;
+
+    (void)arg;
+
+    if (period_us < 1000 || period_us > 100000)
+    {
+        period_us = (period_us < 1000) ? 1000 : 100000;
+    }
+
+    while (!__atomic_load_n(&s_stop, __ATOMIC_ACQUIRE))
+    {
+        const struct watchdog_slot *slot;
+        uint64_t                    seq;
+        uint64_t                    start_ns;
+        uint64_t                    end_ns;
+        uint64_t                    now_ns;
+
+        usleep((useconds_t)period_us);
+
+        if ((seq = __atomic_load_n(&g_watchdog.seq, __ATOMIC_ACQUIRE)) == 0)
+        {
+            continue;
+        }
+
+        slot     = &g_watchdog.history[(seq - 1) % WATCHDOG_HISTORY];
+        start_ns = __atomic_load_n(&slot->start_ns, __ATOMIC_RELAXED);
+        end_ns   = __atomic_load_n(&slot->end_ns, __ATOMIC_RELAXED);
+        now_ns   = monotonic_ns();
+
+        if (reported != 0 && (seq != reported || end_ns != 0))
+        {
+            const struct watchdog_slot *done = &g_watchdog.history[(reported - 1) % WATCHDOG_HISTORY];
+
+            if (seq - reported < WATCHDOG_HISTORY - 1)
+            {
+                fprintf(stderr, "watchdog: transaction %" PRIu64 " returned after %.1f ms\n", reported,
+                        (double)(__atomic_load_n(&done->end_ns, __ATOMIC_RELAXED) - reported_ns) / NSEC_PER_MSEC);
+            }
+            reported = 0;
+        }
+
+        // If seq moved on meanwhile, the slot may have been reused.
+        if (end_ns != 0 || reported == seq || now_ns - start_ns < s_timeout_ns ||
+            seq != __atomic_load_n(&g_watchdog.seq, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        report(seq, slot, now_ns);
+        reported    = seq;
+        reported_ns = start_ns;
+
+        if (s_action == WATCHDOG_ABORT)
+        {
+            abort();
+        }
+
+        if (s_action == WATCHDOG_SIGNAL)
+        {
+            kill(getpid(), s_signo);
+        }
+    }
+
+    return NULL;
+}
+
+int watchdog_start(uint32_t timeout_ms, enum watchdog_action action, int signo, void (*describe)(FILE *out))
+{
+    sigset_t all;
+    sigset_t old;
+
+    s_timeout_ns = (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    s_action     = action;
+    s_signo      = signo;
+    s_describe   = describe;
+
+    // Signals are for the transfer loop.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    s_running = (pthread_create(&s_thread, NULL, watchdog_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return s_running ? 0 : -1;
+}
+
+void watchdog_stop(void)
+{
+    if (!s_running)
+    {
+        return;
+    }
+
+    __atomic_store_n(&s_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_thread, NULL);
+    s_running = 0;
+}
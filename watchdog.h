@@ -0,0 +1,78 @@
+/*
+ * Watchdog for SPI_IOC_MESSAGE ioctls that do not return.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#ifndef SPIDEV_WATCHDOG_H
+#define SPIDEV_WATCHDOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define WATCHDOG_HISTORY 16
+
+enum watchdog_action
+{
+    WATCHDOG_REPORT, // print the diagnostics and keep waiting
+    WATCHDOG_ABORT,  // print them and abort(), for a core dump
+    WATCHDOG_SIGNAL, // print them and send a signal to the process
+};
+
+/*
+ * One transaction. end_ns is 0 while it is in flight.
+ */
+struct watchdog_slot
+{
+    uint64_t       start_ns;
+    uint64_t       end_ns;
+    const uint8_t *tx;
+    uint32_t       frame;
+    uint32_t       len;
+};
+
+/*
+ * Written by the transfer loop only, read by the watchdog thread. `seq`
+ * counts the transactions started; the last one is in
+ * history[(seq - 1) % WATCHDOG_HISTORY].
+ */
+struct watchdog_state
+{
+    uint64_t             seq;
+    struct watchdog_slot history[WATCHDOG_HISTORY];
+};
+
+extern struct watchdog_state g_watchdog;
+
+static inline void watchdog_begin(uint32_t frame, const uint8_t *tx, uint32_t len, uint64_t start_ns)
+{
+    uint64_t              seq  = __atomic_load_n(&g_watchdog.seq, __ATOMIC_RELAXED);
+    struct watchdog_slot *slot = &g_watchdog.history[seq % WATCHDOG_HISTORY];
+
+    __atomic_store_n(&slot->end_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->start_ns, start_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->tx, tx, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->frame, frame, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_watchdog.seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline void watchdog_end(uint64_t end_ns)
+{
+    uint64_t seq = __atomic_load_n(&g_watchdog.seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&g_watchdog.history[(seq - 1) % WATCHDOG_HISTORY].end_ns, end_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Check every transaction against timeout_ms from a background thread.
+ * `describe` prints the device and its settings as part of the report.
+ * Parses "report", "abort" or a signal name or number into an action.
+ */
+int  watchdog_parse_action(const char *spec, enum watchdog_action *action, int *signo);
+int  watchdog_start(uint32_t timeout_ms, enum watchdog_action action, int signo, void (*describe)(FILE *out));
+void watchdog_stop(void);
+
+#endif // SPIDEV_WATCHDOG_H